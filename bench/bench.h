@@ -0,0 +1,89 @@
+#ifndef MX5METRICSSERVICE_BENCH_H
+#define MX5METRICSSERVICE_BENCH_H
+
+// Benchmark results, one JSON object per line so runs can be kept per commit and compared :
+// {"bench":"decode","case":"201","ops":1000000,"ns_per_op":41.2}
+// {"bench":"e2e","case":"pty_to_shm","ops":2000,"mean_ns":..,"p50_ns":..,"p90_ns":..,"p99_ns":..,"max_ns":..}
+// Lines go to stdout, or are appended to $BENCH_OUTPUT. $BENCH_COMMIT is added to each line when set, then the
+// compiler, build type and C flags the benchmark was built with (set by CMakeLists.txt).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifndef BENCH_COMPILER
+#define BENCH_COMPILER "unknown"
+#endif
+#ifndef BENCH_BUILD_TYPE
+#define BENCH_BUILD_TYPE "unknown"
+#endif
+#ifndef BENCH_FLAGS
+#define BENCH_FLAGS "unknown"
+#endif
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline FILE *bench_output(void) {
+    static FILE *output;
+
+    if (output == NULL) {
+        const char *path = getenv("BENCH_OUTPUT");
+        output = path != NULL ? fopen(path, "a") : NULL;
+        if (output == NULL)
+            output = stdout;
+    }
+
+    return output;
+}
+
+static inline void bench_begin_line(const char *bench, const char *name, uint64_t ops) {
+    const char *commit = getenv("BENCH_COMMIT");
+    FILE *out = bench_output();
+
+    fprintf(out, "{");
+    if (commit != NULL)
+        fprintf(out, "\"commit\":\"%s\",", commit);
+    fprintf(out, "\"compiler\":\"%s\",\"build_type\":\"%s\",\"flags\":\"%s\",",
+            BENCH_COMPILER, BENCH_BUILD_TYPE, BENCH_FLAGS);
+    fprintf(out, "\"bench\":\"%s\",\"case\":\"%s\",\"ops\":%llu", bench, name, (unsigned long long)ops);
+}
+
+static inline void bench_end_line(void) {
+    fprintf(bench_output(), "}\n");
+    fflush(bench_output());
+}
+
+static inline void bench_report(const char *bench, const char *name, uint64_t ops, uint64_t elapsed_ns) {
+    bench_begin_line(bench, name, ops);
+    fprintf(bench_output(), ",\"ns_per_op\":%.2f", ops > 0 ? (double)elapsed_ns / ops : 0);
+    bench_end_line();
+}
+
+static inline int bench_compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts samples
+static inline void bench_report_latency(const char *bench, const char *name, uint64_t *samples_ns, size_t count) {
+    uint64_t sum = 0;
+
+    qsort(samples_ns, count, sizeof(samples_ns[0]), bench_compare_u64);
+    for (size_t i = 0; i < count; i++)
+        sum += samples_ns[i];
+
+    bench_begin_line(bench, name, count);
+    if (count > 0)
+        fprintf(bench_output(), ",\"mean_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu",
+                (unsigned long long)(sum / count), (unsigned long long)samples_ns[count / 2],
+                (unsigned long long)samples_ns[count * 9 / 10], (unsigned long long)samples_ns[count * 99 / 100],
+                (unsigned long long)samples_ns[count - 1]);
+    bench_end_line();
+}
+
+#endif //MX5METRICSSERVICE_BENCH_H
@@ -0,0 +1,99 @@
+// Command handling : handle_command() dispatch and response building, the socket round trip left out.
+// Metrics are populated by decoding two seconds of frames first, so every response is a full one.
+
+#include "bench.h"
+#include "../commands.h"
+#include "../server.h"
+#include "../monotonic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CALLS_COUNT     200000
+#define POPULATE_FRAMES 200 // Per CAN id, 10ms apart
+
+struct bench_case {
+    const char *name;
+    uint8_t req[CMD_REQ_MAX_SIZE];
+    size_t req_len;
+};
+
+static const struct bench_case cases[] = {
+    { "get_metric",           { GET_RPM },                                    1 },
+    { "get_metric_timestamp", { GET_METRIC_TIMESTAMP, GET_RPM },              2 },
+    { "get_fresh_metric",     { GET_FRESH_METRIC, GET_RPM, 0xff, 0xff, 0xff, 0xff }, 6 },
+    { "get_signal_stats",     { GET_SIGNAL_STATS, GET_RPM, 60 },              3 },
+    { "get_batch_8",          { GET_BATCH, GET_RPM, GET_SPEED_KMH, GET_ACCELERATOR_PEDAL_POSITION_PCT,
+                                GET_BRAKES_PCT, GET_FL_SPEED_KMH, GET_FR_SPEED_KMH, GET_RL_SPEED_KMH,
+                                GET_RR_SPEED_KMH },                           9 },
+    { "get_snapshot",         { GET_SNAPSHOT },                               1 },
+    { "get_schema",           { GET_SCHEMA },                                 1 },
+    { "unknown",              { 0x7f },                                       1 }
+};
+
+static void populate_metrics(struct metrics *metrics) {
+    const uint64_t now_ns = monotonic_ns();
+    struct can_msg msg;
+
+    srand(42);
+    for (int i = 0; i < POPULATE_FRAMES; i++) {
+        for (int g = 0; g < METRICS_GROUPS_COUNT; g++) {
+            if (group_defs[g].can_id == 0)
+                continue;
+
+            msg.id = group_defs[g].can_id;
+            msg.timestamp_ns = now_ns - (uint64_t)(POPULATE_FRAMES - i) * 10000000;
+            msg.data = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+            handle_can_msg(&msg, metrics);
+        }
+    }
+}
+
+int main(void) {
+    static uint8_t buf[CMD_RSP_MAX_SIZE];
+    static struct subscriptions subscriptions;
+    const struct loop_stats loop_stats = { 0 };
+    const struct server_stats server_stats = { 0 };
+    struct metrics *metrics = calloc(1, sizeof(*metrics));
+
+    if (metrics == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    init_metrics(metrics);
+    populate_metrics(metrics);
+
+    const struct command_context ctx = {
+        .metrics = metrics,
+        .subscriptions = &subscriptions,
+        .loop_stats = &loop_stats,
+        .server_stats = &server_stats
+    };
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        const struct bench_case *bc = &cases[c];
+        const bool expect_error = bc->req[0] == 0x7f;
+
+        // Make sure the case measures what it's named after
+        handle_command(bc->req, bc->req_len, &ctx, NULL, buf);
+        if ((buf[0] == ERROR) != expect_error) {
+            fprintf(stderr, "%s : unexpected %s response\n", bc->name, command_str(buf[0]));
+            return EXIT_FAILURE;
+        }
+
+        size_t total_len = 0;
+        const uint64_t start = bench_now_ns();
+        for (int i = 0; i < CALLS_COUNT; i++)
+            total_len += handle_command(bc->req, bc->req_len, &ctx, NULL, buf);
+        const uint64_t elapsed = bench_now_ns() - start;
+
+        if (total_len == 0)
+            return EXIT_FAILURE;
+
+        bench_report("command", bc->name, CALLS_COUNT, elapsed);
+    }
+
+    free(metrics);
+    return 0;
+}
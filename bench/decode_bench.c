@@ -0,0 +1,66 @@
+// Frame decoding : handle_can_msg() per CAN id, filters, stats, history and derived signals included.
+
+#include "bench.h"
+#include "../metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FRAMES_COUNT 4096 // Must be a power of 2
+#define ROUNDS       500
+
+static uint64_t data[FRAMES_COUNT];
+
+static int run(struct metrics *metrics, const char *name, uint16_t id) {
+    struct can_msg msg = {
+        .timestamp_ns = bench_now_ns(),
+        .id = id
+    };
+    int failed = 0;
+
+    const uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < (uint64_t)ROUNDS * FRAMES_COUNT; i++) {
+        msg.timestamp_ns += 10000000; // 100hz
+        msg.data = data[i & (FRAMES_COUNT - 1)];
+        failed += handle_can_msg(&msg, metrics) < 0;
+    }
+    const uint64_t elapsed = bench_now_ns() - start;
+
+    if (id != METRICS_MAX_CAN_ID && failed > 0) {
+        fprintf(stderr, "%s : %d frames rejected\n", name, failed);
+        return -1;
+    }
+
+    bench_report("decode", name, (uint64_t)ROUNDS * FRAMES_COUNT, elapsed);
+    return 0;
+}
+
+int main(void) {
+    struct metrics *metrics = calloc(1, sizeof(*metrics));
+    char name[8];
+
+    if (metrics == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    srand(42);
+    for (int i = 0; i < FRAMES_COUNT; i++)
+        data[i] = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+
+    init_metrics(metrics);
+
+    for (int g = 0; g < METRICS_GROUPS_COUNT; g++) {
+        if (group_defs[g].can_id == 0)
+            continue;
+
+        snprintf(name, sizeof(name), "%03x", group_defs[g].can_id);
+        if (run(metrics, name, group_defs[g].can_id) < 0)
+            return EXIT_FAILURE;
+    }
+
+    if (run(metrics, "unknown", METRICS_MAX_CAN_ID) < 0)
+        return EXIT_FAILURE;
+
+    free(metrics);
+    return 0;
+}
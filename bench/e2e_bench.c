@@ -0,0 +1,266 @@
+// End to end latency : the service is started on a pty standing in for the adapter, then frames are written to it one
+// at a time and timed until their rpm is visible, in the shm (pty_to_shm) then through the socket (pty_to_socket).
+// Needs the service's socket and shm names to be free, it's started with its default ones.
+
+#include "bench.h"
+#include "../commands.h"
+#include "../metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SOCKET_NAME        "/tmp/mx5metrics.sock"
+#define SHM_NAME           "/mx5metrics"
+#define CLIENT_SOCKET_NAME "/tmp/mx5metrics-e2e-bench.sock"
+#define SAMPLES_COUNT      2000
+#define STARTUP_TIMEOUT_MS 5000
+#define SAMPLE_TIMEOUT_NS  1000000000ull
+
+struct e2e {
+    int master_fd;
+    int slave_fd;   // Kept open so the pty survives the service closing it
+    pid_t service_pid;
+    const struct metrics *metrics;
+    int socket_fd;
+    uint16_t rpm;   // Last one written
+    uint64_t samples_ns[SAMPLES_COUNT];
+};
+
+static bool service_running(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = SOCKET_NAME };
+    const int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+    const bool running = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return running;
+}
+
+static int open_pty(struct e2e *e2e, char *slave_name, size_t len) {
+    struct termios tty;
+
+    e2e->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (e2e->master_fd < 0 || grantpt(e2e->master_fd) < 0 || unlockpt(e2e->master_fd) < 0 ||
+        ptsname_r(e2e->master_fd, slave_name, len) != 0) {
+        perror("pty");
+        return -1;
+    }
+
+    e2e->slave_fd = open(slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (e2e->slave_fd < 0 || tcgetattr(e2e->slave_fd, &tty) < 0) {
+        perror(slave_name);
+        return -1;
+    }
+    cfmakeraw(&tty);
+    tcsetattr(e2e->slave_fd, TCSANOW, &tty);
+
+    return 0;
+}
+
+static int start_service(struct e2e *e2e, const char *slave_name) {
+    e2e->service_pid = fork();
+    if (e2e->service_pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (e2e->service_pid == 0) {
+        const int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execl(SERVICE_PATH, SERVICE_PATH, "-s", slave_name, "-l", "warn", (char *)NULL);
+        perror(SERVICE_PATH);
+        _exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
+
+static void stop_service(struct e2e *e2e) {
+    if (e2e->service_pid <= 0)
+        return;
+
+    kill(e2e->service_pid, SIGTERM);
+    waitpid(e2e->service_pid, NULL, 0);
+    e2e->service_pid = 0;
+}
+
+// Plays the adapter until the service starts monitoring
+static int answer_startup(struct e2e *e2e) {
+    char cmd[64];
+    size_t len = 0;
+    const uint64_t deadline_ns = bench_now_ns() + STARTUP_TIMEOUT_MS * 1000000ull;
+
+    while (bench_now_ns() < deadline_ns) {
+        struct pollfd pfd = { .fd = e2e->master_fd, .events = POLLIN };
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        char c;
+        if (read(e2e->master_fd, &c, 1) != 1)
+            continue;
+        if (c != '\r') {
+            if (len < sizeof(cmd) - 1)
+                cmd[len++] = c;
+            continue;
+        }
+        cmd[len] = '\0';
+        len = 0;
+
+        const char *rsp;
+        if (strcmp(cmd, "STM") == 0)
+            return 0;
+        else if (strcmp(cmd, "ATZ") == 0)
+            rsp = "\r\rELM327 v1.3a\r\r>";
+        else
+            rsp = "OK\r\r>";
+
+        if (write(e2e->master_fd, rsp, strlen(rsp)) < 0) {
+            perror("write");
+            return -1;
+        }
+    }
+
+    fprintf(stderr, "service didn't start monitoring\n");
+    return -1;
+}
+
+static int open_shm(struct e2e *e2e) {
+    const int fd = shm_open(SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        return -1;
+    }
+
+    e2e->metrics = mmap(NULL, sizeof(struct metrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (e2e->metrics == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    if (e2e->metrics->header.magic != METRICS_SHM_MAGIC) {
+        fprintf(stderr, "shm not published\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_socket(struct e2e *e2e) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = CLIENT_SOCKET_NAME };
+    struct sockaddr_un server_addr = { .sun_family = AF_UNIX, .sun_path = SOCKET_NAME };
+    const struct timeval timeout = { .tv_sec = 1 };
+
+    e2e->socket_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    unlink(CLIENT_SOCKET_NAME);
+    if (e2e->socket_fd < 0 || bind(e2e->socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        connect(e2e->socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+        setsockopt(e2e->socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror(CLIENT_SOCKET_NAME);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Next rpm, never the previous one so each frame is a visible change. Returns when it was written
+static uint64_t write_rpm_frame(struct e2e *e2e) {
+    char frame[32];
+
+    e2e->rpm = e2e->rpm >= 7000 ? 1000 : e2e->rpm + 1;
+    const uint64_t data = (uint64_t)(e2e->rpm * 4) << 48;
+    const int len = snprintf(frame, sizeof(frame), "%03X%016llX\r", CAN_ID_RPM_SPEED_ACCEL, (unsigned long long)data);
+
+    const uint64_t written_ns = bench_now_ns();
+    if (write(e2e->master_fd, frame, len) != len)
+        return 0;
+    return written_ns;
+}
+
+static int bench_shm(struct e2e *e2e) {
+    const struct signal_def *def = &signal_defs[SIGNAL_RPM];
+
+    for (int i = 0; i < SAMPLES_COUNT; i++) {
+        const uint64_t written_ns = write_rpm_frame(e2e);
+        uint16_t rpm = 0;
+        uint64_t timestamp_ns, now_ns;
+
+        do {
+            read_signal(e2e->metrics, def, &rpm, &timestamp_ns);
+            now_ns = bench_now_ns();
+        } while (rpm != e2e->rpm && now_ns - written_ns < SAMPLE_TIMEOUT_NS);
+
+        if (rpm != e2e->rpm) {
+            fprintf(stderr, "pty_to_shm : rpm %u never showed up\n", e2e->rpm);
+            return -1;
+        }
+        e2e->samples_ns[i] = now_ns - written_ns;
+    }
+
+    bench_report_latency("e2e", "pty_to_shm", e2e->samples_ns, SAMPLES_COUNT);
+    return 0;
+}
+
+static int bench_socket(struct e2e *e2e) {
+    const uint8_t req = GET_RPM;
+    uint8_t rsp[CMD_SINGLE_RSP_MAX_SIZE];
+
+    for (int i = 0; i < SAMPLES_COUNT; i++) {
+        const uint64_t written_ns = write_rpm_frame(e2e);
+        uint16_t rpm = 0;
+        uint64_t now_ns;
+
+        do {
+            if (send(e2e->socket_fd, &req, sizeof(req), 0) < 0 || recv(e2e->socket_fd, rsp, sizeof(rsp), 0) < 0) {
+                perror("GET_RPM");
+                return -1;
+            }
+            memcpy(&rpm, rsp + CMD_ID_SIZE, sizeof(rpm));
+            now_ns = bench_now_ns();
+        } while (rpm != e2e->rpm && now_ns - written_ns < SAMPLE_TIMEOUT_NS);
+
+        if (rpm != e2e->rpm) {
+            fprintf(stderr, "pty_to_socket : rpm %u never showed up\n", e2e->rpm);
+            return -1;
+        }
+        e2e->samples_ns[i] = now_ns - written_ns;
+    }
+
+    bench_report_latency("e2e", "pty_to_socket", e2e->samples_ns, SAMPLES_COUNT);
+    return 0;
+}
+
+int main(void) {
+    static struct e2e e2e = { .socket_fd = -1, .rpm = 1000 };
+    char slave_name[64];
+    int ret = EXIT_FAILURE;
+
+    if (service_running()) {
+        fprintf(stderr, "%s is in use, stop the service first\n", SOCKET_NAME);
+        return EXIT_FAILURE;
+    }
+
+    if (open_pty(&e2e, slave_name, sizeof(slave_name)) < 0 || start_service(&e2e, slave_name) < 0)
+        return EXIT_FAILURE;
+
+    if (answer_startup(&e2e) == 0 && open_shm(&e2e) == 0 && open_socket(&e2e) == 0 &&
+        bench_shm(&e2e) == 0 && bench_socket(&e2e) == 0)
+        ret = 0;
+
+    stop_service(&e2e);
+    if (e2e.socket_fd >= 0) {
+        close(e2e.socket_fd);
+        unlink(CLIENT_SOCKET_NAME);
+    }
+
+    return ret;
+}
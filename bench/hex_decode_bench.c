@@ -0,0 +1,75 @@
+// Compares the table driven frame decoder with the previous strtoul/strtoull path
+
+#include "bench.h"
+#include "../hex_decoder.h"
+#include "../stnobd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_LEN    (CAN_ID_STR_LEN + CAN_DATA_STR_LEN)
+#define FRAMES_COUNT 4096
+#define ROUNDS       2000
+
+static char frames[FRAMES_COUNT][FRAME_LEN];
+
+static int decode_strtoul(const char *frame, uint16_t *can_id, uint64_t *can_data) {
+    char can_id_str[CAN_ID_STR_LEN + 1 /* null terminator */] = {0};
+    memcpy(can_id_str, frame, CAN_ID_STR_LEN);
+    *can_id = strtoul(can_id_str, NULL, 16);
+
+    char can_data_str[CAN_DATA_STR_LEN + 1 /* null terminator */] = {0};
+    memcpy(can_data_str, frame + CAN_ID_STR_LEN, CAN_DATA_STR_LEN);
+    *can_data = strtoull(can_data_str, NULL, 16);
+
+    return 0;
+}
+
+static void generate_frames(void) {
+    const uint16_t ids[] = { CAN_ID_BRAKES, CAN_ID_RPM_SPEED_ACCEL, CAN_ID_COOLANT_THROTTLE_INTAKE,
+                             CAN_ID_FUEL_LEVEL, CAN_ID_WHEEL_SPEEDS };
+    char tmp[32];
+
+    srand(42);
+    for (int i = 0; i < FRAMES_COUNT; i++) {
+        uint64_t data = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+        snprintf(tmp, sizeof(tmp), "%03X%016llX", ids[i % 5], (unsigned long long)data);
+        memcpy(frames[i], tmp, FRAME_LEN);
+    }
+}
+
+static void run(const char *name, int (*decode)(const char *, uint16_t *, uint64_t *)) {
+    uint16_t can_id;
+    uint64_t can_data;
+    volatile uint64_t sink = 0;
+
+    const uint64_t start = bench_now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < FRAMES_COUNT; i++) {
+            decode(frames[i], &can_id, &can_data);
+            sink += can_id ^ can_data;
+        }
+    }
+    bench_report("hex_decode", name, (uint64_t)ROUNDS * FRAMES_COUNT, bench_now_ns() - start);
+    (void)sink;
+}
+
+int main(void) {
+    generate_frames();
+
+    // Both decoders must agree before their timings mean anything
+    for (int i = 0; i < FRAMES_COUNT; i++) {
+        uint16_t id_a, id_b;
+        uint64_t data_a, data_b;
+        decode_strtoul(frames[i], &id_a, &data_a);
+        if (decode_hex_frame(frames[i], &id_b, &data_b) < 0 || id_a != id_b || data_a != data_b) {
+            fprintf(stderr, "decoder mismatch on frame %.*s\n", FRAME_LEN, frames[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    run("strtoul", decode_strtoul);
+    run("hex_decoder", decode_hex_frame);
+
+    return 0;
+}
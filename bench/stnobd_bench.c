@@ -0,0 +1,111 @@
+// Monitoring stream parsing : handle_incoming_stnobd_msg() reading frames from a pipe, readv included.
+// The pipe is filled outside of the timed part, then drained by as many calls as the parser needs.
+
+#include "bench.h"
+#include "../stnobd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PIPE_SIZE   (1024 * 1024)
+#define LINES_COUNT (PIPE_SIZE / MONITORING_RSP_LEN)
+#define ROUNDS      50
+#define GARBAGE_ONE_IN 16
+
+static char stream[PIPE_SIZE];
+static size_t stream_len;
+static uint64_t frames;
+static uint64_t sink;
+
+static void count_frame(const struct can_msg *msg, void *arg) {
+    (void)arg;
+    frames++;
+    sink += msg->id ^ msg->data;
+}
+
+// Every garbage_one_in lines (0 for none) is a misaligned line of junk instead of a frame
+static void generate_stream(int garbage_one_in) {
+    const uint16_t ids[] = { CAN_ID_BRAKES, CAN_ID_RPM_SPEED_ACCEL, CAN_ID_COOLANT_THROTTLE_INTAKE,
+                             CAN_ID_FUEL_LEVEL, CAN_ID_WHEEL_SPEEDS };
+    char line[32];
+
+    srand(42);
+    stream_len = 0;
+    for (int i = 0; i < LINES_COUNT; i++) {
+        if (garbage_one_in > 0 && i % garbage_one_in == 0) {
+            const int len = 1 + rand() % (MONITORING_RSP_LEN - 2);
+            for (int c = 0; c < len; c++)
+                line[c] = 'G' + rand() % 20;
+            line[len] = '\r';
+            memcpy(stream + stream_len, line, len + 1);
+            stream_len += len + 1;
+            continue;
+        }
+
+        const uint64_t data = ((uint64_t)rand() << 32) ^ (uint64_t)rand();
+        snprintf(line, sizeof(line), "%03X%016llX\r", ids[i % 5], (unsigned long long)data);
+        memcpy(stream + stream_len, line, MONITORING_RSP_LEN);
+        stream_len += MONITORING_RSP_LEN;
+    }
+}
+
+static int run(const char *name, int garbage_one_in) {
+    static struct stnobd_context ctx;
+    int fds[2];
+
+    generate_stream(garbage_one_in);
+
+    if (pipe2(fds, O_NONBLOCK) < 0 || fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE) < PIPE_SIZE) {
+        perror("pipe");
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fd = fds[0];
+    ctx.state = STNOBD_STATE_MONITORING;
+    ctx.handler = count_frame;
+
+    uint64_t elapsed = 0;
+    uint64_t lines = 0;
+    frames = 0;
+
+    for (int r = 0; r < ROUNDS; r++) {
+        if (write(fds[1], stream, stream_len) != (ssize_t)stream_len) {
+            perror("write");
+            return -1;
+        }
+
+        const size_t end = ctx.mon_head + stream_len;
+        const uint64_t start = bench_now_ns();
+        while (ctx.mon_head != end) {
+            if (handle_incoming_stnobd_msg(&ctx) < 0)
+                return -1;
+        }
+        elapsed += bench_now_ns() - start;
+        lines += LINES_COUNT;
+    }
+
+    // Every valid frame must have made it through, resyncing included
+    const uint64_t expected = (uint64_t)ROUNDS * (LINES_COUNT - (garbage_one_in > 0 ? (LINES_COUNT + garbage_one_in - 1) / garbage_one_in : 0));
+    if (frames != expected) {
+        fprintf(stderr, "%s : %llu frames parsed, expected %llu\n", name, (unsigned long long)frames,
+                (unsigned long long)expected);
+        return -1;
+    }
+
+    bench_report("stnobd_monitoring", name, lines, elapsed);
+
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+int main(void) {
+    if (run("clean", 0) < 0 || run("resync", GARBAGE_ONE_IN) < 0)
+        return EXIT_FAILURE;
+
+    (void)sink;
+    return 0;
+}
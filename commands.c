@@ -3,129 +3,729 @@
 //
 
 #include "commands.h"
+#include "monotonic.h"
+#include "stats.h"
+#include "server.h"
+#include "connections.h"
+#include "notify.h"
+#include "recorder.h"
+#include "latency.h"
+#include "log.h"
 #include <assert.h>
 #include <string.h>
+#include <time.h>
 
 static const char unknown_cmd_id_msg[] = "unknown cmd";
+static const char no_ingest_thread_msg[] = "ingest thread disabled";
+static const char missing_args_msg[] = "missing args";
+static const char unknown_metric_msg[] = "unknown metric";
+static const char stale_metric_msg[] = "stale";
+static const char no_stats_msg[] = "no stats";
+static const char not_batchable_msg[] = "not batchable";
+static const char unbound_client_msg[] = "unbound client";
+static const char no_subscriber_slot_msg[] = "too many subscribers";
+static const char not_subscribed_msg[] = "not subscribed";
+static const char invalid_log_level_msg[] = "invalid log level";
+static const char connection_only_msg[] = "connection only";
+static const char hello_first_msg[] = "hello first";
+static const char already_negotiated_msg[] = "already negotiated";
+static const char unsupported_version_msg[] = "unsupported version";
+static const char not_negotiated_msg[] = "capability not negotiated";
+static const char no_groups_msg[] = "no groups";
+static const char no_notify_fd_msg[] = "no notify fd";
+static const char no_recorder_msg[] = "not recording";
+static const char unknown_stage_msg[] = "unknown stage";
+
+// A replay faster than recorded stamps frames ahead of the clock (see replay.h), those are brand new
+static uint64_t metric_age_ns(uint64_t timestamp_ns)
+{
+    const uint64_t now = monotonic_ns();
+    return now > timestamp_ns ? now - timestamp_ns : 0;
+}
 
 static int get_command_response(uint8_t cmd_id, const void *val, int val_len, uint8_t *buf)
 {
-    assert(val_len <= CMD_RSP_MAX_SIZE - CMD_ID_SIZE);
+    assert(val_len <= CMD_SINGLE_RSP_MAX_SIZE - CMD_ID_SIZE);
     buf[0] = cmd_id;
     memcpy(buf + 1, val, val_len);
     return val_len + 1;
 }
 
-size_t handle_command(uint8_t cmd_id, const struct metrics *metrics, uint8_t *buf)
+static int get_ingest_stats_response(const struct command_context *ctx, uint8_t *buf)
+{
+    struct ingest_stats stats;
+
+    if (ctx->ingest_thread == NULL)
+        return get_command_response(
+                ERROR,
+                no_ingest_thread_msg, strlen(no_ingest_thread_msg), buf);
+
+    get_ingest_stats(ctx->ingest_thread, &stats);
+
+    return get_command_response(GET_INGEST_STATS, &stats, sizeof(stats), buf);
+}
+
+// Returns 0 if cmd_id isn't a metric
+static size_t get_metric_response(uint8_t cmd_id, const struct metrics *metrics, uint8_t *buf,
+                                  uint64_t *timestamp_ns)
+{
+    const struct signal_def *def = get_signal_def(cmd_id);
+    if (def == NULL)
+        return 0;
+
+    buf[0] = cmd_id;
+    return CMD_ID_SIZE + read_signal(metrics, def, buf + CMD_ID_SIZE, timestamp_ns);
+}
+
+static size_t get_error_response(const char *msg, uint8_t *buf)
+{
+    return get_command_response(ERROR, msg, strlen(msg), buf);
+}
+
+static size_t get_timestamp_response(const uint8_t *req, size_t req_len,
+                                     const struct metrics *metrics, uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1
+    // cmd id | metric cmd id
+    //
+    // Response bytes :
+    // 0      | 1-8                   | 9-16
+    // cmd id | timestamp ns (uint64) | age ns (uint64)
+    // Timestamps are CLOCK_MONOTONIC, 0 if the metric was never received
+
+    uint64_t rsp[2];
+
+    if (req_len < 2)
+        return get_error_response(missing_args_msg, buf);
+
+    if (get_metric_response(req[1], metrics, buf, &rsp[0]) == 0)
+        return get_error_response(unknown_metric_msg, buf);
+
+    rsp[1] = rsp[0] > 0 ? metric_age_ns(rsp[0]) : 0;
+
+    return get_command_response(GET_METRIC_TIMESTAMP, rsp, sizeof(rsp), buf);
+}
+
+static size_t get_fresh_metric_response(const uint8_t *req, size_t req_len,
+                                        const struct metrics *metrics, uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1             | 2-5
+    // cmd id | metric cmd id | max age ms (uint32)
+    //
+    // Response is the same as the metric cmd's own response,
+    // or an error if the metric is older than max age
+
+    uint32_t max_age_ms;
+    uint64_t timestamp_ns;
+
+    if (req_len < 2 + sizeof(max_age_ms))
+        return get_error_response(missing_args_msg, buf);
+
+    memcpy(&max_age_ms, req + 2, sizeof(max_age_ms));
+
+    const size_t rsp_len = get_metric_response(req[1], metrics, buf, &timestamp_ns);
+
+    if (rsp_len == 0)
+        return get_error_response(unknown_metric_msg, buf);
+
+    if (timestamp_ns == 0 || metric_age_ns(timestamp_ns) > (uint64_t)max_age_ms * 1000000)
+        return get_error_response(stale_metric_msg, buf);
+
+    return rsp_len;
+}
+
+static size_t get_signal_stats_response(const uint8_t *req, size_t req_len, uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1             | 2
+    // cmd id | metric cmd id | window s (1, 10 or 60)
+    //
+    // Response bytes :
+    // 0      | 1-4            | 5-8 | 9-12 | 13-16 | 17-20 | 21-24 | 25-28
+    // cmd id | count (uint32) | min | max  | mean  | p50   | p95   | p99
+    // Values are int32 in the metric's unit, all 0 if count is 0
+
+    struct signal_stats stats;
+
+    if (req_len < 3)
+        return get_error_response(missing_args_msg, buf);
+
+    const struct signal_def *def = get_signal_def(req[1]);
+    if (def == NULL)
+        return get_error_response(unknown_metric_msg, buf);
+
+    if (get_signal_stats(def - signal_defs, req[2], &stats) < 0)
+        return get_error_response(no_stats_msg, buf);
+
+    return get_command_response(GET_SIGNAL_STATS, &stats, sizeof(stats), buf);
+}
+
+static size_t get_batch_response(const uint8_t *req, size_t req_len, const struct command_context *ctx,
+                                 const struct command_client *client, uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1 up to CMD_REQ_MAX_SIZE
+    // cmd id | cmd ids, one byte each, of commands without args
+    //
+    // Response bytes (CMD_BATCH_VERSION 1) :
+    // 0      | 1       | 2     | 3 ...
+    // cmd id | version | count | count times : response len (uint8) | response
+    // Responses are in request order, each one exactly what its cmd would return alone (errors included)
+
+    size_t len = 3;
+
+    buf[0] = GET_BATCH;
+    buf[1] = CMD_BATCH_VERSION;
+    buf[2] = req_len - CMD_ID_SIZE;
+
+    for (size_t i = CMD_ID_SIZE; i < req_len; i++) {
+        uint8_t *rsp = buf + len + 1;
+        size_t rsp_len;
+
+        if (req[i] == GET_BATCH || req[i] == GET_SNAPSHOT || req[i] == GET_SCHEMA || req[i] == GET_LATENCY_STATS)
+            rsp_len = get_error_response(not_batchable_msg, rsp);
+        else
+            rsp_len = handle_command(&req[i], CMD_ID_SIZE, ctx, client, rsp);
+
+        assert(rsp_len <= CMD_SINGLE_RSP_MAX_SIZE);
+        buf[len] = rsp_len;
+        len += 1 + rsp_len;
+    }
+
+    return len;
+}
+
+static size_t get_snapshot_response(const struct metrics *metrics, uint8_t *buf)
+{
+    // Response bytes (CMD_SNAPSHOT_VERSION 1) :
+    // 0      | 1       | 2            | 3             | 4 ...
+    // cmd id | version | groups count | signals count | groups count times : timestamp ns (uint64)
+    //                                                 | then signals count times : metric cmd id | group index | value (int32)
+    // All values come from the same instant. Groups are in shm order, a signal's timestamp is its group's,
+    // 0 if the group was never received. Values are in the metric's unit, sign extended.
+
+    struct metrics_snapshot snapshot;
+    size_t len = 4;
+
+    read_snapshot(metrics, &snapshot);
+
+    buf[0] = GET_SNAPSHOT;
+    buf[1] = CMD_SNAPSHOT_VERSION;
+    buf[2] = METRICS_GROUPS_COUNT;
+    buf[3] = METRICS_SIGNALS_COUNT;
+
+    memcpy(buf + len, snapshot.timestamps_ns, sizeof(snapshot.timestamps_ns));
+    len += sizeof(snapshot.timestamps_ns);
+
+    for (int i = 0; i < METRICS_SIGNALS_COUNT; i++) {
+        buf[len++] = signal_defs[i].cmd_id;
+        buf[len++] = signal_defs[i].group;
+        memcpy(buf + len, &snapshot.values[i], sizeof(snapshot.values[i]));
+        len += sizeof(snapshot.values[i]);
+    }
+
+    return len;
+}
+
+static_assert(4 + METRICS_GROUPS_COUNT * sizeof(uint64_t) + METRICS_SIGNALS_COUNT * (2 + sizeof(int32_t))
+              <= CMD_RSP_MAX_SIZE, "snapshot doesn't fit in a response");
+
+static size_t put_schema_str(const char *str, uint8_t *buf)
+{
+    const size_t len = strlen(str);
+
+    buf[0] = len;
+    memcpy(buf + 1, str, len);
+    return 1 + len;
+}
+
+static size_t get_schema_response(const struct metrics *metrics, uint8_t *buf)
+{
+    // Response bytes (version is METRICS_SHM_VERSION) :
+    // 0      | 1       | 2            | 3             | 4-7
+    // cmd id | version | groups count | signals count | shm size (uint32)
+    // then groups count times :
+    // name len | name | shm offset (uint32) | size (uint32) | can id (uint16) | rate hz (uint16)
+    // then signals count times :
+    // cmd id | group index | size | is signed | shm offset (uint32) | history offset (uint32) | min (int32) | max (int32)
+    // | scale mul (int32) | scale div (int32) | name len | name | unit len | unit
+    // Same content as the shm schema block (see metrics.h), names aren't NUL terminated.
+    // Not batchable, the offsets only change with the version : resolve them once then read the shm directly.
+
+    const struct metrics_schema *schema = &metrics->schema;
+    size_t len = 8;
+
+    buf[0] = GET_SCHEMA;
+    buf[1] = metrics->header.version;
+    buf[2] = schema->groups_count;
+    buf[3] = schema->signals_count;
+    memcpy(buf + 4, &metrics->header.size, sizeof(metrics->header.size));
+
+    for (uint32_t g = 0; g < schema->groups_count; g++) {
+        const struct metrics_schema_group *group = &schema->groups[g];
+
+        len += put_schema_str(group->name, buf + len);
+        memcpy(buf + len, &group->shm_offset, sizeof(group->shm_offset));
+        len += sizeof(group->shm_offset);
+        memcpy(buf + len, &group->size, sizeof(group->size));
+        len += sizeof(group->size);
+        memcpy(buf + len, &group->can_id, sizeof(group->can_id));
+        len += sizeof(group->can_id);
+        memcpy(buf + len, &group->rate_hz, sizeof(group->rate_hz));
+        len += sizeof(group->rate_hz);
+    }
+
+    for (uint32_t i = 0; i < schema->signals_count; i++) {
+        const struct metrics_schema_signal *signal = &schema->signals[i];
+
+        buf[len++] = signal->cmd_id;
+        buf[len++] = signal->group;
+        buf[len++] = signal->size;
+        buf[len++] = signal->is_signed;
+        memcpy(buf + len, &signal->shm_offset, sizeof(signal->shm_offset));
+        len += sizeof(signal->shm_offset);
+        memcpy(buf + len, &signal->history_offset, sizeof(signal->history_offset));
+        len += sizeof(signal->history_offset);
+        memcpy(buf + len, &signal->min, sizeof(signal->min));
+        len += sizeof(signal->min);
+        memcpy(buf + len, &signal->max, sizeof(signal->max));
+        len += sizeof(signal->max);
+        memcpy(buf + len, &signal->scale_mul, sizeof(signal->scale_mul));
+        len += sizeof(signal->scale_mul);
+        memcpy(buf + len, &signal->scale_div, sizeof(signal->scale_div));
+        len += sizeof(signal->scale_div);
+        len += put_schema_str(signal->name, buf + len);
+        len += put_schema_str(signal->unit, buf + len);
+    }
+
+    return len;
+}
+
+// sizeof a string literal counts its NUL, standing for the len byte
+#define SCHEMA_GROUP_RSP_SIZE(group, ...) + sizeof(#group) + 12
+#define SCHEMA_SIGNAL_RSP_SIZE(group, name, NAME, cmd_id, type, unit, ...) + 28 + sizeof(#name) + sizeof(unit)
+
+static_assert(8 METRICS_GROUPS(SCHEMA_GROUP_RSP_SIZE) METRICS_SIGNALS(SCHEMA_SIGNAL_RSP_SIZE) <= CMD_RSP_MAX_SIZE,
+              "schema doesn't fit in a response");
+
+static size_t get_subscribe_response(const uint8_t *req, size_t req_len, const struct command_context *ctx,
+                                     const struct command_client *client, uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1-2                  | 3 ...
+    // cmd id | max rate hz (uint16) | metric cmd ids, one byte each
+    // A max rate of 0 sends every change. Replaces the client's previous subscription and renews its lease.
+    //
+    // Response bytes :
+    // 0      | 1                      | 2-3
+    // cmd id | metrics count (uint8)  | lease s (uint16, 0 for none)
+    //
+    // Then SUBSCRIPTION_UPDATE datagrams are sent to the client's address, see subscriptions.c.
+    // The client must bind its socket and subscribe again before the lease ends.
+    // Connection clients need CONNECTION_CAP_SUBSCRIPTIONS, get the updates on the connection and have no lease.
+
+    uint16_t max_rate_hz;
+    uint64_t signals = 0;
+    const struct connection *conn = client != NULL ? client->connection : NULL;
+
+    if (conn != NULL && !(conn->capabilities & CONNECTION_CAP_SUBSCRIPTIONS))
+        return get_error_response(not_negotiated_msg, buf);
+
+    if (conn == NULL && (client == NULL || client->addr_len <= sizeof(sa_family_t)))
+        return get_error_response(unbound_client_msg, buf);
+
+    if (req_len < 3 + 1)
+        return get_error_response(missing_args_msg, buf);
+
+    memcpy(&max_rate_hz, req + 1, sizeof(max_rate_hz));
+
+    for (size_t i = 3; i < req_len; i++) {
+        const struct signal_def *def = get_signal_def(req[i]);
+        if (def == NULL)
+            return get_error_response(unknown_metric_msg, buf);
+        signals |= 1ULL << (def - signal_defs);
+    }
+
+    if (subscribe(ctx->subscriptions, conn != NULL ? conn->fd : -1, client->addr, client->addr_len,
+                  signals, max_rate_hz) < 0)
+        return get_error_response(no_subscriber_slot_msg, buf);
+
+    const uint8_t count = __builtin_popcountll(signals);
+    const uint16_t lease_s = conn != NULL ? 0 : SUBSCRIPTION_LEASE_S;
+
+    buf[0] = SUBSCRIBE;
+    buf[1] = count;
+    memcpy(buf + 2, &lease_s, sizeof(lease_s));
+
+    return 2 + sizeof(lease_s);
+}
+
+static size_t get_unsubscribe_response(const struct command_context *ctx, const struct command_client *client,
+                                       uint8_t *buf)
+{
+    if (client == NULL ||
+        unsubscribe(ctx->subscriptions, client->connection != NULL ? client->connection->fd : -1,
+                    client->addr, client->addr_len) < 0)
+        return get_error_response(not_subscribed_msg, buf);
+
+    buf[0] = UNSUBSCRIBE;
+    return CMD_ID_SIZE;
+}
+
+static size_t get_set_log_level_response(const uint8_t *req, size_t req_len, uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1                                      | 2
+    // cmd id | log module (enum log_module, 0xff all) | level (enum log_level)
+    //
+    // Response bytes :
+    // 0
+    // cmd id
+
+    if (req_len < 3)
+        return get_error_response(missing_args_msg, buf);
+
+    if (set_log_level(req[1], req[2]) < 0)
+        return get_error_response(invalid_log_level_msg, buf);
+
+    buf[0] = SET_LOG_LEVEL;
+    return CMD_ID_SIZE;
+}
+
+static size_t get_hello_response(const uint8_t *req, size_t req_len, const struct command_client *client,
+                                 uint8_t *buf)
 {
+    // Request bytes :
+    // 0      | 1                        | 2-5
+    // cmd id | protocol version (uint8) | capabilities wanted (uint32, CONNECTION_CAP_*)
+    //
     // Response bytes :
-    // 0      | 1 up to RSP_BUFFER_SIZE
+    // 0      | 1                | 2-5                             | 6-9                    | 10-11
+    // cmd id | version (uint8) | capabilities granted (uint32) | connection id (uint32) | max request size (uint16)
+    // The version is the highest both sides speak. Once per connection, before any other command.
+
+    struct connection *conn = client != NULL ? client->connection : NULL;
+    uint32_t capabilities;
+
+    if (conn == NULL)
+        return get_error_response(connection_only_msg, buf);
+
+    if (conn->negotiated)
+        return get_error_response(already_negotiated_msg, buf);
+
+    if (req_len < 2 + sizeof(capabilities))
+        return get_error_response(missing_args_msg, buf);
+
+    if (req[1] == 0)
+        return get_error_response(unsupported_version_msg, buf);
+
+    memcpy(&capabilities, req + 2, sizeof(capabilities));
+
+    conn->version = req[1] < CONNECTION_PROTOCOL_VERSION ? req[1] : CONNECTION_PROTOCOL_VERSION;
+    conn->capabilities = capabilities & CONNECTION_CAPS;
+    conn->negotiated = true;
+
+    const uint16_t max_req_size = CMD_REQ_MAX_SIZE;
+    size_t len = 1;
+
+    buf[0] = HELLO;
+    buf[len++] = conn->version;
+    memcpy(buf + len, &conn->capabilities, sizeof(conn->capabilities));
+    len += sizeof(conn->capabilities);
+    memcpy(buf + len, &conn->id, sizeof(conn->id));
+    len += sizeof(conn->id);
+    memcpy(buf + len, &max_req_size, sizeof(max_req_size));
+    len += sizeof(max_req_size);
+
+    return len;
+}
+
+static size_t get_connection_info_response(const struct command_client *client, uint8_t *buf)
+{
+    // Response bytes :
+    // 0      | 1-4                    | 5               | 6-9                   | 10-17
+    // cmd id | connection id (uint32) | version (uint8) | capabilities (uint32) | connected for ns (uint64)
+    // 18-25             | 26-33
+    // requests (uint64) | errors (uint64), this request included
+
+    const struct connection *conn = client != NULL ? client->connection : NULL;
+    const uint64_t connected_for_ns = conn != NULL ? monotonic_ns() - conn->connected_ns : 0;
+    size_t len = 1;
+
+    if (conn == NULL)
+        return get_error_response(connection_only_msg, buf);
+
+    buf[0] = GET_CONNECTION_INFO;
+    memcpy(buf + len, &conn->id, sizeof(conn->id));
+    len += sizeof(conn->id);
+    buf[len++] = conn->version;
+    memcpy(buf + len, &conn->capabilities, sizeof(conn->capabilities));
+    len += sizeof(conn->capabilities);
+    memcpy(buf + len, &connected_for_ns, sizeof(connected_for_ns));
+    len += sizeof(connected_for_ns);
+    memcpy(buf + len, &conn->requests, sizeof(conn->requests));
+    len += sizeof(conn->requests);
+    memcpy(buf + len, &conn->errors, sizeof(conn->errors));
+    len += sizeof(conn->errors);
+
+    return len;
+}
+
+static size_t get_notify_fd_response(const uint8_t *req, size_t req_len, const struct command_client *client,
+                                     uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1-4
+    // cmd id | groups mask (uint32, bit per group index, see GET_SCHEMA)
+    //
+    // Response bytes :
+    // 0      | 1-4
+    // cmd id | groups mask, the unknown groups left out
+    // along with an eventfd (SCM_RIGHTS) signaled after updates of those groups. Needs CONNECTION_CAP_NOTIFY,
+    // asking again changes the groups and passes the same eventfd again.
+
+    struct connection *conn = client != NULL ? client->connection : NULL;
+    uint32_t groups;
+
+    if (conn == NULL)
+        return get_error_response(connection_only_msg, buf);
+
+    if (!(conn->capabilities & CONNECTION_CAP_NOTIFY))
+        return get_error_response(not_negotiated_msg, buf);
+
+    if (req_len < CMD_ID_SIZE + sizeof(groups))
+        return get_error_response(missing_args_msg, buf);
+
+    memcpy(&groups, req + 1, sizeof(groups));
+    groups &= METRICS_ALL_GROUPS;
+    if (groups == 0)
+        return get_error_response(no_groups_msg, buf);
+
+    if (set_connection_notify(conn, groups) < 0)
+        return get_error_response(no_notify_fd_msg, buf);
+
+    return get_command_response(GET_NOTIFY_FD, &groups, sizeof(groups), buf);
+}
+
+static size_t get_recorder_stats_response(const struct command_context *ctx, uint8_t *buf)
+{
+    struct recorder_stats stats;
+
+    if (ctx->recorder == NULL)
+        return get_error_response(no_recorder_msg, buf);
+
+    get_recorder_stats(ctx->recorder, &stats);
+
+    return get_command_response(GET_RECORDER_STATS, &stats, sizeof(stats), buf);
+}
+
+static size_t get_latency_stats_response(const uint8_t *req, size_t req_len, uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1 (optional)
+    // cmd id | stage (enum latency_stage)
+    //
+    // Response bytes, without a stage :
+    // 0      | 1            | 2 ...
+    // cmd id | stages count | stages count times : struct latency_summary
+    //
+    // Response bytes, with a stage (its histogram) :
+    // 0      | 1     | 2               | 3-4                   | 5-12           | 13-20           | 21-28
+    // cmd id | stage | sub bucket bits | buckets count (uint16) | count (uint64) | sum ns (uint64) | max ns (uint64)
+    // | buckets count times : samples (uint32)
+    // Buckets are log-linear (see latency.h), those after the last non empty one are left out.
+    // Not batchable.
+
+    size_t len = 2;
+
+    buf[0] = GET_LATENCY_STATS;
+
+    if (req_len < 2) {
+        buf[1] = LATENCY_STAGES_COUNT;
+        for (int s = 0; s < LATENCY_STAGES_COUNT; s++) {
+            struct latency_summary summary;
+            get_latency_summary(s, &summary);
+            memcpy(buf + len, &summary, sizeof(summary));
+            len += sizeof(summary);
+        }
+        return len;
+    }
+
+    if (req[1] >= LATENCY_STAGES_COUNT)
+        return get_error_response(unknown_stage_msg, buf);
+
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint64_t totals[3];
+
+    const uint16_t buckets_count = get_latency_histogram(req[1], &totals[0], &totals[1], &totals[2], buckets);
+
+    buf[1] = req[1];
+    buf[2] = LATENCY_SUB_BUCKET_BITS;
+    memcpy(buf + 3, &buckets_count, sizeof(buckets_count));
+    memcpy(buf + 5, totals, sizeof(totals));
+    memcpy(buf + 29, buckets, buckets_count * sizeof(buckets[0]));
+    return 29 + buckets_count * sizeof(buckets[0]);
+}
+
+static_assert(2 + LATENCY_STAGES_COUNT * sizeof(struct latency_summary) <= CMD_RSP_MAX_SIZE
+              && 29 + LATENCY_BUCKETS * sizeof(uint32_t) <= CMD_RSP_MAX_SIZE,
+              "latency stats don't fit in a response");
+
+static size_t get_reset_latency_stats_response(uint8_t *buf)
+{
+    // Response bytes :
+    // 0
+    // cmd id
+
+    reset_latency_histograms();
+
+    buf[0] = RESET_LATENCY_STATS;
+    return CMD_ID_SIZE;
+}
+
+static size_t get_loop_stats_response(const struct command_context *ctx, uint8_t *buf)
+{
+    // Response bytes :
+    // 0      | 1                  | 25
+    // cmd id | struct loop_stats | struct server_stats
+
+    buf[0] = GET_LOOP_STATS;
+    memcpy(buf + CMD_ID_SIZE, ctx->loop_stats, sizeof(*ctx->loop_stats));
+    memcpy(buf + CMD_ID_SIZE + sizeof(*ctx->loop_stats), ctx->server_stats, sizeof(*ctx->server_stats));
+    return CMD_ID_SIZE + sizeof(*ctx->loop_stats) + sizeof(*ctx->server_stats);
+}
+
+static_assert(CMD_ID_SIZE + sizeof(struct loop_stats) + sizeof(struct server_stats) <= CMD_SINGLE_RSP_MAX_SIZE,
+              "loop stats don't fit in a response");
+
+size_t handle_command(const uint8_t *req, size_t req_len, const struct command_context *ctx,
+                      const struct command_client *client, uint8_t *buf)
+{
+    // Request bytes :
+    // 0      | 1 up to CMD_REQ_MAX_SIZE
+    // cmd id | args
+    //
+    // Response bytes :
+    // 0      | 1 up to CMD_RSP_MAX_SIZE
     // cmd id | msg
     // On error : msg is ascii
 
+    assert(req_len >= CMD_ID_SIZE);
+    const uint8_t cmd_id = req[0];
+
+    if (client != NULL && client->connection != NULL && !client->connection->negotiated && cmd_id != HELLO)
+        return get_error_response(hello_first_msg, buf);
+
     switch (cmd_id) {
-        case GET_RPM:
-            return get_command_response(
-                    GET_RPM,
-                    &metrics->rpm, sizeof(metrics->rpm), buf);
-
-        case GET_SPEED_KMH:
-            return get_command_response(
-                    GET_SPEED_KMH,
-                    &metrics->speed_kmh, sizeof(metrics->speed_kmh), buf);
-
-        case GET_ACCELERATOR_PEDAL_POSITION_PCT:
-            return get_command_response(
-                    GET_ACCELERATOR_PEDAL_POSITION_PCT,
-                    &metrics->accelerator_pedal_position_pct, sizeof(metrics->accelerator_pedal_position_pct), buf);
-
-        case GET_CALCULATED_ENGINE_LOAD_PCT:
-            return get_command_response(
-                    GET_CALCULATED_ENGINE_LOAD_PCT,
-                    &metrics->calculated_engine_load_pct, sizeof(metrics->calculated_engine_load_pct), buf);
-
-        case GET_ENGINE_COOLANT_TEMP_C:
-            return get_command_response(
-                    GET_ENGINE_COOLANT_TEMP_C,
-                    &metrics->engine_coolant_temp_c, sizeof(metrics->engine_coolant_temp_c), buf);
-
-        case GET_THROTTLE_VALVE_POSITION_PCT:
-            return get_command_response(
-                    GET_THROTTLE_VALVE_POSITION_PCT,
-                    &metrics->throttle_valve_position_pct, sizeof(metrics->throttle_valve_position_pct), buf);
-
-        case GET_INTAKE_AIR_TEMP_C:
-            return get_command_response(
-                    GET_INTAKE_AIR_TEMP_C,
-                    &metrics->intake_air_temp_c, sizeof(metrics->intake_air_temp_c), buf);
-
-        case GET_FUEL_LEVEL_PCT:
-            return get_command_response(
-                    GET_FUEL_LEVEL_PCT,
-                    &metrics->fuel_level_pct, sizeof(metrics->fuel_level_pct), buf);
-
-        case GET_BRAKES_PCT:
-            return get_command_response(
-                    GET_BRAKES_PCT,
-                    &metrics->brakes_pct, sizeof(metrics->brakes_pct), buf);
-
-        case GET_FL_SPEED_KMH:
-            return get_command_response(
-                    GET_FL_SPEED_KMH,
-                    &metrics->fl_speed_kmh, sizeof(metrics->fl_speed_kmh), buf);
-
-        case GET_FR_SPEED_KMH:
-            return get_command_response(
-                    GET_FR_SPEED_KMH,
-                    &metrics->fr_speed_kmh, sizeof(metrics->fr_speed_kmh), buf);
-
-        case GET_RL_SPEED_KMH:
-            return get_command_response(
-                    GET_RL_SPEED_KMH,
-                    &metrics->rl_speed_kmh, sizeof(metrics->rl_speed_kmh), buf);
-
-        case GET_RR_SPEED_KMH:
-            return get_command_response(
-                    GET_RR_SPEED_KMH,
-                    &metrics->rr_speed_kmh, sizeof(metrics->rr_speed_kmh), buf);
+        case GET_METRIC_TIMESTAMP:
+            return get_timestamp_response(req, req_len, ctx->metrics, buf);
 
-        default:
-            return get_command_response(
-                    ERROR,
-                    unknown_cmd_id_msg, strlen(unknown_cmd_id_msg), buf);
+        case GET_FRESH_METRIC:
+            return get_fresh_metric_response(req, req_len, ctx->metrics, buf);
+
+        case GET_INGEST_STATS:
+            return get_ingest_stats_response(ctx, buf);
+
+        case GET_SIGNAL_STATS:
+            return get_signal_stats_response(req, req_len, buf);
+
+        case GET_BATCH:
+            return get_batch_response(req, req_len, ctx, client, buf);
+
+        case GET_SNAPSHOT:
+            return get_snapshot_response(ctx->metrics, buf);
+
+        case SUBSCRIBE:
+            return get_subscribe_response(req, req_len, ctx, client, buf);
+
+        case UNSUBSCRIBE:
+            return get_unsubscribe_response(ctx, client, buf);
+
+        case SET_LOG_LEVEL:
+            return get_set_log_level_response(req, req_len, buf);
+
+        case GET_LOOP_STATS:
+            return get_loop_stats_response(ctx, buf);
+
+        case HELLO:
+            return get_hello_response(req, req_len, client, buf);
+
+        case GET_CONNECTION_INFO:
+            return get_connection_info_response(client, buf);
+
+        case GET_SCHEMA:
+            return get_schema_response(ctx->metrics, buf);
+
+        case GET_NOTIFY_FD:
+            return get_notify_fd_response(req, req_len, client, buf);
+
+        case GET_RECORDER_STATS:
+            return get_recorder_stats_response(ctx, buf);
+
+        case GET_LATENCY_STATS:
+            return get_latency_stats_response(req, req_len, buf);
+
+        case RESET_LATENCY_STATS:
+            return get_reset_latency_stats_response(buf);
+
+        default: {
+            uint64_t timestamp_ns;
+            const size_t rsp_len = get_metric_response(cmd_id, ctx->metrics, buf, &timestamp_ns);
+            if (rsp_len > 0)
+                return rsp_len;
+
+            return get_error_response(unknown_cmd_id_msg, buf);
+        }
     }
 }
 
+#define METRIC_COMMAND_STR(group, name, NAME, ...) \
+        case GET_##NAME:                          \
+            return "GET_" #NAME;
+
 const char* command_str(enum command cmd) {
     switch (cmd) {
         case ERROR:
             return "ERROR";
-        case GET_RPM:
-            return "GET_RPM";
-        case GET_SPEED_KMH:
-            return "GET_SPEED_KMH";
-        case GET_ACCELERATOR_PEDAL_POSITION_PCT:
-            return "GET_ACCELERATOR_PEDAL_POSITION_PCT";
-        case GET_CALCULATED_ENGINE_LOAD_PCT:
-            return "GET_CALCULATED_ENGINE_LOAD_PCT";
-        case GET_ENGINE_COOLANT_TEMP_C:
-            return "GET_ENGINE_COOLANT_TEMP_C";
-        case GET_THROTTLE_VALVE_POSITION_PCT:
-            return "GET_THROTTLE_VALVE_POSITION_PCT";
-        case GET_INTAKE_AIR_TEMP_C:
-            return "GET_INTAKE_AIR_TEMP_C";
-        case GET_FUEL_LEVEL_PCT:
-            return "GET_FUEL_LEVEL_PCT";
-        case GET_BRAKES_PCT:
-            return "GET_BRAKES_PCT";
-        case GET_FL_SPEED_KMH:
-            return "GET_FL_SPEED_KMH";
-        case GET_FR_SPEED_KMH:
-            return "GET_FR_SPEED_KMH";
-        case GET_RL_SPEED_KMH:
-            return "GET_RL_SPEED_KMH";
-        case GET_RR_SPEED_KMH:
-            return "GET_RR_SPEED_KMH";
+        METRICS_SIGNALS(METRIC_COMMAND_STR)
+        case GET_INGEST_STATS:
+            return "GET_INGEST_STATS";
+        case GET_METRIC_TIMESTAMP:
+            return "GET_METRIC_TIMESTAMP";
+        case GET_FRESH_METRIC:
+            return "GET_FRESH_METRIC";
+        case GET_SIGNAL_STATS:
+            return "GET_SIGNAL_STATS";
+        case GET_BATCH:
+            return "GET_BATCH";
+        case GET_SNAPSHOT:
+            return "GET_SNAPSHOT";
+        case SUBSCRIBE:
+            return "SUBSCRIBE";
+        case UNSUBSCRIBE:
+            return "UNSUBSCRIBE";
+        case SUBSCRIPTION_UPDATE:
+            return "SUBSCRIPTION_UPDATE";
+        case SET_LOG_LEVEL:
+            return "SET_LOG_LEVEL";
+        case GET_LOOP_STATS:
+            return "GET_LOOP_STATS";
+        case HELLO:
+            return "HELLO";
+        case GET_CONNECTION_INFO:
+            return "GET_CONNECTION_INFO";
+        case GET_SCHEMA:
+            return "GET_SCHEMA";
+        case GET_NOTIFY_FD:
+            return "GET_NOTIFY_FD";
+        case GET_RECORDER_STATS:
+            return "GET_RECORDER_STATS";
+        case GET_LATENCY_STATS:
+            return "GET_LATENCY_STATS";
+        case RESET_LATENCY_STATS:
+            return "RESET_LATENCY_STATS";
         default:
             return "UNKNOWN_CMD";
     }
@@ -8,28 +8,72 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "metrics.h"
+#include "ingest_thread.h"
+#include "subscriptions.h"
 
-#define CMD_ID_SIZE      1
-#define CMD_RSP_MAX_SIZE 32
+#define CMD_ID_SIZE             1
+#define CMD_REQ_MAX_SIZE        32
+#define CMD_SINGLE_RSP_MAX_SIZE 64 // Of every command but the batch and snapshot ones
+// A batch of CMD_REQ_MAX_SIZE - 1 commands, each response prefixed by its length
+#define CMD_RSP_MAX_SIZE        (3 + (CMD_REQ_MAX_SIZE - CMD_ID_SIZE) * (1 + CMD_SINGLE_RSP_MAX_SIZE))
+
+// Layout versions of the batch and snapshot responses, bumped on any change
+#define CMD_BATCH_VERSION       1
+#define CMD_SNAPSHOT_VERSION    1
+
+#define METRIC_COMMAND_ENUM(group, name, NAME, cmd_id, ...) GET_##NAME = cmd_id,
 
 enum command {
     ERROR = 0,
-    GET_RPM = 1,
-    GET_SPEED_KMH = 2,
-    GET_ACCELERATOR_PEDAL_POSITION_PCT = 3,
-    GET_CALCULATED_ENGINE_LOAD_PCT = 4,
-    GET_ENGINE_COOLANT_TEMP_C = 5,
-    GET_THROTTLE_VALVE_POSITION_PCT = 6,
-    GET_INTAKE_AIR_TEMP_C = 7,
-    GET_FUEL_LEVEL_PCT = 8,
-    GET_BRAKES_PCT = 9,
-    GET_FL_SPEED_KMH = 10,
-    GET_FR_SPEED_KMH = 11,
-    GET_RL_SPEED_KMH = 12,
-    GET_RR_SPEED_KMH = 13
+
+    // Metric commands (1 to 0x7f), generated from signals.h
+    METRICS_SIGNALS(METRIC_COMMAND_ENUM)
+
+    // Service commands
+    GET_INGEST_STATS = 0x80,
+    GET_METRIC_TIMESTAMP = 0x81,
+    GET_FRESH_METRIC = 0x82,
+    GET_SIGNAL_STATS = 0x83,
+    GET_BATCH = 0x84,
+    GET_SNAPSHOT = 0x85,
+    SUBSCRIBE = 0x86,
+    UNSUBSCRIBE = 0x87,
+    SUBSCRIPTION_UPDATE = 0x88, // Pushed to subscribers, never requested
+    SET_LOG_LEVEL = 0x89,
+    GET_LOOP_STATS = 0x8a,
+    HELLO = 0x8b,                // Connections only, first command of each
+    GET_CONNECTION_INFO = 0x8c,  // Connections only
+    GET_SCHEMA = 0x8d,
+    GET_NOTIFY_FD = 0x8e,        // Connections only
+    GET_RECORDER_STATS = 0x8f,
+    GET_LATENCY_STATS = 0x90,
+    RESET_LATENCY_STATS = 0x91
+};
+
+struct loop_stats;
+struct server_stats;
+struct connection;
+struct recorder;
+
+// Everything commands can read from
+struct command_context {
+    const struct metrics *metrics;
+    struct ingest_thread *ingest_thread; // NULL when ingest runs on the main thread
+    struct subscriptions *subscriptions;
+    const struct loop_stats *loop_stats;
+    const struct server_stats *server_stats;
+    struct recorder *recorder;                 // NULL when not recording
+};
+
+// Sender of a request, needed by the commands that answer later (subscriptions)
+struct command_client {
+    const struct sockaddr_un *addr;            // Datagram clients
+    socklen_t addr_len;
+    struct connection *connection;             // Connection clients, NULL for datagram ones
 };
 
-size_t handle_command(uint8_t cmd_id, const struct metrics *metrics, uint8_t *buf);
+size_t handle_command(const uint8_t *req, size_t req_len, const struct command_context *ctx,
+                      const struct command_client *client, uint8_t *buf);
 
 const char* command_str(enum command cmd);
 
@@ -0,0 +1,296 @@
+#define LOG_MODULE LOG_MODULE_CONNECTIONS
+
+#include "connections.h"
+#include "log.h"
+#include "monotonic.h"
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#define EPOLL_MAX_EVENTS (MAX_CONNECTIONS + 1)
+
+static int epoll_add(int epoll_fd, int fd, void *ptr) {
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = ptr
+    };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        log_errno("epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+int setup_connections(const char *socket_name, struct connections *conns) {
+    struct sockaddr_un addr;
+
+    memset(conns, 0, sizeof(*conns));
+    for (int i = 0; i < MAX_CONNECTIONS; i++)
+        conns->connections[i].fd = -1;
+
+    unlink(socket_name);
+
+    conns->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conns->listen_fd < 0) {
+        log_errno("socket");
+        return -1;
+    }
+
+    strcpy(addr.sun_path, socket_name);
+    addr.sun_family = AF_UNIX;
+
+    if (bind(conns->listen_fd, (struct sockaddr *) &addr,
+             strlen(addr.sun_path) + sizeof (addr.sun_family)) < 0) {
+        log_errno("bind");
+        close(conns->listen_fd);
+        return -1;
+    }
+
+    if (listen(conns->listen_fd, CONNECTIONS_BACKLOG) < 0) {
+        log_errno("listen");
+        close(conns->listen_fd);
+        return -1;
+    }
+
+    // Its own epoll so the main loop only sees one fd however many connections are open
+    conns->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (conns->epoll_fd < 0) {
+        log_errno("epoll_create1");
+        close(conns->listen_fd);
+        return -1;
+    }
+
+    if (epoll_add(conns->epoll_fd, conns->listen_fd, NULL) < 0) {
+        close(conns->epoll_fd);
+        close(conns->listen_fd);
+        return -1;
+    }
+
+    return conns->epoll_fd;
+}
+
+static void close_connection(struct connections *conns, struct connection *conn, struct subscriptions *subs,
+                             const char *reason) {
+    log_info("connection %" PRIu32 " closed : %s, %" PRIu64 " requests, %" PRIu64 " errors, open %" PRIu64 " ms",
+             conn->id, reason, conn->requests, conn->errors, (monotonic_ns() - conn->connected_ns) / 1000000);
+
+    if (subs != NULL)
+        unsubscribe(subs, conn->fd, NULL, 0);
+
+    // The client's copy of notify_fd stays valid, it's just never signaled again
+    if (conn->notify_fd >= 0)
+        close(conn->notify_fd);
+
+    // Also removes it from epoll
+    close(conn->fd);
+    conn->fd = -1;
+    conns->count--;
+}
+
+void close_connections(struct connections *conns, const char *socket_name) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (conns->connections[i].fd >= 0)
+            close_connection(conns, &conns->connections[i], NULL, "shutting down");
+    }
+
+    log_info("connections : %" PRIu64 " accepted, %" PRIu64 " refused", conns->accepted, conns->refused);
+
+    close(conns->epoll_fd);
+    close(conns->listen_fd);
+    unlink(socket_name);
+}
+
+static void accept_connections(struct connections *conns) {
+    while (1) {
+        const int fd = accept4(conns->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_errno("accept4");
+            return;
+        }
+
+        struct connection *conn = NULL;
+        for (int i = 0; i < MAX_CONNECTIONS && conn == NULL; i++) {
+            if (conns->connections[i].fd < 0)
+                conn = &conns->connections[i];
+        }
+
+        if (conn == NULL) {
+            log_warn("refusing connection, %d open", conns->count);
+            conns->refused++;
+            close(fd);
+            continue;
+        }
+
+        if (epoll_add(conns->epoll_fd, fd, conn) < 0) {
+            close(fd);
+            continue;
+        }
+
+        struct ucred cred = {0};
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+            log_errno("getsockopt SO_PEERCRED");
+
+        *conn = (struct connection) {
+            .fd = fd,
+            .id = ++conns->next_id,
+            .pid = cred.pid,
+            .connected_ns = monotonic_ns(),
+            .notify_fd = -1,
+            .pass_fd = -1
+        };
+        conns->count++;
+        conns->accepted++;
+
+        log_info("connection %" PRIu32 " from pid %d", conn->id, (int)conn->pid);
+    }
+}
+
+static ssize_t send_response(struct connection *conn, const uint8_t *rsp, size_t rsp_len) {
+    struct iovec iov = {
+        .iov_base = (void *)rsp,
+        .iov_len = rsp_len
+    };
+    union {
+        struct cmsghdr header;
+        uint8_t buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1
+    };
+
+    if (conn->pass_fd >= 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &conn->pass_fd, sizeof(int));
+        conn->pass_fd = -1;
+    }
+
+    return sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Returns why the connection is to be closed, NULL while it stays open
+static const char *serve_connection(struct connections *conns, struct connection *conn,
+                                    const struct command_context *cmd_ctx) {
+    const struct command_client client = {
+        .connection = conn
+    };
+
+    for (int i = 0; i < CONNECTION_BUDGET; i++) {
+        // MSG_TRUNC returns the real length of a request too long for the buffer
+        const ssize_t len = recv(conn->fd, conns->req, sizeof(conns->req), MSG_TRUNC);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return NULL;
+            log_debug("recv connection %" PRIu32 ": %m", conn->id);
+            return "reset";
+        }
+
+        if (len == 0)
+            return "disconnected";
+
+        if ((size_t)len > sizeof(conns->req))
+            return "request too long";
+
+        log_debug("connection %" PRIu32 " cmd id %d %s", conn->id, conns->req[0], command_str(conns->req[0]));
+
+        conn->requests++;
+        const size_t rsp_len = handle_command(conns->req, len, cmd_ctx, &client, conns->rsp);
+        if (conns->rsp[0] == ERROR)
+            conn->errors++;
+
+        // Dropping a response would pair every later one with the wrong request
+        if (send_response(conn, conns->rsp, rsp_len) < 0) {
+            log_debug("send connection %" PRIu32 ": %m", conn->id);
+            return errno == EAGAIN || errno == EWOULDBLOCK ? "not reading responses" : "reset";
+        }
+    }
+
+    return NULL;
+}
+
+int handle_connections(struct connections *conns, const struct command_context *cmd_ctx) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    const int count = epoll_wait(conns->epoll_fd, events, EPOLL_MAX_EVENTS, 0);
+    if (count < 0) {
+        log_errno("epoll_wait connections");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct connection *conn = events[i].data.ptr;
+
+        if (conn == NULL) {
+            accept_connections(conns);
+            continue;
+        }
+
+        // A hang up is seen once the requests sent before it are served
+        const char *reason = serve_connection(conns, conn, cmd_ctx);
+        if (reason != NULL)
+            close_connection(conns, conn, cmd_ctx->subscriptions, reason);
+    }
+
+    return 0;
+}
+
+int set_connection_notify(struct connection *conn, uint32_t groups) {
+    if (conn->notify_fd < 0) {
+        conn->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (conn->notify_fd < 0) {
+            log_errno("eventfd");
+            return -1;
+        }
+    }
+
+    conn->notify_groups = groups;
+    conn->notify_pending = 0;
+    conn->pass_fd = conn->notify_fd;
+
+    return 0;
+}
+
+void handle_connections_group_update(const struct group_def *group, const int32_t *values,
+                                     uint64_t timestamp_ns, void *arg) {
+    struct connections *conns = arg;
+    const uint32_t bit = 1u << (group - group_defs);
+
+    (void)values;
+    (void)timestamp_ns;
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        struct connection *conn = &conns->connections[i];
+        if (conn->fd >= 0 && (conn->notify_groups & bit))
+            conn->notify_pending |= bit;
+    }
+}
+
+void flush_connections_notify(struct connections *conns) {
+    const uint64_t one = 1;
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        struct connection *conn = &conns->connections[i];
+        if (conn->fd < 0 || conn->notify_pending == 0)
+            continue;
+
+        // The counter sums up the signals until the client reads it, it can't realistically overflow
+        if (write(conn->notify_fd, &one, sizeof(one)) < 0)
+            log_debug("write connection %" PRIu32 " notify_fd: %m", conn->id);
+        conn->notify_pending = 0;
+    }
+}
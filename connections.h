@@ -0,0 +1,70 @@
+#ifndef MX5METRICSSERVICE_CONNECTIONS_H
+#define MX5METRICSSERVICE_CONNECTIONS_H
+
+#include "commands.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Connection oriented endpoint : SOCK_SEQPACKET, one request or response per message, same commands as
+// the datagram socket. A connection starts with a HELLO negotiating the protocol version and capabilities,
+// any other command is rejected until then. Its subscription and counters are freed as soon as it closes.
+
+#define MAX_CONNECTIONS             16
+#define CONNECTIONS_BACKLOG         8
+#define CONNECTION_BUDGET           8  // Requests per connection per wakeup
+#define CONNECTION_PROTOCOL_VERSION 1
+
+// Capabilities a HELLO can ask for, the response has the ones granted
+#define CONNECTION_CAP_SUBSCRIPTIONS 0x01 // SUBSCRIBE, updates are pushed on the connection
+#define CONNECTION_CAP_NOTIFY        0x02 // GET_NOTIFY_FD, an eventfd signaled when groups are updated
+#define CONNECTION_CAPS              (CONNECTION_CAP_SUBSCRIPTIONS | CONNECTION_CAP_NOTIFY)
+
+struct connection {
+    int fd;                                    // -1 when the slot is free
+    uint32_t id;
+    pid_t pid;                                 // Of the peer when it connected
+    bool negotiated;                           // HELLO done
+    uint8_t version;
+    uint32_t capabilities;
+    uint64_t connected_ns;
+    uint64_t requests;
+    uint64_t errors;                           // Error responses
+    int notify_fd;                             // eventfd, -1 until GET_NOTIFY_FD
+    int pass_fd;                               // Sent along with the next response, -1 for none
+    uint32_t notify_groups;                    // Mask of enum metrics_group signaling notify_fd
+    uint32_t notify_pending;                   // Updated since notify_fd was last signaled
+};
+
+struct connections {
+    int listen_fd;
+    int epoll_fd;                              // Listening socket and connections, added to the main loop
+    int count;
+    uint32_t next_id;
+    uint64_t accepted;
+    uint64_t refused;                          // Table full
+    struct connection connections[MAX_CONNECTIONS];
+    uint8_t req[CMD_REQ_MAX_SIZE];
+    uint8_t rsp[CMD_RSP_MAX_SIZE];
+};
+
+// Returns epoll_fd
+int setup_connections(const char *socket_name, struct connections *conns);
+
+void close_connections(struct connections *conns, const char *socket_name);
+
+// Accepts, serves and closes whatever is ready
+int handle_connections(struct connections *conns, const struct command_context *cmd_ctx);
+
+// Creates conn's eventfd if needed, signals it on updates of groups from now on and passes it with the
+// next response. Returns -1 if the eventfd can't be created
+int set_connection_notify(struct connection *conn, uint32_t groups);
+
+// group_listener, marks the groups to signal
+void handle_connections_group_update(const struct group_def *group, const int32_t *values,
+                                     uint64_t timestamp_ns, void *arg);
+
+// Signals the eventfds of the connections with updated groups, once per batch of updates
+void flush_connections_notify(struct connections *conns);
+
+#endif //MX5METRICSSERVICE_CONNECTIONS_H
@@ -0,0 +1,111 @@
+#include "derived.h"
+
+#define CENTI_KMH_PER_KMH 100
+#define MIN_SLIP_SPEED    (5 * CENTI_KMH_PER_KMH) // Slip is meaningless when rolling that slow
+#define MIN_GEAR_SPEED    (5 * CENTI_KMH_PER_KMH)
+#define MIN_GEAR_RPM      500
+
+// NC 6MT, ratios x1000, stock 205/50R16 tires
+#define FINAL_DRIVE       3909
+#define TIRE_CIRC_MM      1921
+#define GEAR_TOLERANCE    15 // % outside of 1st and 6th before calling it neutral / clutch in
+#define GEARS_COUNT       6
+
+// Engine rpm per km/h x100 in a gear : gear * final drive * 1e6 mm/km / (60 min/h * circumference)
+#define RPM_PER_KMH_X100(gear_ratio) ((gear_ratio) * FINAL_DRIVE * 100LL / (60 * TIRE_CIRC_MM))
+
+static const int64_t gear_rpm_per_kmh_x100[GEARS_COUNT] = {
+    RPM_PER_KMH_X100(3815),
+    RPM_PER_KMH_X100(2260),
+    RPM_PER_KMH_X100(1640),
+    RPM_PER_KMH_X100(1177),
+    RPM_PER_KMH_X100(1000),
+    RPM_PER_KMH_X100(794)
+};
+
+#define ACCEL_WINDOW_NS   100000000ULL // 100ms
+#define ACCEL_MAX_GAP_NS  500000000ULL // Start over after a longer gap in the speed frames
+#define ACCEL_RING_SIZE   32           // > window * 100hz, power of 2
+#define ACCEL_RING_MASK   (ACCEL_RING_SIZE - 1)
+#define MG_NS_PER_CENTI_KMH 283254504LL // 1e9 ns/s * 1000 mg/g / (360 centi km/h per m/s * 9.80665 m/s2)
+
+struct speed_sample {
+    uint64_t timestamp_ns;
+    int32_t speed; // centi km/h
+};
+
+// Speed samples of the last window, oldest at tail
+static struct {
+    struct speed_sample samples[ACCEL_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+} speed_window;
+
+void derive_wheel_slip(const struct can_msg *msg, int32_t *values) {
+    // Full frame resolution, 0.01 km/h
+    const int32_t front = decode_signal_unscaled(&signal_defs[SIGNAL_FL_SPEED_KMH], msg->data) +
+                          decode_signal_unscaled(&signal_defs[SIGNAL_FR_SPEED_KMH], msg->data);
+    const int32_t rear = decode_signal_unscaled(&signal_defs[SIGNAL_RL_SPEED_KMH], msg->data) +
+                         decode_signal_unscaled(&signal_defs[SIGNAL_RR_SPEED_KMH], msg->data);
+
+    if (front < 2 * MIN_SLIP_SPEED)
+        values[DERIVED_WHEEL_SLIP_PCT] = 0;
+    else
+        values[DERIVED_WHEEL_SLIP_PCT] = (int32_t)((int64_t)(rear - front) * 100 / front);
+}
+
+static int32_t estimate_gear(int32_t rpm, int32_t speed) {
+    if (speed < MIN_GEAR_SPEED || rpm < MIN_GEAR_RPM)
+        return 0;
+
+    const int64_t ratio = (int64_t)rpm * CENTI_KMH_PER_KMH * 100 / speed;
+
+    if (ratio > gear_rpm_per_kmh_x100[0] * (100 + GEAR_TOLERANCE) / 100 ||
+        ratio < gear_rpm_per_kmh_x100[GEARS_COUNT - 1] * (100 - GEAR_TOLERANCE) / 100)
+        return 0;
+
+    // Closest gear, the boundaries are halfway between two gears' ratios
+    int gear = 1;
+    while (gear < GEARS_COUNT &&
+           ratio < (gear_rpm_per_kmh_x100[gear - 1] + gear_rpm_per_kmh_x100[gear]) / 2)
+        gear++;
+
+    return gear;
+}
+
+static int32_t longitudinal_accel(uint64_t timestamp_ns, int32_t speed) {
+    // Start over on a gap or a clock going backwards
+    if (speed_window.head != speed_window.tail) {
+        const struct speed_sample *last = &speed_window.samples[(speed_window.head - 1) & ACCEL_RING_MASK];
+        if (timestamp_ns < last->timestamp_ns || timestamp_ns - last->timestamp_ns > ACCEL_MAX_GAP_NS)
+            speed_window.tail = speed_window.head;
+    }
+
+    if (speed_window.head - speed_window.tail == ACCEL_RING_SIZE)
+        speed_window.tail++;
+    speed_window.samples[speed_window.head++ & ACCEL_RING_MASK] = (struct speed_sample) {timestamp_ns, speed};
+
+    // Keep the newest sample at least a window old as the reference, amortized O(1)
+    while (speed_window.head - speed_window.tail > 1 &&
+           timestamp_ns - speed_window.samples[(speed_window.tail + 1) & ACCEL_RING_MASK].timestamp_ns >= ACCEL_WINDOW_NS)
+        speed_window.tail++;
+
+    const struct speed_sample *ref = &speed_window.samples[speed_window.tail & ACCEL_RING_MASK];
+    const uint64_t dt = timestamp_ns - ref->timestamp_ns;
+
+    // Not a full window yet
+    if (dt < ACCEL_WINDOW_NS)
+        return 0;
+
+    return (int32_t)((int64_t)(speed - ref->speed) * MG_NS_PER_CENTI_KMH / (int64_t)dt);
+}
+
+void derive_drivetrain(const struct can_msg *msg, int32_t *values) {
+    const int32_t rpm = decode_signal_unscaled(&signal_defs[SIGNAL_RPM], msg->data) /
+                        signal_defs[SIGNAL_RPM].div;
+    // Full frame resolution, 0.01 km/h
+    const int32_t speed = decode_signal_unscaled(&signal_defs[SIGNAL_SPEED_KMH], msg->data);
+
+    values[DERIVED_GEAR] = estimate_gear(rpm, speed);
+    values[DERIVED_LONGITUDINAL_ACCEL_MG] = longitudinal_accel(msg->timestamp_ns, speed);
+}
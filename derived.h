@@ -0,0 +1,17 @@
+#ifndef MX5METRICSSERVICE_DERIVED_H
+#define MX5METRICSSERVICE_DERIVED_H
+
+#include "metrics.h"
+
+// Index of each derived signal in its group's values, in signals.h order
+#define DERIVED_VALUE_INDEX(group, name, NAME, ...) DERIVED_##NAME,
+#define DERIVED_VALUE_ENUM(group, GROUP, SOURCE, rate_hz, GROUP_SIGNALS) \
+    enum { GROUP_SIGNALS(DERIVED_VALUE_INDEX) };
+METRICS_DERIVED_GROUPS(DERIVED_VALUE_ENUM)
+
+// derive_<group>(msg, values) : called with the source group's frame right after it was decoded,
+// fills values. Keeps its own state, must be O(1) and only ever called from the decoding thread.
+#define DERIVE_FN_DECL(group, ...) void derive_##group(const struct can_msg *msg, int32_t *values);
+METRICS_DERIVED_GROUPS(DERIVE_FN_DECL)
+
+#endif //MX5METRICSSERVICE_DERIVED_H
@@ -0,0 +1,182 @@
+#include "filters.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define EMA_SHIFT     8
+#define EMA_ONE       (1 << EMA_SHIFT)
+#define RATE_SCALE    1000
+#define NS_PER_S      1000000000LL
+
+static const char *const filter_names[] = {
+    [FILTER_NONE] = "none",
+    [FILTER_SMA] = "sma",
+    [FILTER_EMA] = "ema",
+    [FILTER_MEDIAN] = "median",
+    [FILTER_RATE_LIMIT] = "rate"
+};
+
+static bool is_valid_config(const struct filter_config *config) {
+    switch (config->type) {
+        case FILTER_NONE:
+            return true;
+        case FILTER_SMA:
+        case FILTER_MEDIAN:
+            return config->param >= 1 && config->param <= FILTER_MAX_WINDOW;
+        case FILTER_EMA:
+            return config->param >= 1 && config->param <= EMA_ONE;
+        case FILTER_RATE_LIMIT:
+            return config->param >= 1;
+        default:
+            return false;
+    }
+}
+
+int init_filter(struct filter *filter, const struct filter_config *config) {
+    if (!is_valid_config(config))
+        return -1;
+
+    memset(filter, 0, sizeof(*filter));
+    filter->config = *config;
+
+    return 0;
+}
+
+static void prime_filter(struct filter *filter, int32_t sample, uint64_t timestamp_ns) {
+    const int window = filter->config.param;
+
+    switch (filter->config.type) {
+        case FILTER_SMA:
+        case FILTER_MEDIAN:
+            for (int i = 0; i < window; i++) {
+                filter->samples[i] = sample;
+                filter->sorted[i] = sample;
+            }
+            filter->acc = (int64_t)sample * window;
+            break;
+        case FILTER_EMA:
+            filter->acc = (int64_t)sample * EMA_ONE;
+            break;
+        case FILTER_RATE_LIMIT:
+            filter->acc = (int64_t)sample * RATE_SCALE;
+            break;
+        default:
+            break;
+    }
+
+    filter->pos = 0;
+    filter->timestamp_ns = timestamp_ns;
+    filter->primed = true;
+}
+
+static int32_t update_sma(struct filter *filter, int32_t sample) {
+    const int window = filter->config.param;
+
+    filter->acc += sample - filter->samples[filter->pos];
+    filter->samples[filter->pos] = sample;
+    if (++filter->pos >= window)
+        filter->pos = 0;
+
+    return (int32_t)(filter->acc / window);
+}
+
+static int32_t update_ema(struct filter *filter, int32_t sample) {
+    filter->acc += ((int64_t)sample * EMA_ONE - filter->acc) * filter->config.param / EMA_ONE;
+
+    return (int32_t)(filter->acc / EMA_ONE);
+}
+
+static int32_t update_median(struct filter *filter, int32_t sample) {
+    const int window = filter->config.param;
+    const int32_t oldest = filter->samples[filter->pos];
+    int32_t *sorted = filter->sorted;
+    int i = 0;
+
+    filter->samples[filter->pos] = sample;
+    if (++filter->pos >= window)
+        filter->pos = 0;
+
+    // Replace the oldest sample in the sorted window then move the new one in place
+    while (sorted[i] != oldest)
+        i++;
+    while (i > 0 && sorted[i - 1] > sample) {
+        sorted[i] = sorted[i - 1];
+        i--;
+    }
+    while (i < window - 1 && sorted[i + 1] < sample) {
+        sorted[i] = sorted[i + 1];
+        i++;
+    }
+    sorted[i] = sample;
+
+    return sorted[window / 2];
+}
+
+static int32_t update_rate_limit(struct filter *filter, int32_t sample, uint64_t timestamp_ns) {
+    const uint64_t dt = timestamp_ns > filter->timestamp_ns ? timestamp_ns - filter->timestamp_ns : 0;
+    // Capped so that a long gap can't overflow, a second is plenty to catch up anyway
+    const int64_t max_step = (int64_t)filter->config.param * RATE_SCALE * (int64_t)(dt < NS_PER_S ? dt : NS_PER_S) / NS_PER_S;
+    const int64_t delta = (int64_t)sample * RATE_SCALE - filter->acc;
+
+    filter->timestamp_ns = timestamp_ns;
+
+    if (delta > max_step)
+        filter->acc += max_step;
+    else if (delta < -max_step)
+        filter->acc -= max_step;
+    else
+        filter->acc += delta;
+
+    return (int32_t)(filter->acc / RATE_SCALE);
+}
+
+int32_t update_filter(struct filter *filter, int32_t sample, uint64_t timestamp_ns) {
+    if (filter->config.type == FILTER_NONE)
+        return sample;
+
+    if (!filter->primed) {
+        prime_filter(filter, sample, timestamp_ns);
+        return sample;
+    }
+
+    switch (filter->config.type) {
+        case FILTER_SMA:
+            return update_sma(filter, sample);
+        case FILTER_EMA:
+            return update_ema(filter, sample);
+        case FILTER_MEDIAN:
+            return update_median(filter, sample);
+        case FILTER_RATE_LIMIT:
+            return update_rate_limit(filter, sample, timestamp_ns);
+        default:
+            return sample;
+    }
+}
+
+int parse_filter_config(const char *str, struct filter_config *config) {
+    const char *sep = strchr(str, ':');
+    const size_t name_len = sep != NULL ? (size_t)(sep - str) : strlen(str);
+    char *end;
+
+    for (size_t type = 0; type < sizeof(filter_names) / sizeof(filter_names[0]); type++) {
+        if (strlen(filter_names[type]) != name_len || strncmp(str, filter_names[type], name_len) != 0)
+            continue;
+
+        config->type = type;
+        config->param = 0;
+
+        if (sep != NULL) {
+            long param = strtol(sep + 1, &end, 10);
+            if (end == sep + 1 || *end != '\0' || param < 0 || param > INT32_MAX)
+                return -1;
+            config->param = (int32_t)param;
+        }
+
+        return is_valid_config(config) ? 0 : -1;
+    }
+
+    return -1;
+}
+
+const char *filter_type_str(enum filter_type type) {
+    return type < sizeof(filter_names) / sizeof(filter_names[0]) ? filter_names[type] : "unknown";
+}
@@ -0,0 +1,46 @@
+#ifndef MX5METRICSSERVICE_FILTERS_H
+#define MX5METRICSSERVICE_FILTERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Integer only streaming filters, one instance per signal.
+// Every update is constant time : windows are bounded by FILTER_MAX_WINDOW.
+
+#define FILTER_MAX_WINDOW 16
+
+enum filter_type {
+    FILTER_NONE,
+    FILTER_SMA,        // param : window, mean of the last samples
+    FILTER_EMA,        // param : alpha in 1/256th, y += (x - y) * alpha / 256
+    FILTER_MEDIAN,     // param : window, median of the last samples, drops spikes
+    FILTER_RATE_LIMIT  // param : max change per second, in the filtered samples' unit
+};
+
+struct filter_config {
+    enum filter_type type;
+    int32_t param;
+};
+
+struct filter {
+    struct filter_config config;
+    bool primed;
+    uint8_t pos;                          // Oldest sample
+    int32_t samples[FILTER_MAX_WINDOW];   // SMA and MEDIAN, in arrival order
+    int32_t sorted[FILTER_MAX_WINDOW];    // MEDIAN
+    int64_t acc;                          // SMA sum, EMA output << 8, RATE_LIMIT output * 1000
+    uint64_t timestamp_ns;                // RATE_LIMIT, of the last sample
+};
+
+// Returns -1 if the config's param is out of range for its type
+int init_filter(struct filter *filter, const struct filter_config *config);
+
+// Starts from the first sample (a full window of it), never ramps up from 0
+int32_t update_filter(struct filter *filter, int32_t sample, uint64_t timestamp_ns);
+
+// "none", "sma:<window>", "ema:<alpha>", "median:<window>" or "rate:<max per second>", returns -1 if invalid
+int parse_filter_config(const char *str, struct filter_config *config);
+
+const char *filter_type_str(enum filter_type type);
+
+#endif //MX5METRICSSERVICE_FILTERS_H
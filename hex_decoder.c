@@ -0,0 +1,59 @@
+#include "hex_decoder.h"
+#include "stnobd.h"
+
+#define INVALID_NIBBLE 0x10
+#define X              INVALID_NIBBLE
+
+// ascii char -> nibble value, anything that isn't [0-9a-fA-F] has the INVALID_NIBBLE bit set
+static const uint8_t hex_nibbles[256] = {
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  X,  X,  X,  X,  X,  X,
+      X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+      X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+};
+
+#undef X
+
+int decode_hex_frame(const char *frame, uint16_t *can_id, uint64_t *can_data) {
+    const uint8_t *p = (const uint8_t *)frame;
+    uint8_t invalid = 0;
+
+    uint32_t id = 0;
+    for (int i = 0; i < CAN_ID_STR_LEN; i++) {
+        const uint8_t nibble = hex_nibbles[p[i]];
+        invalid |= nibble;
+        id = (id << 4) | nibble;
+    }
+
+    p += CAN_ID_STR_LEN;
+
+    // Two bytes per iteration, a fixed trip count the compiler fully unrolls
+    uint64_t data = 0;
+    for (int i = 0; i < CAN_DATA_STR_LEN; i += 2) {
+        const uint8_t hi = hex_nibbles[p[i]];
+        const uint8_t lo = hex_nibbles[p[i + 1]];
+        invalid |= hi | lo;
+        data = (data << 8) | (uint8_t)((hi << 4) | lo);
+    }
+
+    // Validate once for the whole frame instead of branching on every char
+    if (invalid & INVALID_NIBBLE)
+        return -1;
+
+    *can_id = (uint16_t)id;
+    *can_data = data;
+
+    return 0;
+}
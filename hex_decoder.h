@@ -0,0 +1,11 @@
+#ifndef MX5METRICSSERVICE_HEX_DECODER_H
+#define MX5METRICSSERVICE_HEX_DECODER_H
+
+#include <stdint.h>
+
+// Decodes a fixed width monitoring frame (CAN_ID_STR_LEN id chars followed by CAN_DATA_STR_LEN data chars,
+// no terminator needed). Data keeps the same byte order as strtoull : first byte on the wire is the MSB.
+// Returns -1 without touching can_id/can_data if any char isn't a hex digit.
+int decode_hex_frame(const char *frame, uint16_t *can_id, uint64_t *can_data);
+
+#endif //MX5METRICSSERVICE_HEX_DECODER_H
@@ -0,0 +1,48 @@
+#ifndef MX5METRICSSERVICE_HISTORY_H
+#define MX5METRICSSERVICE_HISTORY_H
+
+// Zero-copy readers for the per signal history rings in shared memory
+
+#include "metrics.h"
+#include <stdbool.h>
+
+// Samples this close to being overwritten are left out of windows
+#define METRICS_HISTORY_GUARD 64
+
+static inline const struct metrics_sample *metrics_history_sample(const struct metrics_history *history, uint64_t n) {
+    return &history->samples[n & METRICS_HISTORY_MASK];
+}
+
+// To be called after reading sample n : false if the writer may have overwritten it meanwhile
+static inline bool metrics_history_valid(const struct metrics_history *history, uint64_t n) {
+    atomic_thread_fence(memory_order_acquire);
+    return n + METRICS_HISTORY_LEN > atomic_load_explicit(&history->write_cursor, memory_order_relaxed);
+}
+
+// First sample n in [lo, hi) with a timestamp >= timestamp_ns, hi if none
+static inline uint64_t metrics_history_lower_bound(const struct metrics_history *history,
+                                                   uint64_t lo, uint64_t hi, uint64_t timestamp_ns) {
+    while (lo < hi) {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (metrics_history_sample(history, mid)->timestamp_ns < timestamp_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Finds the samples with from_ns <= timestamp < to_ns, they are [*first, *end).
+// Read them in place with metrics_history_sample() then check metrics_history_valid() on the first one read.
+static inline void metrics_history_window(const struct metrics_history *history, uint64_t from_ns, uint64_t to_ns,
+                                          uint64_t *first, uint64_t *end) {
+    const uint64_t cursor = atomic_load_explicit(&history->write_cursor, memory_order_acquire);
+    const uint64_t oldest = cursor > METRICS_HISTORY_LEN - METRICS_HISTORY_GUARD
+                            ? cursor - (METRICS_HISTORY_LEN - METRICS_HISTORY_GUARD) : 0;
+
+    *first = metrics_history_lower_bound(history, oldest, cursor, from_ns);
+    *end = metrics_history_lower_bound(history, *first, cursor, to_ns);
+}
+
+#endif //MX5METRICSSERVICE_HISTORY_H
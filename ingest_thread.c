@@ -0,0 +1,227 @@
+#define LOG_MODULE LOG_MODULE_INGEST
+
+#include "ingest_thread.h"
+#include "log.h"
+#include "monotonic.h"
+#include <stdio.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define STOP_SOURCE_INDEX UINT32_MAX
+
+static void atomic_max(_Atomic uint64_t *max, uint64_t val) {
+    uint64_t cur = atomic_load_explicit(max, memory_order_relaxed);
+    while (val > cur && !atomic_compare_exchange_weak_explicit(max, &cur, val,
+                                                                memory_order_relaxed, memory_order_relaxed));
+}
+
+static int epoll_add_index(int epfd, int fd, uint32_t index) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = index;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        log_errno("epoll_ctl ingest");
+        return -1;
+    }
+
+    return 0;
+}
+
+// One eventfd write per batch of msgs, not per msg, or when a source closed
+static void notify_consumer(struct ingest_thread *t, bool source_closed) {
+    const size_t head = atomic_load_explicit(&t->queue.head, memory_order_relaxed);
+    if (head == t->notified_head && !source_closed)
+        return;
+
+    t->notified_head = head;
+
+    const uint64_t one = 1;
+    if (write(t->notify_fd, &one, sizeof(one)) < 0)
+        log_errno("write ingest notify_fd");
+}
+
+static void *ingest_thread_main(void *arg) {
+    struct ingest_thread *t = arg;
+    struct epoll_event events[INGEST_MAX_SOURCES + 1 /* stop_fd */];
+
+    while (1) {
+        int n = epoll_wait(t->epoll_fd, events, INGEST_MAX_SOURCES + 1, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_errno("epoll_wait ingest");
+            return NULL;
+        }
+
+        bool source_closed = false;
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u32 == STOP_SOURCE_INDEX)
+                return NULL;
+
+            const struct ingest_source *source = &t->sources[events[i].data.u32];
+            if (source->handle(source->ctx) == INGEST_SOURCE_CLOSED) {
+                // Still readable, polling it again would only spin
+                if (epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) < 0)
+                    log_errno("epoll_ctl ingest del");
+                atomic_store(&t->source_closed, true);
+                source_closed = true;
+            }
+        }
+
+        notify_consumer(t, source_closed);
+    }
+}
+
+int setup_ingest_thread(int cpu, struct ingest_thread *t) {
+    t->cpu = cpu;
+    t->sources_count = 0;
+    t->notified_head = 0;
+    atomic_init(&t->source_closed, false);
+    spsc_queue_init(&t->queue);
+    atomic_init(&t->dropped, 0);
+    atomic_init(&t->max_depth, 0);
+    atomic_init(&t->popped, 0);
+    atomic_init(&t->latency_sum_ns, 0);
+    atomic_init(&t->max_latency_ns, 0);
+
+    t->epoll_fd = epoll_create1(0);
+    if (t->epoll_fd < 0) {
+        log_errno("epoll_create1 ingest");
+        return -1;
+    }
+
+    t->stop_fd = eventfd(0, EFD_NONBLOCK);
+    if (t->stop_fd < 0) {
+        log_errno("eventfd ingest stop_fd");
+        close(t->epoll_fd);
+        return -1;
+    }
+
+    t->notify_fd = eventfd(0, EFD_NONBLOCK);
+    if (t->notify_fd < 0) {
+        log_errno("eventfd ingest notify_fd");
+        close(t->stop_fd);
+        close(t->epoll_fd);
+        return -1;
+    }
+
+    if (epoll_add_index(t->epoll_fd, t->stop_fd, STOP_SOURCE_INDEX) < 0) {
+        close(t->notify_fd);
+        close(t->stop_fd);
+        close(t->epoll_fd);
+        return -1;
+    }
+
+    return t->notify_fd;
+}
+
+int add_ingest_source(struct ingest_thread *t, int fd, int (*handle)(void *ctx), void *ctx) {
+    if (t->sources_count >= INGEST_MAX_SOURCES) {
+        log_error("too many ingest sources (max %d)", INGEST_MAX_SOURCES);
+        return -1;
+    }
+
+    const int index = t->sources_count;
+    if (epoll_add_index(t->epoll_fd, fd, index) < 0) return -1;
+
+    t->sources[index].fd = fd;
+    t->sources[index].handle = handle;
+    t->sources[index].ctx = ctx;
+    t->sources_count++;
+
+    return 0;
+}
+
+int start_ingest_thread(struct ingest_thread *t) {
+    int err = pthread_create(&t->thread, NULL, ingest_thread_main, t);
+    if (err != 0) {
+        log_error("pthread_create ingest: %s", strerror(err));
+        return -1;
+    }
+
+    pthread_setname_np(t->thread, "mx5-ingest");
+
+    if (t->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(t->cpu, &cpus);
+
+        // Not fatal, we just lose the cache locality
+        err = pthread_setaffinity_np(t->thread, sizeof(cpus), &cpus);
+        if (err != 0)
+            log_warn("pthread_setaffinity_np cpu %d: %s", t->cpu, strerror(err));
+    }
+
+    return 0;
+}
+
+void stop_ingest_thread(struct ingest_thread *t) {
+    const uint64_t one = 1;
+    if (write(t->stop_fd, &one, sizeof(one)) < 0)
+        log_errno("write ingest stop_fd");
+
+    pthread_join(t->thread, NULL);
+
+    close(t->notify_fd);
+    close(t->stop_fd);
+    close(t->epoll_fd);
+}
+
+void push_ingest_msg(const struct can_msg *msg, void *arg) {
+    struct ingest_thread *t = arg;
+
+    if (!spsc_queue_push(&t->queue, msg)) {
+        atomic_fetch_add_explicit(&t->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    atomic_max(&t->max_depth, spsc_queue_depth(&t->queue));
+}
+
+int drain_ingest_thread(struct ingest_thread *t, can_msg_handler handler, void *handler_arg) {
+    struct can_msg msg;
+    uint64_t count;
+    uint64_t popped = 0;
+    uint64_t latency_sum_ns = 0;
+    uint64_t max_latency_ns = 0;
+
+    // Reset the eventfd before draining so msgs queued meanwhile trigger a new wakeup
+    if (read(t->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_errno("read ingest notify_fd");
+        return -1;
+    }
+
+    const uint64_t now = monotonic_ns();
+
+    while (spsc_queue_pop(&t->queue, &msg)) {
+        const uint64_t latency_ns = now > msg.timestamp_ns ? now - msg.timestamp_ns : 0;
+        latency_sum_ns += latency_ns;
+        if (latency_ns > max_latency_ns) max_latency_ns = latency_ns;
+        popped++;
+
+        handler(&msg, handler_arg);
+    }
+
+    atomic_fetch_add_explicit(&t->popped, popped, memory_order_relaxed);
+    atomic_fetch_add_explicit(&t->latency_sum_ns, latency_sum_ns, memory_order_relaxed);
+    atomic_max(&t->max_latency_ns, max_latency_ns);
+
+    return (int)popped;
+}
+
+void get_ingest_stats(struct ingest_thread *t, struct ingest_stats *stats) {
+    const uint64_t popped = atomic_load_explicit(&t->popped, memory_order_relaxed);
+
+    stats->depth = spsc_queue_depth(&t->queue);
+    stats->pushed = popped + stats->depth;
+    stats->dropped = atomic_load_explicit(&t->dropped, memory_order_relaxed);
+    stats->max_depth = atomic_load_explicit(&t->max_depth, memory_order_relaxed);
+    stats->avg_latency_ns = popped > 0 ? atomic_load_explicit(&t->latency_sum_ns, memory_order_relaxed) / popped : 0;
+    stats->max_latency_ns = atomic_load_explicit(&t->max_latency_ns, memory_order_relaxed);
+}
@@ -0,0 +1,66 @@
+#ifndef MX5METRICSSERVICE_INGEST_THREAD_H
+#define MX5METRICSSERVICE_INGEST_THREAD_H
+
+#define INGEST_MAX_SOURCES 4
+
+#include "metrics.h"
+#include "spsc_queue.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+// handle() result once its fd is gone for good : it's no longer polled and source_closed is set
+#define INGEST_SOURCE_CLOSED (-2)
+
+// An fd the ingest thread polls and the handler to call when it's readable
+struct ingest_source {
+    int fd;
+    int (*handle)(void *ctx);
+    void *ctx;
+};
+
+struct ingest_stats {
+    uint64_t pushed;
+    uint64_t dropped;          // Queue full
+    uint64_t depth;
+    uint64_t max_depth;
+    uint64_t avg_latency_ns;   // From read to dequeue
+    uint64_t max_latency_ns;
+};
+
+struct ingest_thread {
+    pthread_t thread;
+    int cpu; // -1 to let the scheduler pick
+    int epoll_fd;
+    int stop_fd;
+    int notify_fd; // Readable whenever msgs were queued, poll it from the serving thread
+    struct ingest_source sources[INGEST_MAX_SOURCES];
+    int sources_count;
+    struct spsc_queue queue;
+    size_t notified_head;
+    _Atomic bool source_closed; // Checked by the consumer when notified
+    // Producer counters
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t max_depth;
+    // Consumer counters
+    _Atomic uint64_t popped;
+    _Atomic uint64_t latency_sum_ns;
+    _Atomic uint64_t max_latency_ns;
+};
+
+int setup_ingest_thread(int cpu, struct ingest_thread *t);
+
+int add_ingest_source(struct ingest_thread *t, int fd, int (*handle)(void *ctx), void *ctx);
+
+int start_ingest_thread(struct ingest_thread *t);
+
+void stop_ingest_thread(struct ingest_thread *t);
+
+// can_msg_handler for the backends, only to be called from the ingest thread
+void push_ingest_msg(const struct can_msg *msg, void *arg);
+
+// Consumer side, hands every queued msg to handler
+int drain_ingest_thread(struct ingest_thread *t, can_msg_handler handler, void *handler_arg);
+
+void get_ingest_stats(struct ingest_thread *t, struct ingest_stats *stats);
+
+#endif //MX5METRICSSERVICE_INGEST_THREAD_H
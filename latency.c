@@ -0,0 +1,84 @@
+#include "latency.h"
+
+struct latency_histogram latency_histograms[LATENCY_STAGES_COUNT];
+
+#define LATENCY_STAGE_STR(stage, STAGE) #stage,
+
+static const char *stage_names[LATENCY_STAGES_COUNT] = {
+    LATENCY_STAGES(LATENCY_STAGE_STR)
+};
+
+uint64_t latency_bucket_min_ns(uint32_t bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    const uint32_t power = bucket >> LATENCY_SUB_BUCKET_BITS;
+    const uint64_t sub = bucket & (LATENCY_SUB_BUCKETS - 1);
+    return (LATENCY_SUB_BUCKETS + sub) << (power - 1);
+}
+
+static uint64_t percentile(const uint32_t *buckets, uint64_t total, uint64_t max_ns, int p) {
+    const uint64_t rank = (total * p + 99) / 100;
+    uint64_t seen = 0;
+
+    for (uint32_t b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            const uint64_t upper_ns = b + 1 < LATENCY_BUCKETS ? latency_bucket_min_ns(b + 1) - 1 : max_ns;
+            return upper_ns < max_ns ? upper_ns : max_ns;
+        }
+    }
+
+    return max_ns;
+}
+
+void get_latency_summary(enum latency_stage stage, struct latency_summary *summary) {
+    uint32_t buckets[LATENCY_BUCKETS] = { 0 };
+    uint64_t sum_ns;
+    uint64_t total = 0;
+
+    get_latency_histogram(stage, &summary->count, &sum_ns, &summary->max_ns, buckets);
+
+    // Percentiles are ranked among the bucket counts, which may trail count by a racing record
+    for (uint32_t b = 0; b < LATENCY_BUCKETS; b++)
+        total += buckets[b];
+
+    summary->mean_ns = summary->count > 0 ? sum_ns / summary->count : 0;
+    summary->p50_ns = percentile(buckets, total, summary->max_ns, 50);
+    summary->p90_ns = percentile(buckets, total, summary->max_ns, 90);
+    summary->p99_ns = percentile(buckets, total, summary->max_ns, 99);
+}
+
+uint32_t get_latency_histogram(enum latency_stage stage, uint64_t *count, uint64_t *sum_ns, uint64_t *max_ns,
+                               uint32_t *buckets) {
+    const struct latency_histogram *h = &latency_histograms[stage];
+    uint32_t len = 0;
+
+    *count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    *sum_ns = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+    *max_ns = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+
+    for (uint32_t b = 0; b < LATENCY_BUCKETS; b++) {
+        buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        if (buckets[b] > 0)
+            len = b + 1;
+    }
+
+    return len;
+}
+
+void reset_latency_histograms(void) {
+    for (int s = 0; s < LATENCY_STAGES_COUNT; s++) {
+        struct latency_histogram *h = &latency_histograms[s];
+
+        for (uint32_t b = 0; b < LATENCY_BUCKETS; b++)
+            atomic_store_explicit(&h->buckets[b], 0, memory_order_relaxed);
+        atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->sum_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->max_ns, 0, memory_order_relaxed);
+    }
+}
+
+const char *latency_stage_str(enum latency_stage stage) {
+    return stage < LATENCY_STAGES_COUNT ? stage_names[stage] : "unknown";
+}
@@ -0,0 +1,100 @@
+#ifndef MX5METRICSSERVICE_LATENCY_H
+#define MX5METRICSSERVICE_LATENCY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Always on latency histograms of each stage a frame or a request goes through, CLOCK_MONOTONIC based.
+// Log-linear buckets : each power of 2 is split in LATENCY_SUB_BUCKETS, so a bucket is at most 12.5% wide.
+// Recording is a few relaxed loads and stores, each stage must only be recorded from a single thread.
+// Queries and resets can come from any thread, a record racing a reset may survive it.
+
+// X(stage, STAGE)
+// read    : adapter readv() syscall, per read
+// parse   : from the read returning to the frame being handed over, per frame
+// decode  : handle_can_msg() decoding the frame's signals, per frame
+// publish : shm write, derived signals, history, stats and subscriptions of the frame, per frame
+// reply   : socket request received to its response sent, per request
+#define LATENCY_STAGES(X) \
+    X(read, READ)         \
+    X(parse, PARSE)       \
+    X(decode, DECODE)     \
+    X(publish, PUBLISH)   \
+    X(reply, REPLY)
+
+#define LATENCY_STAGE_ENUM(stage, STAGE) LATENCY_STAGE_##STAGE,
+
+enum latency_stage {
+    LATENCY_STAGES(LATENCY_STAGE_ENUM)
+    LATENCY_STAGES_COUNT
+};
+
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS     (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_BITS        36 // Longer latencies (over 68s) land in the last bucket
+#define LATENCY_BUCKETS         ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+    _Alignas(64) _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint32_t buckets[LATENCY_BUCKETS]; // Saturate at UINT32_MAX
+};
+
+struct latency_summary {
+    uint64_t count;
+    uint64_t mean_ns;
+    uint64_t p50_ns;   // Percentiles are their bucket's upper bound, capped to max
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+};
+
+extern struct latency_histogram latency_histograms[LATENCY_STAGES_COUNT];
+
+// Values under LATENCY_SUB_BUCKETS get a bucket each, then LATENCY_SUB_BUCKETS buckets per power of 2
+static inline uint32_t latency_bucket(uint64_t ns) {
+    if (ns < LATENCY_SUB_BUCKETS)
+        return ns;
+    if (ns >> LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+
+    const int msb = 63 - __builtin_clzll(ns);
+    return ((msb - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS) +
+           ((ns >> (msb - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// n samples of ns each, e.g. every request of a batch
+static inline void record_latency_n(enum latency_stage stage, uint64_t ns, uint32_t n) {
+    struct latency_histogram *h = &latency_histograms[stage];
+    _Atomic uint32_t *bucket = &h->buckets[latency_bucket(ns)];
+
+    // Single writer, no need for read-modify-write atomics
+    const uint32_t b = atomic_load_explicit(bucket, memory_order_relaxed);
+    atomic_store_explicit(bucket, b > UINT32_MAX - n ? UINT32_MAX : b + n, memory_order_relaxed);
+    atomic_store_explicit(&h->count, atomic_load_explicit(&h->count, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+    atomic_store_explicit(&h->sum_ns, atomic_load_explicit(&h->sum_ns, memory_order_relaxed) + ns * n,
+                          memory_order_relaxed);
+    if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+}
+
+static inline void record_latency(enum latency_stage stage, uint64_t ns) {
+    record_latency_n(stage, ns, 1);
+}
+
+// Lowest value of a bucket, the next bucket's is its upper bound
+uint64_t latency_bucket_min_ns(uint32_t bucket);
+
+void get_latency_summary(enum latency_stage stage, struct latency_summary *summary);
+
+// Copies the histogram, buckets to the last non empty one. Returns the number of buckets copied
+uint32_t get_latency_histogram(enum latency_stage stage, uint64_t *count, uint64_t *sum_ns, uint64_t *max_ns,
+                               uint32_t *buckets);
+
+void reset_latency_histograms(void);
+
+const char *latency_stage_str(enum latency_stage stage);
+
+#endif //MX5METRICSSERVICE_LATENCY_H
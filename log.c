@@ -0,0 +1,226 @@
+#include "log.h"
+#include "monotonic.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE         1024 // Records, must be a power of 2
+#define LOG_RING_MASK         (LOG_RING_SIZE - 1)
+#define LOG_TEXT_SIZE         232
+#define LOG_FLUSH_INTERVAL_MS 20
+#define LOG_BATCH_SIZE        (64 * 1024)
+#define LOG_LINE_MAX_SIZE     (LOG_TEXT_SIZE + 64)
+
+_Static_assert((LOG_RING_SIZE & LOG_RING_MASK) == 0, "LOG_RING_SIZE must be a power of 2");
+
+// Bounded MPSC ring : a record is free for ticket n when seq == n, holds ticket n's record when seq == n + 1
+struct log_record {
+    _Atomic uint64_t seq;
+    uint64_t timestamp_ns;
+    uint8_t level;
+    uint8_t module;
+    uint16_t len;
+    char text[LOG_TEXT_SIZE];
+};
+
+// Every level up to level
+#define LEVEL_MASK(level) ((1u << ((level) + 1)) - 1)
+
+#define LOG_MODULE_LEVEL(module, MODULE) [LOG_MODULE_##MODULE] = LEVEL_MASK(LOG_DEFAULT_LEVEL),
+_Atomic uint8_t log_level_masks[LOG_MODULES_COUNT] = { LOG_MODULES(LOG_MODULE_LEVEL) };
+
+#define LOG_MODULE_NAME(module, MODULE) [LOG_MODULE_##MODULE] = #module,
+static const char *const module_names[LOG_MODULES_COUNT] = { LOG_MODULES(LOG_MODULE_NAME) };
+
+static const char *const level_names[LOG_LEVELS_COUNT] = {
+    [LOG_LEVEL_ERROR] = "error",
+    [LOG_LEVEL_WARN] = "warn",
+    [LOG_LEVEL_INFO] = "info",
+    [LOG_LEVEL_DEBUG] = "debug"
+};
+
+static struct log_record ring[LOG_RING_SIZE];
+static _Atomic uint64_t ring_head;
+static uint64_t ring_tail;                  // Consumer side, under flush_mutex
+static _Atomic uint64_t dropped;            // Records lost to a full ring
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t flush_thread;
+static _Atomic bool flush_thread_running;
+static _Atomic bool stop_flush_thread;
+
+void log_write(enum log_module module, enum log_level level, const char *fmt, ...) {
+    uint64_t pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    struct log_record *record;
+
+    // Claim a free record, never wait for the consumer
+    while (1) {
+        record = &ring[pos & LOG_RING_MASK];
+        const uint64_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        const int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring_head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    const int len = vsnprintf(record->text, sizeof(record->text), fmt, args);
+    va_end(args);
+
+    record->timestamp_ns = monotonic_ns();
+    record->level = level;
+    record->module = module;
+    record->len = len < 0 ? 0 : (len >= LOG_TEXT_SIZE ? LOG_TEXT_SIZE - 1 : len);
+
+    atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        const ssize_t c = write(STDOUT_FILENO, buf, len);
+        if (c <= 0)
+            return; // Nowhere to report it
+        buf += c;
+        len -= c;
+    }
+}
+
+static void flush_logger(void) {
+    static char batch[LOG_BATCH_SIZE];
+    size_t len = 0;
+
+    pthread_mutex_lock(&flush_mutex);
+
+    while (1) {
+        struct log_record *record = &ring[ring_tail & LOG_RING_MASK];
+
+        // Empty, or the next record is still being written
+        if (atomic_load_explicit(&record->seq, memory_order_acquire) != ring_tail + 1)
+            break;
+
+        if (len + LOG_LINE_MAX_SIZE > sizeof(batch)) {
+            write_all(batch, len);
+            len = 0;
+        }
+
+        len += snprintf(batch + len, sizeof(batch) - len, "%" PRIu64 ".%06" PRIu64 " %-5s %-13s %.*s\n",
+                        record->timestamp_ns / 1000000000, record->timestamp_ns / 1000 % 1000000,
+                        level_names[record->level], module_names[record->module], record->len, record->text);
+
+        atomic_store_explicit(&record->seq, ring_tail + LOG_RING_SIZE, memory_order_release);
+        ring_tail++;
+    }
+
+    const uint64_t lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+    if (lost > 0)
+        len += snprintf(batch + len, sizeof(batch) - len, "%" PRIu64 " log records dropped, ring full\n", lost);
+
+    write_all(batch, len);
+
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+static void *flush_thread_main(void *arg) {
+    (void)arg;
+    const struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000000L };
+
+    while (!atomic_load_explicit(&stop_flush_thread, memory_order_relaxed)) {
+        flush_logger();
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
+// Before main(), every binary linking log.c can log whether it calls setup_logger() or not
+__attribute__((constructor)) static void init_ring(void) {
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_store_explicit(&ring[i].seq, i, memory_order_relaxed);
+
+    // Errors right before an exit(EXIT_FAILURE) must not be lost, and without the flush thread that's when
+    // everything is written
+    atexit(flush_logger);
+}
+
+int setup_logger(void) {
+    // Signals are for the main thread's signalfd, never for this one
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+
+    const int err = pthread_create(&flush_thread, NULL, flush_thread_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create log: %s\n", strerror(err));
+        return -1;
+    }
+
+    pthread_setname_np(flush_thread, "mx5-log");
+    atomic_store(&flush_thread_running, true);
+
+    return 0;
+}
+
+void close_logger(void) {
+    if (atomic_exchange(&flush_thread_running, false)) {
+        atomic_store(&stop_flush_thread, true);
+        pthread_join(flush_thread, NULL);
+    }
+
+    flush_logger();
+}
+
+int set_log_level(unsigned module, unsigned level) {
+    if (level >= LOG_LEVELS_COUNT || (module >= LOG_MODULES_COUNT && module != LOG_ALL_MODULES))
+        return -1;
+
+    for (unsigned i = 0; i < LOG_MODULES_COUNT; i++) {
+        if (module == LOG_ALL_MODULES || module == i)
+            atomic_store_explicit(&log_level_masks[i], LEVEL_MASK(level), memory_order_relaxed);
+    }
+
+    return 0;
+}
+
+static int find_name(const char *const *names, unsigned count, const char *name, size_t len) {
+    for (unsigned i = 0; i < count; i++) {
+        if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0)
+            return (int)i;
+    }
+
+    return -1;
+}
+
+int parse_log_opt(const char *opt) {
+    const char *sep = strchr(opt, '=');
+    int module = LOG_ALL_MODULES;
+    const char *level_name = opt;
+
+    if (sep != NULL) {
+        module = find_name(module_names, LOG_MODULES_COUNT, opt, sep - opt);
+        level_name = sep + 1;
+    }
+
+    const int level = find_name(level_names, LOG_LEVELS_COUNT, level_name, strlen(level_name));
+
+    if (module < 0 || level < 0)
+        return -1;
+
+    return set_log_level(module, level);
+}
@@ -0,0 +1,81 @@
+#ifndef MX5METRICSSERVICE_LOG_H
+#define MX5METRICSSERVICE_LOG_H
+
+// Asynchronous leveled logger.
+// Records are formatted by the caller into a lock-free ring, a background thread writes them to stdout in batches.
+// A disabled log call costs one relaxed load and a bit test, its arguments aren't evaluated.
+// Each .c file defines LOG_MODULE to one of the LOG_MODULE_ values before including this header.
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    LOG_LEVELS_COUNT
+};
+
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_INFO
+
+// X(module, MODULE)
+#define LOG_MODULES(X)                  \
+    X(main, MAIN)                       \
+    X(metrics, METRICS)                 \
+    X(stnobd, STNOBD)                   \
+    X(serial, SERIAL)                   \
+    X(socketcan, SOCKETCAN)             \
+    X(ingest, INGEST)                   \
+    X(server, SERVER)                   \
+    X(subscriptions, SUBSCRIPTIONS)     \
+    X(connections, CONNECTIONS)         \
+    X(recorder, RECORDER)               \
+    X(replay, REPLAY)
+
+#define LOG_MODULE_ENUM(module, MODULE) LOG_MODULE_##MODULE,
+
+enum log_module {
+    LOG_MODULES(LOG_MODULE_ENUM)
+    LOG_MODULES_COUNT
+};
+
+#define LOG_ALL_MODULES 0xff
+
+// Enabled levels of each module, bit per enum log_level
+extern _Atomic uint8_t log_level_masks[LOG_MODULES_COUNT];
+
+#define log_enabled(level) \
+    (atomic_load_explicit(&log_level_masks[LOG_MODULE], memory_order_relaxed) & (1u << (level)))
+
+#define log_at(level, ...)                                      \
+    do {                                                        \
+        if (__builtin_expect(log_enabled(level), 0))            \
+            log_write(LOG_MODULE, level, __VA_ARGS__);          \
+    } while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// perror() replacement
+#define log_errno(what) log_error("%s: %m", what)
+
+void log_write(enum log_module module, enum log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Starts the flush thread. Without it records are kept until the ring is full, and flushed at exit()
+int setup_logger(void);
+
+// Flushes everything and stops the flush thread
+void close_logger(void);
+
+// module is an enum log_module or LOG_ALL_MODULES, returns -1 if either is out of range
+int set_log_level(unsigned module, unsigned level);
+
+// "<level>" or "<module>=<level>", e.g. "debug" or "stnobd=debug", returns -1 if invalid
+int parse_log_opt(const char *opt);
+
+#endif //MX5METRICSSERVICE_LOG_H
@@ -1,7 +1,17 @@
+#define LOG_MODULE LOG_MODULE_MAIN
+
 #include <stdio.h>
 #include "stnobd.h"
+#include "socketcan.h"
+#include "ingest_thread.h"
 #include "server.h"
+#include "subscriptions.h"
+#include "connections.h"
+#include "recorder.h"
+#include "replay.h"
 #include "metrics.h"
+#include "log.h"
+#include "latency.h"
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <unistd.h>
@@ -9,36 +19,119 @@
 #include <sys/signalfd.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
 
 #define SERIAL_PORT_NAME   "/dev/pts/3"
 #define SERIAL_BAUD_RATE    921600
 #define SOCKET_NAME        "/tmp/mx5metrics.sock"
+#define CONN_SOCKET_NAME   "/tmp/mx5metrics-conn.sock"
 #define SHM_NAME           "/mx5metrics"
-#define EPOLL_SINGLE_EVENT 1
+#define EPOLL_MAX_EVENTS   16
+#define MAX_FILTER_OPTS    METRICS_SIGNALS_COUNT
 
 static struct metrics* setup_shm() {
     int fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0755);
     if (fd < 0) {
-        perror("shm_open");
+        log_errno("shm_open");
         exit(EXIT_FAILURE);
     }
 
     if (ftruncate(fd, sizeof(struct metrics)) < 0) {
-        perror("ftruncate");
+        log_errno("ftruncate");
         exit(EXIT_FAILURE);
     }
 
     struct metrics *metrics = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (metrics == MAP_FAILED) {
-        perror("mmap");
+        log_errno("mmap");
         exit(EXIT_FAILURE);
     }
 
     close(fd);
 
+    init_metrics(metrics);
+
     return metrics;
 }
 
+// Only let through the CAN IDs of the groups in signals.h
+#define STNOBD_CFG_GROUP_FILTER(group, GROUP, ...) STNOBD_CFG_FILTER(CAN_ID_HEX_STR_##GROUP),
+#define GROUP_CAN_ID(group, GROUP, can_id, ...)    can_id,
+
+enum ingest_backend {
+    INGEST_STNOBD,
+    INGEST_SOCKETCAN,
+    INGEST_REPLAY
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s serial_port | -c can_interface | -r file ... [-x speed]] [-t [-p cpu]]\n"
+                    "          [-f signal=filter ...] [-l [module=]level ...]\n"
+                    "          [-w dir [-W recorder_opt ...]]\n"
+                    "  -s  read an STN/ELM adapter on serial_port (default %s)\n"
+                    "  -c  read raw frames from a SocketCAN interface (e.g. can0, vcan0)\n"
+                    "  -r  replay recorder files, in order\n"
+                    "  -x  replay speed factor (default 1), 0 for as fast as possible\n"
+                    "  -t  run ingest on a dedicated thread\n"
+                    "  -p  pin the ingest thread to cpu\n"
+                    "  -f  change a <name>_filtered signal's filter : none, sma:<window>, ema:<alpha /256>,\n"
+                    "      median:<window> or rate:<max change per second>, e.g. brakes_pct_filtered=ema:32\n"
+                    "  -l  log level (error, warn, info, debug) of every module or of one, e.g. stnobd=debug\n"
+                    "  -w  record the raw frames to files in dir\n"
+                    "  -W  recorder option : rotate_mb=<n> (default %d), rotate_s=<n> (default %d),\n"
+                    "      fsync=<never|rotate|seconds> (default rotate)\n",
+            prog, SERIAL_PORT_NAME, RECORDER_DEFAULT_ROTATE_MB, RECORDER_DEFAULT_ROTATE_S);
+}
+
+// signal=filter
+static int apply_filter_opt(char *opt) {
+    struct filter_config config;
+    char *sep = strchr(opt, '=');
+
+    if (sep == NULL || parse_filter_config(sep + 1, &config) < 0) {
+        fprintf(stderr, "invalid filter %s\n", opt);
+        return -1;
+    }
+
+    *sep = '\0';
+    return set_signal_filter(opt, &config);
+}
+
+// Where decoded frames go, on the main thread
+struct can_msg_sink {
+    struct metrics *metrics;
+    struct recorder *recorder; // NULL when not recording
+};
+
+static void handle_can_msg_inline(const struct can_msg *msg, void *arg) {
+    const struct can_msg_sink *sink = arg;
+
+    if (sink->recorder != NULL)
+        record_can_msg(sink->recorder, msg);
+    handle_can_msg(msg, sink->metrics);
+}
+
+static int handle_stnobd_source(void *ctx) {
+    const int r = handle_incoming_stnobd_msg(ctx);
+
+    return r == STNOBD_DISCONNECTED ? INGEST_SOURCE_CLOSED : r;
+}
+
+static int handle_stnobd_timer_source(void *ctx) {
+    return handle_stnobd_timeout(ctx);
+}
+
+static int handle_socketcan_source(void *ctx) {
+    return handle_incoming_socketcan_msg(ctx);
+}
+
+static int handle_replay_source(void *ctx) {
+    return handle_replay_timeout(ctx);
+}
+
 static int setup_signal_handler() {
     int fd;
     sigset_t mask;
@@ -50,13 +143,13 @@ static int setup_signal_handler() {
     // Block signals so that they aren't handled
     // according to their default dispositions
     if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
-        perror("sigprocmask");
+        log_errno("sigprocmask");
         exit(EXIT_FAILURE);
     }
 
     fd = signalfd(-1, &mask, 0);
     if (fd == -1) {
-        perror("signalfd");
+        log_errno("signalfd");
         exit(EXIT_FAILURE);
     }
 
@@ -68,16 +161,16 @@ static void handle_signal(int fd) {
 
     ssize_t s = read(fd, &siginfo, sizeof(siginfo));
     if (s != sizeof(siginfo)) {
-        perror("read signalfd");
+        log_errno("read signalfd");
         exit(EXIT_FAILURE);
     }
 
     if (siginfo.ssi_signo == SIGINT) {
-        printf("Got SIGINT\n");
+        log_info("Got SIGINT");
     } else if (siginfo.ssi_signo == SIGTERM) {
-        printf("Got SIGTERM\n");
+        log_info("Got SIGTERM");
     } else {
-        printf("Unexpected signal %d\n", siginfo.ssi_signo);
+        log_warn("Unexpected signal %d", siginfo.ssi_signo);
     }
 }
 
@@ -87,95 +180,363 @@ static void epoll_add_fd(int epfd, int fd) {
     event.data.fd = fd;
 
     if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
-        perror("epoll_ctl");
+        log_errno("epoll_ctl");
         exit(EXIT_FAILURE);
     }
 }
 
-static int setup_epoll(int signalfd_fd, int stnobd_fd, int socket_fd) {
+static int setup_epoll(int signalfd_fd, int socket_fd) {
     int fd = epoll_create1(0);
     if (fd < 0) {
-        perror("epoll_create1");
+        log_errno("epoll_create1");
         exit(EXIT_FAILURE);
     }
 
     epoll_add_fd(fd, signalfd_fd);
-    epoll_add_fd(fd, stnobd_fd);
     epoll_add_fd(fd, socket_fd);
 
     return fd;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
     struct stnobd_context stnobd_context;
+    struct socketcan_context socketcan_context;
+    static struct replay_context replay_context;
+    static struct ingest_thread ingest_thread;
+    static struct subscriptions subscriptions;
+    static struct server_context server_context;
+    static struct connections connections;
+    static struct recorder recorder;
+    struct recorder_config recorder_config;
+    struct can_msg_sink sink = {0};
+    struct loop_stats loop_stats = {0};
+    enum ingest_backend backend = INGEST_STNOBD;
+    bool threaded = false;
+    int ingest_cpu = -1;
+    const char *serial_port_name = SERIAL_PORT_NAME;
+    const char *can_if_name = NULL;
+    char *replay_files[REPLAY_MAX_FILES];
+    int replay_files_count = 0;
+    double replay_speed = 1;
+    char *filter_opts[MAX_FILTER_OPTS];
+    int filter_opts_count = 0;
+    int opt;
+
+    init_recorder_config(&recorder_config);
+
+    while ((opt = getopt(argc, argv, "s:c:r:x:tp:f:l:w:W:h")) != -1) {
+        switch (opt) {
+            case 's':
+                backend = INGEST_STNOBD;
+                serial_port_name = optarg;
+                break;
+            case 'c':
+                backend = INGEST_SOCKETCAN;
+                can_if_name = optarg;
+                break;
+            case 'r':
+                if (replay_files_count == REPLAY_MAX_FILES) {
+                    fprintf(stderr, "too many files to replay\n");
+                    exit(EXIT_FAILURE);
+                }
+                backend = INGEST_REPLAY;
+                replay_files[replay_files_count++] = optarg;
+                break;
+            case 'x': {
+                char *end;
+                replay_speed = strtod(optarg, &end);
+                if (*end != '\0' || replay_speed < 0) {
+                    fprintf(stderr, "invalid replay speed %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 't':
+                threaded = true;
+                break;
+            case 'p':
+                ingest_cpu = atoi(optarg);
+                break;
+            case 'f':
+                if (filter_opts_count == MAX_FILTER_OPTS) {
+                    fprintf(stderr, "too many filters\n");
+                    exit(EXIT_FAILURE);
+                }
+                filter_opts[filter_opts_count++] = optarg;
+                break;
+            case 'l':
+                if (parse_log_opt(optarg) < 0) {
+                    fprintf(stderr, "invalid log level %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                recorder_config.dir = optarg;
+                break;
+            case 'W':
+                if (parse_recorder_opt(optarg, &recorder_config) < 0) {
+                    fprintf(stderr, "invalid recorder option %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (setup_logger() < 0) exit(EXIT_FAILURE);
 
     struct metrics *metrics = setup_shm();
 
+    // After setup_shm(), init_metrics() resets the filters
+    for (int i = 0; i < filter_opts_count; i++) {
+        if (apply_filter_opt(filter_opts[i]) < 0) exit(EXIT_FAILURE);
+    }
+
     int signalfd_fd = setup_signal_handler();
 
-    printf("Setting up serial port %s\n", SERIAL_PORT_NAME);
+    sink.metrics = metrics;
+    if (recorder_config.dir != NULL) {
+        // After setup_signal_handler(), the writer thread inherits the blocked signals
+        if (setup_recorder(&recorder_config, &recorder) < 0) exit(EXIT_FAILURE);
+        sink.recorder = &recorder;
+    }
 
+    // Referenced by the stnobd context for its whole lifetime
     char *cfg_cmds[] = {
         STNOBD_CFG_DISABLE_ECHO,
         STNOBD_CFG_ENABLE_HEADER,
         STNOBD_CFG_DISABLE_SPACES,
-        STNOBD_CFG_FILTER(CAN_ID_HEX_STR_BRAKES),
-        STNOBD_CFG_FILTER(CAN_ID_HEX_STR_RPM_SPEED_ACCEL),
-        STNOBD_CFG_FILTER(CAN_ID_HEX_STR_COOLANT_THROTTLE_INTAKE),
-        STNOBD_CFG_FILTER(CAN_ID_HEX_STR_FUEL_LEVEL),
-        STNOBD_CFG_FILTER(CAN_ID_HEX_STR_WHEEL_SPEEDS)
+        METRICS_CAN_GROUPS(STNOBD_CFG_GROUP_FILTER)
     };
     int cfg_cmds_count = sizeof(cfg_cmds) / sizeof(cfg_cmds[0]);
 
-    int stnobd_fd = setup_stnobd(SERIAL_PORT_NAME, SERIAL_BAUD_RATE, cfg_cmds, cfg_cmds_count, &stnobd_context);
-    if (stnobd_fd < 0) exit(EXIT_FAILURE);
+    // Frames are either decoded right away or handed over to the main thread
+    can_msg_handler handler = handle_can_msg_inline;
+    void *handler_arg = &sink;
+
+    if (threaded) {
+        if (setup_ingest_thread(ingest_cpu, &ingest_thread) < 0) exit(EXIT_FAILURE);
+        handler = push_ingest_msg;
+        handler_arg = &ingest_thread;
+    }
+
+    int ingest_fd;
+
+    if (backend == INGEST_SOCKETCAN) {
+        log_info("Setting up SocketCAN interface %s", can_if_name);
 
-    send_stnobd_reset_cmd(&stnobd_context);
+        const uint16_t can_ids[] = {
+            METRICS_CAN_GROUPS(GROUP_CAN_ID)
+        };
+        int can_ids_count = sizeof(can_ids) / sizeof(can_ids[0]);
 
-    int socket_fd = setup_server_socket(SOCKET_NAME);
+        ingest_fd = setup_socketcan(can_if_name, can_ids, can_ids_count,
+                                    handler, handler_arg, &socketcan_context);
+        if (ingest_fd < 0) exit(EXIT_FAILURE);
+    }
+    else if (backend == INGEST_REPLAY) {
+        ingest_fd = setup_replay(replay_files, replay_files_count, replay_speed,
+                                 handler, handler_arg, &replay_context);
+        if (ingest_fd < 0) exit(EXIT_FAILURE);
+    }
+    else {
+        log_info("Setting up serial port %s", serial_port_name);
+
+        ingest_fd = setup_stnobd(serial_port_name, SERIAL_BAUD_RATE, cfg_cmds, cfg_cmds_count,
+                                 handler, handler_arg, &stnobd_context);
+        if (ingest_fd < 0) exit(EXIT_FAILURE);
+
+        send_stnobd_reset_cmd(&stnobd_context);
+    }
+
+    int socket_fd = setup_server_socket(SOCKET_NAME, &server_context);
     if (socket_fd < 0) exit(EXIT_FAILURE);
 
-    int epoll_fd = setup_epoll(signalfd_fd, stnobd_fd, socket_fd);
+    int connections_fd = setup_connections(CONN_SOCKET_NAME, &connections);
+    if (connections_fd < 0) exit(EXIT_FAILURE);
+
+    int epoll_fd = setup_epoll(signalfd_fd, socket_fd);
+    epoll_add_fd(epoll_fd, connections_fd);
+
+    // Subscribers are pushed the changes once each batch of frames is decoded
+    int subscriptions_timer_fd = setup_subscriptions(socket_fd, &subscriptions);
+    if (subscriptions_timer_fd < 0) exit(EXIT_FAILURE);
+    epoll_add_fd(epoll_fd, subscriptions_timer_fd);
+    add_group_listener(handle_subscriptions_group_update, &subscriptions);
+    add_group_listener(handle_connections_group_update, &connections);
+
+    struct command_context cmd_ctx = {
+        .metrics = metrics,
+        .ingest_thread = threaded ? &ingest_thread : NULL,
+        .subscriptions = &subscriptions,
+        .loop_stats = &loop_stats,
+        .server_stats = &server_context.stats,
+        .recorder = sink.recorder
+    };
+
+    int stnobd_timer_fd = backend == INGEST_STNOBD ? stnobd_context.timer_fd : -1;
+    int ingest_notify_fd = -1;
 
-    struct epoll_event epoll_events[EPOLL_SINGLE_EVENT];
+    if (threaded) {
+        // The ingest thread owns the backend context from now on
+        if (backend == INGEST_SOCKETCAN) {
+            if (add_ingest_source(&ingest_thread, ingest_fd, handle_socketcan_source, &socketcan_context) < 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (backend == INGEST_REPLAY) {
+            if (add_ingest_source(&ingest_thread, ingest_fd, handle_replay_source, &replay_context) < 0)
+                exit(EXIT_FAILURE);
+        }
+        else {
+            if (add_ingest_source(&ingest_thread, ingest_fd, handle_stnobd_source, &stnobd_context) < 0 ||
+                add_ingest_source(&ingest_thread, stnobd_timer_fd, handle_stnobd_timer_source, &stnobd_context) < 0)
+                exit(EXIT_FAILURE);
+        }
+
+        if (start_ingest_thread(&ingest_thread) < 0) exit(EXIT_FAILURE);
+
+        ingest_notify_fd = ingest_thread.notify_fd;
+        epoll_add_fd(epoll_fd, ingest_notify_fd);
+        ingest_fd = -1;
+        stnobd_timer_fd = -1;
+    }
+    else {
+        epoll_add_fd(epoll_fd, ingest_fd);
+        if (stnobd_timer_fd >= 0) epoll_add_fd(epoll_fd, stnobd_timer_fd);
+    }
 
-    printf("Ready at %s, /dev/shm%s\n", SOCKET_NAME, SHM_NAME);
+    struct epoll_event epoll_events[EPOLL_MAX_EVENTS];
+    bool running = true;
+    int exit_status = EXIT_SUCCESS;
 
-    while(1) {
-        if (epoll_wait(epoll_fd, epoll_events, EPOLL_SINGLE_EVENT, -1) != EPOLL_SINGLE_EVENT) {
-            perror("epoll_wait");
+    log_info("Ready at %s, %s, /dev/shm%s", SOCKET_NAME, CONN_SOCKET_NAME, SHM_NAME);
+
+    while(running) {
+        const int count = epoll_wait(epoll_fd, epoll_events, EPOLL_MAX_EVENTS, -1);
+        if (count < 0) {
+            log_errno("epoll_wait");
             exit(EXIT_FAILURE);
         }
 
-        if (!(epoll_events[0].events & EPOLLIN)) {
-            fprintf(stderr, "Expected EPOLLIN, got %d\n", epoll_events[0].events);
-            break;
+        loop_stats.wakeups++;
+        loop_stats.events += count;
+        if ((uint64_t)count > loop_stats.max_events)
+            loop_stats.max_events = count;
+
+        bool server_ready = false;
+        bool connections_ready = false;
+
+        // Ingest first, clients are served last with what's left of the wakeup
+        for (int i = 0; i < count && running; i++) {
+            const int fd = epoll_events[i].data.fd;
+
+            if (!(epoll_events[i].events & EPOLLIN)) {
+                log_error("Expected EPOLLIN, got %d", epoll_events[i].events);
+                running = false;
+                exit_status = EXIT_FAILURE;
+            }
+            else if (fd == ingest_notify_fd) {
+                drain_ingest_thread(&ingest_thread, handle_can_msg_inline, &sink);
+                if (atomic_load(&ingest_thread.source_closed)) {
+                    log_error("ingest source closed, exiting");
+                    running = false;
+                    exit_status = EXIT_FAILURE;
+                }
+            }
+            else if (fd == ingest_fd) {
+                if (backend == INGEST_SOCKETCAN)
+                    handle_incoming_socketcan_msg(&socketcan_context);
+                else if (backend == INGEST_REPLAY)
+                    handle_replay_timeout(&replay_context);
+                else if (handle_incoming_stnobd_msg(&stnobd_context) == STNOBD_DISCONNECTED) {
+                    // Nothing will ever be read from it again
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ingest_fd, NULL);
+                    log_error("ingest source closed, exiting");
+                    running = false;
+                    exit_status = EXIT_FAILURE;
+                }
+            }
+            else if (fd == subscriptions_timer_fd) {
+                handle_subscriptions_timeout(&subscriptions);
+            }
+            else if (fd == stnobd_timer_fd) {
+                handle_stnobd_timeout(&stnobd_context);
+            }
+            else if (fd == socket_fd) {
+                server_ready = true;
+            }
+            else if (fd == connections_fd) {
+                connections_ready = true;
+            }
+            else if (fd == signalfd_fd) {
+                handle_signal(signalfd_fd);
+                running = false;
+            }
+            else {
+                log_error("Unexpected epoll event fd %d", fd);
+                running = false;
+            }
         }
 
-        if (epoll_events[0].data.fd == stnobd_fd) {
-            handle_incoming_stnobd_msg(&stnobd_context, metrics);
-        }
-        else if (epoll_events[0].data.fd == socket_fd) {
-            handle_incoming_server_msg(socket_fd, metrics);
-        }
-        else if (epoll_events[0].data.fd == signalfd_fd) {
-            handle_signal(signalfd_fd);
+        if (!running)
             break;
-        }
-        else {
-            fprintf(stderr, "Unexpected epoll event fd %d\n", epoll_events[0].data.fd);
-            break;
-        }
+
+        // Level triggered, datagrams left over the budget wake us up again
+        if (server_ready)
+            handle_incoming_server_msg(&server_context, &cmd_ctx);
+        if (connections_ready)
+            handle_connections(&connections, &cmd_ctx);
+
+        // Once per wakeup : decoded changes and new subscribers' current values
+        flush_subscriptions(&subscriptions);
+        flush_connections_notify(&connections);
     }
 
-    printf("Shutting down ....\n");
+    log_info("Shutting down ....");
+
+    if (threaded) {
+        struct ingest_stats stats;
+
+        stop_ingest_thread(&ingest_thread);
+        get_ingest_stats(&ingest_thread, &stats);
+        log_info("ingest queue : %" PRIu64 " msgs, %" PRIu64 " dropped, max depth %" PRIu64
+               ", latency avg %" PRIu64 " ns max %" PRIu64 " ns",
+               stats.pushed, stats.dropped, stats.max_depth, stats.avg_latency_ns, stats.max_latency_ns);
+    }
+
+    log_info("main loop : %" PRIu64 " wakeups, %" PRIu64 " events, max %" PRIu64 " per wakeup",
+             loop_stats.wakeups, loop_stats.events, loop_stats.max_events);
+    log_info("server : %" PRIu64 " wakeups, %" PRIu64 " datagrams, max %" PRIu64 " per wakeup, budget exhausted %" PRIu64,
+             server_context.stats.wakeups, server_context.stats.datagrams, server_context.stats.max_datagrams,
+             server_context.stats.budget_exhausted);
+    for (int s = 0; s < LATENCY_STAGES_COUNT; s++) {
+        struct latency_summary latency;
+
+        get_latency_summary(s, &latency);
+        if (latency.count > 0)
+            log_info("%s latency : %" PRIu64 " samples, avg %" PRIu64 " ns, p50 %" PRIu64 " ns, p99 %" PRIu64
+                     " ns, max %" PRIu64 " ns", latency_stage_str(s), latency.count, latency.mean_ns, latency.p50_ns,
+                     latency.p99_ns, latency.max_ns);
+    }
 
     close(epoll_fd);
     close(signalfd_fd);
-    close_stnobd(&stnobd_context);
-    close_server_socket(socket_fd, SOCKET_NAME);
+    close_subscriptions(&subscriptions);
+    if (backend == INGEST_SOCKETCAN)
+        close_socketcan(&socketcan_context);
+    else if (backend == INGEST_REPLAY)
+        close_replay(&replay_context);
+    else
+        close_stnobd(&stnobd_context);
+    if (sink.recorder != NULL)
+        close_recorder(sink.recorder);
+    close_server_socket(&server_context, SOCKET_NAME);
+    close_connections(&connections, CONN_SOCKET_NAME);
     shm_unlink(SHM_NAME);
 
-    printf("Bye :)\n");
-    return 0;
+    log_info("Bye :)");
+    close_logger();
+    return exit_status;
 }
@@ -2,191 +2,469 @@
 // Created by rleroux on 4/28/24.
 //
 
-#define LOG
+#define LOG_MODULE LOG_MODULE_METRICS
 
-// /!\ data endianness swapped (strtoull), byte indexes inverted
+#define CAN_DATA_LEN      8
+#define MAX_GROUP_SIGNALS 16
+#define MAX_GROUP_SIZE    (4 * METRICS_CACHE_LINE_SIZE)
 
-#define BRAKE_PRESSURE_MASK 0xffff000000000000 // 6-7
+// The groups are contiguous, right after the header
+#define GROUPS_OFFSET     sizeof(struct metrics_header)
+#define GROUPS_SIZE       (offsetof(struct metrics, history) - GROUPS_OFFSET)
 
-#define RPM_MASK            0xffff000000000000 // 6-7
-#define SPEED_MASK                  0xffff0000 // 2-3
-#define ACCEL_MASK                      0xff00 // 1
+// Every group starts with its seq then its timestamp
+#define GROUP_SEQ_OFFSET       0
+#define GROUP_TIMESTAMP_OFFSET 8
 
-#define ENGINE_LOAD_MASK    0xff00000000000000 // 7
-#define COOLANT_MASK          0xff000000000000 // 6
-#define THROTTLE_MASK             0xff00000000 // 4
-#define INTAKE_MASK                 0xff000000 // 3
+#include "metrics.h"
+#include "log.h"
+#include "derived.h"
+#include "stats.h"
+#include "seqlock.h"
+#include "notify.h"
+#include "latency.h"
+#include "monotonic.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+// Generated from signals.h
+
+#define GROUP_INDEX(group, GROUP, ...) enum { group##_group_index = METRICS_GROUP_##GROUP };
+METRICS_GROUPS(GROUP_INDEX)
+
+#define SIGNAL_DEF(group_, name_, NAME, cmd_id_, type_, unit_, byte_, width_, raw_signed_,     \
+                   offset_, mul_, div_, min_, max_, filter_, filter_param_)                   \
+    [SIGNAL_##NAME] = {                                                                       \
+        .name = #name_,                                                                       \
+        .unit = unit_,                                                                        \
+        .type = #type_,                                                                       \
+        .cmd_id = cmd_id_,                                                                    \
+        .group = group_##_group_index,                                                        \
+        .size = sizeof(type_),                                                                \
+        .is_signed = (type_)-1 < 0,                                                           \
+        .shm_offset = offsetof(struct metrics, group_.name_),                                 \
+        .byte = byte_,                                                                        \
+        .width = width_,                                                                      \
+        .raw_signed = raw_signed_,                                                            \
+        .offset = offset_,                                                                    \
+        .mul = mul_,                                                                          \
+        .div = div_,                                                                          \
+        .min = min_,                                                                          \
+        .max = max_,                                                                          \
+        .filter = { FILTER_##filter_, filter_param_ }                                         \
+    },
+
+#define DERIVED_SIGNAL_DEF(group_, name_, NAME, cmd_id_, type_, unit_, min_, max_)   \
+    [SIGNAL_##NAME] = {                                                                 \
+        .name = #name_,                                                                 \
+        .unit = unit_,                                                                  \
+        .type = #type_,                                                                 \
+        .cmd_id = cmd_id_,                                                              \
+        .group = group_##_group_index,                                                  \
+        .size = sizeof(type_),                                                          \
+        .is_signed = (type_)-1 < 0,                                                     \
+        .shm_offset = offsetof(struct metrics, group_.name_),                           \
+        .mul = 1,                                                                       \
+        .div = 1,                                                                       \
+        .min = min_,                                                                    \
+        .max = max_                                                                     \
+    },
+
+const struct signal_def signal_defs[METRICS_SIGNALS_COUNT] = {
+    METRICS_DECODED_SIGNALS(SIGNAL_DEF)
+    METRICS_DERIVED_SIGNALS(DERIVED_SIGNAL_DEF)
+};
+
+#define SIGNAL_INDEX(group, name, NAME, ...) SIGNAL_##NAME,
+#define GROUP_SIGNALS(group, GROUP, can_id, rate_hz, GROUP_SIGNALS) \
+    static const uint8_t group##_signals[] = { GROUP_SIGNALS(SIGNAL_INDEX) };
+METRICS_GROUPS(GROUP_SIGNALS)
+
+#define GROUP_DEF(group, GROUP, can_id_, rate_hz_, GROUP_SIGNALS)   \
+    [METRICS_GROUP_##GROUP] = {                                     \
+        .name = #group,                                             \
+        .can_id = can_id_,                                          \
+        .rate_hz = rate_hz_,                                        \
+        .shm_offset = offsetof(struct metrics, group),              \
+        .size = sizeof(struct metrics_##group),                     \
+        .signals = group##_signals,                                 \
+        .signals_count = sizeof(group##_signals)                    \
+    },
+
+#define DERIVED_GROUP_DEF(group, GROUP, SOURCE, rate_hz, GROUP_SIGNALS) \
+    GROUP_DEF(group, GROUP, 0, rate_hz, GROUP_SIGNALS)
+
+const struct group_def group_defs[METRICS_GROUPS_COUNT] = {
+    METRICS_CAN_GROUPS(GROUP_DEF)
+    METRICS_DERIVED_GROUPS(DERIVED_GROUP_DEF)
+};
+
+// Direct-indexed decode lookups, no switch
+#define GROUP_BY_CAN_ID(group, GROUP, can_id, ...) [can_id] = &group_defs[METRICS_GROUP_##GROUP],
+
+static const struct group_def *const groups_by_can_id[METRICS_MAX_CAN_ID + 1] = {
+    METRICS_CAN_GROUPS(GROUP_BY_CAN_ID)
+};
+
+// Derived group to update after each source group, -Woverride-init catches two sharing a source
+struct derived_def {
+    const struct group_def *group;
+    void (*derive)(const struct can_msg *msg, int32_t *values);
+};
+
+#define DERIVED_BY_SOURCE(group, GROUP, SOURCE, ...) \
+    [METRICS_GROUP_##SOURCE] = { &group_defs[METRICS_GROUP_##GROUP], derive_##group },
+
+static const struct derived_def derived_by_source[METRICS_GROUPS_COUNT] = {
+    METRICS_DERIVED_GROUPS(DERIVED_BY_SOURCE)
+};
+
+#define SIGNAL_BY_CMD_ID(group, name, NAME, cmd_id, ...) [cmd_id] = &signal_defs[SIGNAL_##NAME],
+
+static const struct signal_def *const signals_by_cmd_id[UINT8_MAX + 1] = {
+    METRICS_SIGNALS(SIGNAL_BY_CMD_ID)
+};
+
+#define DECODED_SIGNAL_CHECKS(group, name, NAME, cmd_id, type, unit, byte, width, ...)                      \
+    static_assert((byte) + (width) <= CAN_DATA_LEN && (width) > 0 && (width) <= 4, #name " doesn't fit");
+METRICS_DECODED_SIGNALS(DECODED_SIGNAL_CHECKS)
+
+#define SIGNAL_CHECKS(group, name, NAME, cmd_id, ...)                                               \
+    static_assert((cmd_id) > 0 && (cmd_id) < 0x80, #name " cmd id is out of the metrics range");
+METRICS_SIGNALS(SIGNAL_CHECKS)
+
+#define CAN_GROUP_CHECKS(group, GROUP, can_id, ...)                                                       \
+    static_assert((can_id) > 0 && (can_id) <= METRICS_MAX_CAN_ID, #group " can id isn't 11 bits");
+METRICS_CAN_GROUPS(CAN_GROUP_CHECKS)
+
+#define GROUP_CHECKS(group, GROUP, can_id, rate_hz, GROUP_SIGNALS)                                        \
+    static_assert(offsetof(struct metrics_##group, seq) == GROUP_SEQ_OFFSET, #group " layout");           \
+    static_assert(offsetof(struct metrics_##group, timestamp_ns) == GROUP_TIMESTAMP_OFFSET, #group " layout"); \
+    static_assert(sizeof(struct metrics_##group) <= MAX_GROUP_SIZE, #group " is too big");                 \
+    static_assert(sizeof(group##_signals) <= MAX_GROUP_SIGNALS, #group " has too many signals");
+METRICS_GROUPS(GROUP_CHECKS)
+
+#define GROUP_PLACEMENT_CHECKS(group, ...)                                                              \
+    static_assert(offsetof(struct metrics, group) >= GROUPS_OFFSET &&                                   \
+                  offsetof(struct metrics, group) + sizeof(struct metrics_##group) <= offsetof(struct metrics, history), \
+                  #group " is outside of the groups");
+METRICS_GROUPS(GROUP_PLACEMENT_CHECKS)
+
+// Only used by signals with a filter
+static struct filter signal_filters[METRICS_SIGNALS_COUNT];
+
+static struct {
+    group_listener listener;
+    void *arg;
+} listeners[MAX_GROUP_LISTENERS];
+static int listeners_count;
+
+static int32_t clamp_signal(const struct signal_def *def, int64_t value) {
+    if (value < def->min) return def->min;
+    if (value > def->max) return def->max;
+    return (int32_t)value;
+}
 
-#define FUEL_LEVEL_MASK     0xff00000000000000 // 7
+static int32_t decode_raw(const struct signal_def *def, uint64_t can_data) {
+    const int bits = def->width * 8;
+    const int shift = (CAN_DATA_LEN - def->byte - def->width) * 8;
 
-#define FL_SPEED_MASK       0xffff000000000000 // 6-7
-#define FR_SPEED_MASK           0xffff00000000 // 4-5
-#define RL_SPEED_MASK               0xffff0000 // 2-3
-#define RR_SPEED_MASK                   0xffff // 0-1
+    uint32_t raw_bits = (uint32_t)((can_data >> shift) & (UINT64_MAX >> (64 - bits)));
 
-#define BRAKE_PRESSURE_BIT_SHIFT (6 * 8)
+    if (def->raw_signed && bits < 32 && (raw_bits & (1u << (bits - 1))))
+        return (int32_t)(raw_bits | ~((1u << bits) - 1)); // Sign extend
 
-#define RPM_BIT_SHIFT            (6 * 8)
-#define SPEED_BIT_SHIFT          (2 * 8)
-#define ACCEL_BIT_SHIFT          (1 * 8)
+    return (int32_t)raw_bits;
+}
 
-#define ENGINE_LOAD_BIT_SHIFT    (7 * 8)
-#define COOLANT_BIT_SHIFT        (6 * 8)
-#define THROTTLE_BIT_SHIFT       (4 * 8)
-#define INTAKE_BIT_SHIFT         (3 * 8)
+static int32_t decode_signal(const struct signal_def *def, enum metrics_signal signal, const struct can_msg *msg) {
+    // Filtered before scaling, at the frame's full resolution
+    int32_t value = update_filter(&signal_filters[signal], decode_raw(def, msg->data) + def->offset, msg->timestamp_ns);
 
-#define FUEL_LEVEL_BIT_SHIFT     (7 * 8)
+    return clamp_signal(def, (int64_t)value * def->mul / def->div);
+}
 
-#define FL_SPEED_BIT_SHIFT       (6 * 8)
-#define FR_SPEED_BIT_SHIFT       (4 * 8)
-#define RL_SPEED_BIT_SHIFT       (2 * 8)
+static void store_signal(struct metrics *metrics, const struct signal_def *def, int32_t value) {
+    uint8_t *field = (uint8_t *)metrics + def->shm_offset;
+
+    // Values are already clamped to the field's range
+    switch (def->size) {
+        case 1: {
+            uint8_t v = (uint8_t)value;
+            memcpy(field, &v, sizeof(v));
+            break;
+        }
+        case 2: {
+            uint16_t v = (uint16_t)value;
+            memcpy(field, &v, sizeof(v));
+            break;
+        }
+        default: {
+            uint32_t v = (uint32_t)value;
+            memcpy(field, &v, sizeof(v));
+            break;
+        }
+    }
+}
 
-#define BRAKE_PRESSURE_OFFSET 102
-#define BRAKE_PRESSURE_COEF   0.2f
-#define RPM_DIV               4
-#define SPEED_DIV             100.0f
-#define SPEED_OFFSET          100
-#define ACCEL_DIV             2
-#define PCT_DIV               2.55f
-#define TEMP_OFFSET           40
+// Returns the sample's n
+static uint64_t push_history(struct metrics *metrics, enum metrics_signal signal, uint64_t timestamp_ns, int32_t value) {
+    struct metrics_history *history = &metrics->history[signal];
+    const uint64_t cursor = atomic_load_explicit(&history->write_cursor, memory_order_relaxed);
+    struct metrics_sample *sample = &history->samples[cursor & METRICS_HISTORY_MASK];
 
-#define FUEL_LEVEL_SAMPLES_COUNT 10
+    sample->timestamp_ns = timestamp_ns;
+    sample->value = value;
+    // Publishes the sample, readers then check the cursor again to make sure it wasn't overwritten
+    atomic_store_explicit(&history->write_cursor, cursor + 1, memory_order_release);
 
-#include "metrics.h"
-#include <stdio.h>
-#include <assert.h>
+    return cursor;
+}
 
-static uint8_t fuel_level_samples[FUEL_LEVEL_SAMPLES_COUNT] = {0};
-static uint16_t fuel_level_samples_sum = 0;
-static uint8_t fuel_levels_samples_pos = 0;
+int32_t decode_signal_unscaled(const struct signal_def *def, uint64_t can_data) {
+    return decode_raw(def, can_data) + def->offset;
+}
 
-uint8_t fuel_moving_avg(uint8_t new_sample)
-{
-    assert(fuel_levels_samples_pos < FUEL_LEVEL_SAMPLES_COUNT);
+const struct signal_def *get_signal_def(uint8_t cmd_id) {
+    return signals_by_cmd_id[cmd_id];
+}
 
-    fuel_level_samples_sum = fuel_level_samples_sum - fuel_level_samples[fuel_levels_samples_pos] + new_sample;
-    fuel_level_samples[fuel_levels_samples_pos] = new_sample;
+size_t read_signal(const struct metrics *metrics, const struct signal_def *def, void *val, uint64_t *timestamp_ns) {
+    const struct group_def *group = &group_defs[def->group];
+    const uint8_t *shm_group = (const uint8_t *)metrics + group->shm_offset;
+    uint8_t copy[MAX_GROUP_SIZE];
 
-    if (++fuel_levels_samples_pos >= FUEL_LEVEL_SAMPLES_COUNT)
-        fuel_levels_samples_pos = 0;
+    // The whole group is copied under its seqlock so the value and its timestamp always match
+    seqlock_read((const _Atomic uint32_t *)(shm_group + GROUP_SEQ_OFFSET), copy, shm_group, group->size);
 
-    return fuel_level_samples_sum / FUEL_LEVEL_SAMPLES_COUNT;
-}
+    memcpy(timestamp_ns, copy + GROUP_TIMESTAMP_OFFSET, sizeof(*timestamp_ns));
+    memcpy(val, copy + (def->shm_offset - group->shm_offset), def->size);
 
-static uint16_t raw_speed_to_kmh(uint16_t raw_speed) {
-    int16_t speed = (int16_t)(((float)raw_speed / SPEED_DIV) - SPEED_OFFSET);
-    return speed < 0 ? 0 : speed;
+    return def->size;
 }
 
-static uint8_t raw_to_pct(uint8_t raw) {
-    return (uint8_t)((float)raw / PCT_DIV);
-}
+// Filters run on unscaled values, rate limits are converted from the signal's unit
+static int setup_signal_filter(enum metrics_signal signal, const struct filter_config *config) {
+    const struct signal_def *def = &signal_defs[signal];
+    struct filter_config unscaled = *config;
+
+    if (unscaled.type == FILTER_RATE_LIMIT)
+        unscaled.param = (int32_t)((int64_t)config->param * def->div / def->mul);
 
-static int16_t raw_to_temp(int16_t raw) {
-    return (int16_t)(raw - TEMP_OFFSET);
+    return init_filter(&signal_filters[signal], &unscaled);
 }
 
-static int handle_brakes(uint64_t can_data, struct metrics *metrics) {
-    int16_t brake_pressure = (int16_t)((can_data & BRAKE_PRESSURE_MASK) >> BRAKE_PRESSURE_BIT_SHIFT);
-    brake_pressure -= BRAKE_PRESSURE_OFFSET;
+int set_signal_filter(const char *name, const struct filter_config *config) {
+    for (int i = 0; i < METRICS_SIGNALS_COUNT; i++) {
+        if (strcmp(signal_defs[i].name, name) != 0)
+            continue;
+
+        // Raw signals stay raw
+        if (signal_defs[i].filter.type == FILTER_NONE || config->type == FILTER_NONE) {
+            log_error("%s isn't a filtered signal", name);
+            return -1;
+        }
 
-    // Pressure can be momentarily negative (vacuum ?)
-    // Limit to min 0
-    metrics->brakes_pct = brake_pressure < 0 ? 0 : (uint8_t)((float)brake_pressure * BRAKE_PRESSURE_COEF);
+        if (setup_signal_filter(i, config) < 0) {
+            log_error("invalid %s filter param %d", filter_type_str(config->type), config->param);
+            return -1;
+        }
 
-#ifdef LOG
-    printf("brakes %d %%\n", metrics->brakes_pct);
-#endif
+        return 0;
+    }
 
-    return 0;
+    log_error("unknown signal %s", name);
+    return -1;
 }
 
-static int handle_rpm_speed_accel(uint64_t can_data, struct metrics *metrics) {
-    uint16_t rpm = (uint16_t)((can_data & RPM_MASK) >> RPM_BIT_SHIFT);
-    metrics->rpm = rpm / RPM_DIV;
+static int32_t load_signal(const struct signal_def *def, const uint8_t *field) {
+    switch (def->size) {
+        case 1: {
+            uint8_t v;
+            memcpy(&v, field, sizeof(v));
+            return def->is_signed ? (int8_t)v : v;
+        }
+        case 2: {
+            uint16_t v;
+            memcpy(&v, field, sizeof(v));
+            return def->is_signed ? (int16_t)v : v;
+        }
+        default: {
+            int32_t v;
+            memcpy(&v, field, sizeof(v));
+            return v;
+        }
+    }
+}
 
-    uint16_t speed = (uint16_t)((can_data & SPEED_MASK) >> SPEED_BIT_SHIFT);
-    metrics->speed_kmh = raw_speed_to_kmh(speed);
+void read_snapshot(const struct metrics *metrics, struct metrics_snapshot *snapshot) {
+    const uint8_t *shm_groups = (const uint8_t *)metrics + GROUPS_OFFSET;
+    uint8_t copy[GROUPS_SIZE];
+    uint32_t seqs[METRICS_GROUPS_COUNT];
+    bool torn;
 
-    uint8_t accel = (uint8_t)((can_data & ACCEL_MASK) >> ACCEL_BIT_SHIFT);
-    metrics->accelerator_pedal_position_pct = accel / ACCEL_DIV;
+    // One copy of every group between all their seqlocks, retried until none of them moved
+    do {
+        for (int g = 0; g < METRICS_GROUPS_COUNT; g++)
+            seqs[g] = seqlock_read_begin((const _Atomic uint32_t *)(shm_groups + group_defs[g].shm_offset - GROUPS_OFFSET));
 
-#ifdef LOG
-    printf("rpm %d, speed %d kmh, accel %d %%\n",
-           metrics->rpm, metrics->speed_kmh, metrics->accelerator_pedal_position_pct);
-#endif
+        memcpy(copy, shm_groups, sizeof(copy));
 
-    return 0;
+        torn = false;
+        for (int g = 0; g < METRICS_GROUPS_COUNT && !torn; g++)
+            torn = seqlock_read_retry((const _Atomic uint32_t *)(shm_groups + group_defs[g].shm_offset - GROUPS_OFFSET), seqs[g]);
+    } while (torn);
+
+    for (int g = 0; g < METRICS_GROUPS_COUNT; g++)
+        memcpy(&snapshot->timestamps_ns[g], copy + group_defs[g].shm_offset - GROUPS_OFFSET + GROUP_TIMESTAMP_OFFSET,
+               sizeof(snapshot->timestamps_ns[g]));
+
+    for (int i = 0; i < METRICS_SIGNALS_COUNT; i++)
+        snapshot->values[i] = load_signal(&signal_defs[i], copy + signal_defs[i].shm_offset - GROUPS_OFFSET);
+}
+
+#define SCHEMA_GROUP_FITS(group, ...) \
+    static_assert(sizeof(#group) <= METRICS_SCHEMA_NAME_LEN, #group " is too long for the schema");
+#define SCHEMA_SIGNAL_FITS(group, name, NAME, cmd_id, type, unit, ...)                                  \
+    static_assert(sizeof(#name) <= METRICS_SCHEMA_NAME_LEN && sizeof(unit) <= METRICS_SCHEMA_UNIT_LEN, \
+                  #name " is too long for the schema");
+METRICS_GROUPS(SCHEMA_GROUP_FITS)
+METRICS_SIGNALS(SCHEMA_SIGNAL_FITS)
+
+static void init_schema(struct metrics_schema *schema) {
+    schema->groups_count = METRICS_GROUPS_COUNT;
+    schema->signals_count = METRICS_SIGNALS_COUNT;
+    schema->group_size = sizeof(schema->groups[0]);
+    schema->signal_size = sizeof(schema->signals[0]);
+
+    for (int g = 0; g < METRICS_GROUPS_COUNT; g++) {
+        struct metrics_schema_group *group = &schema->groups[g];
+
+        strncpy(group->name, group_defs[g].name, sizeof(group->name) - 1);
+        group->shm_offset = group_defs[g].shm_offset;
+        group->size = group_defs[g].size;
+        group->can_id = group_defs[g].can_id;
+        group->rate_hz = group_defs[g].rate_hz;
+    }
+
+    for (int i = 0; i < METRICS_SIGNALS_COUNT; i++) {
+        const struct signal_def *def = &signal_defs[i];
+        struct metrics_schema_signal *signal = &schema->signals[i];
+
+        strncpy(signal->name, def->name, sizeof(signal->name) - 1);
+        strncpy(signal->unit, def->unit, sizeof(signal->unit) - 1);
+        signal->shm_offset = def->shm_offset;
+        signal->history_offset = offsetof(struct metrics, history) + i * sizeof(struct metrics_history);
+        signal->min = def->min;
+        signal->max = def->max;
+        signal->scale_mul = def->mul;
+        signal->scale_div = def->div;
+        signal->cmd_id = def->cmd_id;
+        signal->group = def->group;
+        signal->size = def->size;
+        signal->is_signed = def->is_signed;
+    }
 }
 
-static int handle_load_coolant_throttle_intake(uint64_t can_data, struct metrics *metrics) {
-    uint8_t engine_load = (uint8_t)((can_data & ENGINE_LOAD_MASK) >> ENGINE_LOAD_BIT_SHIFT);
-    metrics->calculated_engine_load_pct = raw_to_pct(engine_load);
+void init_metrics(struct metrics *metrics) {
+    for (int i = 0; i < METRICS_SIGNALS_COUNT; i++) {
+        // Designated initializers silently keep the last of two signals sharing a cmd id
+        assert(signals_by_cmd_id[signal_defs[i].cmd_id] == &signal_defs[i]);
+        if (setup_signal_filter(i, &signal_defs[i].filter) < 0)
+            assert(!"invalid filter in signals.h");
+    }
 
-    int16_t coolant_temp = (int16_t)((can_data & COOLANT_MASK) >> COOLANT_BIT_SHIFT);
-    metrics->engine_coolant_temp_c = raw_to_temp(coolant_temp);
+    memset(metrics, 0, sizeof(*metrics));
+
+    metrics->header.version = METRICS_SHM_VERSION;
+    metrics->header.size = sizeof(*metrics);
+    metrics->header.history_offset = offsetof(struct metrics, history);
+    metrics->header.history_len = METRICS_HISTORY_LEN;
+    metrics->header.signals_count = METRICS_SIGNALS_COUNT;
+    metrics->header.schema_offset = offsetof(struct metrics, schema);
+    metrics->header.schema_size = sizeof(metrics->schema);
+    init_schema(&metrics->schema);
+    init_stats(metrics);
+    atomic_store_explicit(&metrics->header.magic, METRICS_SHM_MAGIC, memory_order_release);
+}
 
-    uint8_t throttle_valve = (uint8_t)((can_data & THROTTLE_MASK) >> THROTTLE_BIT_SHIFT);
-    metrics->throttle_valve_position_pct = raw_to_pct(throttle_valve);
+// Every group is updated as a whole under its seqlock, timestamp included
+static void publish_group(struct metrics *metrics, const struct group_def *group, uint64_t timestamp_ns,
+                          const int32_t *values) {
+    uint8_t *shm_group = (uint8_t *)metrics + group->shm_offset;
+    _Atomic uint32_t *seq = (_Atomic uint32_t *)(shm_group + GROUP_SEQ_OFFSET);
+
+    seqlock_write_begin(seq);
+    memcpy(shm_group + GROUP_TIMESTAMP_OFFSET, &timestamp_ns, sizeof(timestamp_ns));
+    for (int i = 0; i < group->signals_count; i++)
+        store_signal(metrics, &signal_defs[group->signals[i]], values[i]);
+    seqlock_write_end(seq);
+
+    for (int i = 0; i < group->signals_count; i++) {
+        const uint64_t n = push_history(metrics, group->signals[i], timestamp_ns, values[i]);
+        update_stats(group->signals[i], n);
+    }
 
-    int16_t intake_temp = (int16_t)((can_data & INTAKE_MASK) >> INTAKE_BIT_SHIFT);
-    metrics->intake_air_temp_c = raw_to_temp(intake_temp);
+    // Blocked shm readers waiting for this group
+    notify_metrics_update(metrics, group - group_defs);
 
-#ifdef LOG
-    printf("engine %d %%, coolant %d °C, throttle %d %%, intake %d °C\n",
-           metrics->calculated_engine_load_pct, metrics->engine_coolant_temp_c,
-           metrics->throttle_valve_position_pct, metrics->intake_air_temp_c);
-#endif
+    for (int i = 0; i < listeners_count; i++)
+        listeners[i].listener(group, values, timestamp_ns, listeners[i].arg);
 
-    return 0;
+    if (log_enabled(LOG_LEVEL_DEBUG)) {
+        char line[256];
+        size_t len = 0;
+
+        for (int i = 0; i < group->signals_count && len < sizeof(line); i++) {
+            const struct signal_def *def = &signal_defs[group->signals[i]];
+            len += snprintf(line + len, sizeof(line) - len, " %s %d %s", def->name, values[i], def->unit);
+        }
+        log_debug("%s :%s", group->name, line);
+    }
 }
 
-static int handle_fuel_level(uint64_t can_data, struct metrics *metrics) {
-    uint8_t fuel_level = (uint8_t)((can_data & FUEL_LEVEL_MASK) >> FUEL_LEVEL_BIT_SHIFT);
-    metrics->fuel_level_pct = raw_to_pct(fuel_moving_avg(fuel_level));
+int add_group_listener(group_listener listener, void *arg) {
+    if (listeners_count == MAX_GROUP_LISTENERS)
+        return -1;
 
-#ifdef LOG
-    printf("fuel avg %d sample %d, %%\n", metrics->fuel_level_pct, raw_to_pct(fuel_level));
-#endif
+    listeners[listeners_count].listener = listener;
+    listeners[listeners_count].arg = arg;
+    listeners_count++;
 
     return 0;
 }
 
-static int handle_wheel_speeds(uint64_t can_data, struct metrics *metrics) {
-    uint16_t fl = (uint16_t)((can_data & FL_SPEED_MASK) >> FL_SPEED_BIT_SHIFT);
-    metrics->fl_speed_kmh = raw_speed_to_kmh((fl));
+int handle_can_msg(const struct can_msg *msg, struct metrics *metrics) {
+    const struct group_def *group = msg->id <= METRICS_MAX_CAN_ID ? groups_by_can_id[msg->id] : NULL;
+    if (group == NULL) {
+        log_debug("unhandled can id 0x%x", msg->id);
+        return -1;
+    }
 
-    uint16_t fr = (uint16_t)((can_data & FR_SPEED_MASK) >> FR_SPEED_BIT_SHIFT);
-    metrics->fr_speed_kmh = raw_speed_to_kmh((fr));
+    int32_t values[MAX_GROUP_SIGNALS];
+    const uint64_t decode_start_ns = monotonic_ns();
 
-    uint16_t rl = (uint16_t)((can_data & RL_SPEED_MASK) >> RL_SPEED_BIT_SHIFT);
-    metrics->rl_speed_kmh = raw_speed_to_kmh((rl));
+    for (int i = 0; i < group->signals_count; i++) {
+        const enum metrics_signal signal = group->signals[i];
+        values[i] = decode_signal(&signal_defs[signal], signal, msg);
+    }
 
-    uint16_t rr = (uint16_t)(can_data & RR_SPEED_MASK);
-    metrics->rr_speed_kmh = raw_speed_to_kmh((rr));
+    const uint64_t publish_start_ns = monotonic_ns();
+    record_latency(LATENCY_STAGE_DECODE, publish_start_ns - decode_start_ns);
 
-#ifdef LOG
-    printf("fl %d fr %d rl %d rr %d kmh\n",
-           metrics->fl_speed_kmh, metrics->fr_speed_kmh, metrics->rl_speed_kmh, metrics->rr_speed_kmh);
-#endif
+    publish_group(metrics, group, msg->timestamp_ns, values);
 
-    return 0;
-}
-
-int handle_can_msg(uint16_t can_id, uint64_t can_data, struct metrics *metrics) {
-    switch(can_id) {
-        case CAN_ID_BRAKES:
-            return handle_brakes(can_data, metrics);
-        case CAN_ID_RPM_SPEED_ACCEL:
-            return handle_rpm_speed_accel(can_data, metrics);
-        case CAN_ID_COOLANT_THROTTLE_INTAKE:
-            return handle_load_coolant_throttle_intake(can_data, metrics);
-        case CAN_ID_FUEL_LEVEL:
-            return handle_fuel_level(can_data, metrics);
-        case CAN_ID_WHEEL_SPEEDS:
-            return handle_wheel_speeds(can_data, metrics);
-        default:
-            printf("unhandled can id 0x%x\n", can_id);
-            return -1;
+    // Derived values are only computed here, once per source frame, never on read
+    const struct derived_def *derived = &derived_by_source[group - group_defs];
+    if (derived->group != NULL) {
+        derived->derive(msg, values);
+        for (int i = 0; i < derived->group->signals_count; i++)
+            values[i] = clamp_signal(&signal_defs[derived->group->signals[i]], values[i]);
+        publish_group(metrics, derived->group, msg->timestamp_ns, values);
     }
+
+    record_latency(LATENCY_STAGE_PUBLISH, monotonic_ns() - publish_start_ns);
+
+    return 0;
 }
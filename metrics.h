@@ -16,24 +16,207 @@
 #define CAN_ID_WHEEL_SPEEDS                    0x4b0 // 100hz
 #define CAN_ID_HEX_STR_WHEEL_SPEEDS            "4B0"
 
+#include "signals.h"
+#include "filters.h"
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 
-struct __attribute__((__packed__)) metrics {
-     uint16_t rpm;
-     uint16_t speed_kmh;
-     uint8_t accelerator_pedal_position_pct;
-     uint8_t calculated_engine_load_pct;
-     int16_t engine_coolant_temp_c;
-     uint8_t throttle_valve_position_pct;
-     int16_t intake_air_temp_c;
-     uint8_t fuel_level_pct;
-     uint8_t brakes_pct;
-     uint16_t fl_speed_kmh;
-     uint16_t fr_speed_kmh;
-     uint16_t rl_speed_kmh;
-     uint16_t rr_speed_kmh;
-};
-
-int handle_can_msg(uint16_t can_id, uint64_t can_data, struct metrics *metrics);
+struct can_msg {
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC, when the frame was read
+    uint64_t data;         // First byte on the wire is the MSB, bytes past len are 0
+    uint16_t id;
+    uint8_t len;           // Data bytes (DLC), 0 to 8
+};
+
+// Where ingest backends hand their frames over
+typedef void (*can_msg_handler)(const struct can_msg *msg, void *arg);
+
+#define METRICS_SHM_MAGIC   0x4d35584d // "MX5M"
+#define METRICS_SHM_VERSION 8
+
+#define METRICS_CACHE_LINE_SIZE 64
+#define METRICS_GROUP __attribute__((aligned(METRICS_CACHE_LINE_SIZE)))
+
+#define METRICS_HISTORY_LEN  8192 // Per signal, must be a power of 2. Over 80s at 100hz
+#define METRICS_HISTORY_MASK (METRICS_HISTORY_LEN - 1)
+
+#define METRICS_MAX_CAN_ID   0x7ff // 11 bit ids
+
+// Shared memory layout :
+// header, one group per CAN ID then the derived groups (see signals.h), each on its own cache line(s).
+// A group is only updated as a whole under its seqlock (see seqlock.h) :
+// copy it between seqlock_read_begin() and seqlock_read_retry() to get a consistent snapshot.
+// Check magic, version and size before trusting anything else, magic is written last at startup.
+// The groups are followed by one history ring per signal (see history.h to read them), then by the schema :
+// every group's and signal's name, type, unit and offset, so clients can resolve them once at startup.
+
+struct METRICS_GROUP metrics_header {
+    _Atomic uint32_t magic;
+    uint32_t version;
+    uint32_t size;            // sizeof(struct metrics)
+    uint32_t history_offset;  // offsetof(struct metrics, history)
+    uint32_t history_len;     // METRICS_HISTORY_LEN
+    uint32_t signals_count;   // METRICS_SIGNALS_COUNT
+    uint32_t schema_offset;   // offsetof(struct metrics, schema)
+    uint32_t schema_size;     // sizeof(struct metrics_schema)
+    _Atomic uint32_t update_seq; // Futex word bumped after each group update, see notify.h
+    _Atomic uint32_t waiters;    // Readers blocked or about to block on update_seq, see notify.h
+};
+
+#define METRICS_GROUP_FIELD(group, name, NAME, cmd_id, type, ...) type name;
+
+// struct metrics_<group> { seq, timestamp_ns, <one field per signal> }
+#define METRICS_GROUP_STRUCT(group, GROUP, can_id, rate_hz, GROUP_SIGNALS)                 \
+struct METRICS_GROUP metrics_##group {                                                    \
+    _Atomic uint32_t seq;                                                                 \
+    uint64_t timestamp_ns; /* CLOCK_MONOTONIC read time of the last frame, 0 until then */ \
+    GROUP_SIGNALS(METRICS_GROUP_FIELD)                                                    \
+};
+
+METRICS_GROUPS(METRICS_GROUP_STRUCT)
+
+#define METRICS_GROUP_ENUM(group, GROUP, ...) METRICS_GROUP_##GROUP,
+
+enum metrics_group {
+    METRICS_GROUPS(METRICS_GROUP_ENUM)
+    METRICS_GROUPS_COUNT
+};
+
+#define METRICS_SIGNAL_ENUM(group, name, NAME, ...) SIGNAL_##NAME,
+
+// History ring index of each signal
+enum metrics_signal {
+    METRICS_SIGNALS(METRICS_SIGNAL_ENUM)
+    METRICS_SIGNALS_COUNT
+};
+
+struct metrics_sample {
+    uint64_t timestamp_ns;
+    int32_t value;
+    uint32_t reserved;
+};
+
+// Single writer ring, samples are written in place then published by bumping write_cursor.
+// Sample n lives at samples[n & METRICS_HISTORY_MASK] and stays valid while n + METRICS_HISTORY_LEN > write_cursor.
+struct METRICS_GROUP metrics_history {
+    _Atomic uint64_t write_cursor; // Samples written since startup
+    struct metrics_sample samples[METRICS_HISTORY_LEN];
+};
+
+#define METRICS_SCHEMA_NAME_LEN 40 // NUL terminated
+#define METRICS_SCHEMA_UNIT_LEN 8
+
+struct metrics_schema_group {
+    char name[METRICS_SCHEMA_NAME_LEN];
+    uint32_t shm_offset;      // Of the group : seq (uint32) at +0, timestamp ns (uint64) at +8
+    uint32_t size;
+    uint16_t can_id;          // 0 for derived groups
+    uint16_t rate_hz;
+    uint32_t reserved;
+};
+
+struct metrics_schema_signal {
+    char name[METRICS_SCHEMA_NAME_LEN];
+    char unit[METRICS_SCHEMA_UNIT_LEN];
+    uint32_t shm_offset;      // Of the value, in unit, read it under its group's seqlock
+    uint32_t history_offset;  // Of its struct metrics_history
+    int32_t min;
+    int32_t max;
+    int32_t scale_mul;        // Frame raw value to unit, 1 / 1 for derived signals
+    int32_t scale_div;
+    uint8_t cmd_id;
+    uint8_t group;            // Index in groups
+    uint8_t size;             // Of the value : 1, 2 or 4 bytes
+    uint8_t is_signed;
+};
+
+struct metrics_schema {
+    uint32_t groups_count;
+    uint32_t signals_count;
+    uint32_t group_size;      // sizeof(struct metrics_schema_group)
+    uint32_t signal_size;     // sizeof(struct metrics_schema_signal)
+    struct metrics_schema_group groups[METRICS_GROUPS_COUNT];
+    struct metrics_schema_signal signals[METRICS_SIGNALS_COUNT];
+};
+
+#define METRICS_GROUP_MEMBER(group, ...) struct metrics_##group group;
+
+struct metrics {
+    struct metrics_header header;
+    METRICS_GROUPS(METRICS_GROUP_MEMBER)
+
+    struct metrics_history history[METRICS_SIGNALS_COUNT];
+    struct metrics_schema schema;
+};
+
+struct signal_def {
+    const char *name;
+    const char *unit;
+    const char *type;
+    uint8_t cmd_id;
+    uint8_t group;          // enum metrics_group
+    uint8_t size;           // Of the shm field
+    bool is_signed;         // Of the shm field
+    uint32_t shm_offset;    // Of the field, from the start of struct metrics
+    // Decoding, see signals.h
+    uint8_t byte;
+    uint8_t width;
+    bool raw_signed;
+    int32_t offset;
+    int32_t mul;
+    int32_t div;
+    int32_t min;
+    int32_t max;
+    struct filter_config filter; // Defaults, see set_signal_filter()
+};
+
+struct group_def {
+    const char *name;
+    uint16_t can_id;        // 0 for derived groups
+    uint16_t rate_hz;
+    uint32_t shm_offset;    // Of the group, from the start of struct metrics
+    uint32_t size;
+    const uint8_t *signals; // enum metrics_signal
+    uint8_t signals_count;
+};
+
+// Every group's timestamp and every signal's value (enum metrics_signal order), from one instant
+struct metrics_snapshot {
+    uint64_t timestamps_ns[METRICS_GROUPS_COUNT];
+    int32_t values[METRICS_SIGNALS_COUNT];
+};
+
+extern const struct signal_def signal_defs[METRICS_SIGNALS_COUNT];
+extern const struct group_def group_defs[METRICS_GROUPS_COUNT];
+
+// NULL if cmd_id isn't a metric
+const struct signal_def *get_signal_def(uint8_t cmd_id);
+
+// (raw + offset) of a decoded signal, before averaging, scaling and clamping : the frame's full resolution
+int32_t decode_signal_unscaled(const struct signal_def *def, uint64_t can_data);
+
+// Consistent copy of a signal's shm field and its group's timestamp, returns the field size
+size_t read_signal(const struct metrics *metrics, const struct signal_def *def, void *val, uint64_t *timestamp_ns);
+
+// Consistent copy of all the groups at once
+void read_snapshot(const struct metrics *metrics, struct metrics_snapshot *snapshot);
+
+// Starts from a zeroed segment, publishes the header last. Resets the filters to their signals.h defaults
+void init_metrics(struct metrics *metrics);
+
+// Changes the filter of a <name>_filtered signal, rate limits in the signal's unit, returns -1 if that's not possible
+int set_signal_filter(const char *name, const struct filter_config *config);
+
+#define MAX_GROUP_LISTENERS 4
+
+// Called after every group update, from the decode path
+typedef void (*group_listener)(const struct group_def *group, const int32_t *values, uint64_t timestamp_ns, void *arg);
+
+// Returns -1 if there are MAX_GROUP_LISTENERS already
+int add_group_listener(group_listener listener, void *arg);
+
+int handle_can_msg(const struct can_msg *msg, struct metrics *metrics);
 
 #endif //MX5METRICSSERVICE_METRICS_H
@@ -0,0 +1,14 @@
+#ifndef MX5METRICSSERVICE_MONOTONIC_H
+#define MX5METRICSSERVICE_MONOTONIC_H
+
+#include <stdint.h>
+#include <time.h>
+
+// All service timestamps are CLOCK_MONOTONIC nanoseconds
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif //MX5METRICSSERVICE_MONOTONIC_H
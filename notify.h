@@ -0,0 +1,103 @@
+#ifndef MX5METRICSSERVICE_NOTIFY_H
+#define MX5METRICSSERVICE_NOTIFY_H
+
+// Blocking shm readers : header.update_seq is bumped after each group update, then the waiters whose group mask
+// has that group's bit (1 << enum metrics_group) are woken with FUTEX_WAKE_BITSET.
+// The wake syscall is only made while header.waiters is non zero :
+// - a reader increments waiters, then loads update_seq and checks its groups before FUTEX_WAIT_BITSET on that seq,
+//   and decrements waiters once done waiting
+// - the writer increments update_seq, then loads waiters and wakes only if it's non zero
+// Both sides are seq_cst so either the writer sees the reader's increment, or the reader sees the new update_seq
+// (and its wait returns right away), no wake up is lost. A reader dying while waiting only costs the writer its
+// syscalls again. Blocking readers need a read-write mapping for waiters, the rest of the segment is never written.
+// Connections can get an eventfd instead (GET_NOTIFY_FD).
+
+#include "metrics.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define METRICS_ALL_GROUPS ((1u << METRICS_GROUPS_COUNT) - 1)
+
+static_assert(METRICS_GROUPS_COUNT <= 32, "futex bitsets are 32 bits");
+
+// Writer side, after the group's seqlock_write_end()
+static inline void notify_metrics_update(struct metrics *metrics, int group) {
+    atomic_fetch_add_explicit(&metrics->header.update_seq, 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&metrics->header.waiters, memory_order_seq_cst) > 0)
+        syscall(SYS_futex, &metrics->header.update_seq, FUTEX_WAKE_BITSET, INT_MAX, NULL, NULL, 1u << group);
+}
+
+struct metrics_waiter {
+    uint32_t groups;                          // Mask of the groups waited for
+    uint32_t seqs[METRICS_GROUPS_COUNT];      // Group seqs last seen
+};
+
+static inline const _Atomic uint32_t *metrics_group_seq(const struct metrics *metrics, int group) {
+    return (const _Atomic uint32_t *)((const uint8_t *)metrics + group_defs[group].shm_offset);
+}
+
+// Groups updated since last seen, odd seqs (update in progress) are picked up once done
+static inline uint32_t metrics_waiter_updated(struct metrics_waiter *waiter, const struct metrics *metrics) {
+    uint32_t updated = 0;
+
+    for (int g = 0; g < METRICS_GROUPS_COUNT; g++) {
+        if (!(waiter->groups & (1u << g)))
+            continue;
+
+        const uint32_t seq = atomic_load_explicit(metrics_group_seq(metrics, g), memory_order_acquire);
+        if (!(seq & 1) && seq != waiter->seqs[g]) {
+            waiter->seqs[g] = seq;
+            updated |= 1u << g;
+        }
+    }
+
+    return updated;
+}
+
+// Starts from the current state, only later updates are reported
+static inline void metrics_waiter_init(struct metrics_waiter *waiter, const struct metrics *metrics, uint32_t groups) {
+    memset(waiter, 0, sizeof(*waiter));
+    waiter->groups = groups & METRICS_ALL_GROUPS;
+    metrics_waiter_updated(waiter, metrics);
+}
+
+// Blocks until one of the waiter's groups is updated or CLOCK_MONOTONIC reaches deadline_ns (0 for none).
+// Returns the mask of the updated groups, 0 on timeout, then read them under their seqlock as usual.
+// metrics must be mapped read-write, see above
+static inline uint32_t metrics_wait(struct metrics_waiter *waiter, struct metrics *metrics, uint64_t deadline_ns) {
+    const struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000ull,
+        .tv_nsec = deadline_ns % 1000000000ull
+    };
+    uint32_t updated = 0;
+
+    if (waiter->groups == 0)
+        return 0;
+
+    atomic_fetch_add_explicit(&metrics->header.waiters, 1, memory_order_seq_cst);
+
+    while (1) {
+        // Loaded before the groups : an update in between changes it and the wait returns right away
+        const uint32_t seq = atomic_load_explicit(&metrics->header.update_seq, memory_order_seq_cst);
+
+        updated = metrics_waiter_updated(waiter, metrics);
+        if (updated)
+            break;
+
+        // FUTEX_WAIT_BITSET deadlines are absolute
+        if (syscall(SYS_futex, &metrics->header.update_seq, FUTEX_WAIT_BITSET, seq,
+                    deadline_ns != 0 ? &deadline : NULL, NULL, waiter->groups) < 0 && errno == ETIMEDOUT)
+            break;
+    }
+
+    atomic_fetch_sub_explicit(&metrics->header.waiters, 1, memory_order_seq_cst);
+    return updated;
+}
+
+#endif //MX5METRICSSERVICE_NOTIFY_H
@@ -0,0 +1,389 @@
+#define LOG_MODULE LOG_MODULE_RECORDER
+
+#include "recorder.h"
+#include "log.h"
+#include "monotonic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define NS_PER_S 1000000000ULL
+
+void init_recorder_config(struct recorder_config *config) {
+    *config = (struct recorder_config) {
+        .dir = NULL,
+        .rotate_bytes = RECORDER_DEFAULT_ROTATE_MB * 1024ULL * 1024,
+        .rotate_s = RECORDER_DEFAULT_ROTATE_S,
+        .fsync = RECORDER_FSYNC_ROTATE,
+        .fsync_s = 0
+    };
+}
+
+int parse_recorder_opt(const char *opt, struct recorder_config *config) {
+    const char *sep = strchr(opt, '=');
+    char *end;
+
+    if (sep == NULL || sep[1] == '\0')
+        return -1;
+
+    const char *val = sep + 1;
+    const size_t key_len = sep - opt;
+
+    if (strncmp(opt, "fsync", key_len) == 0 && key_len == strlen("fsync")) {
+        if (strcmp(val, "never") == 0) {
+            config->fsync = RECORDER_FSYNC_NEVER;
+            return 0;
+        }
+        if (strcmp(val, "rotate") == 0) {
+            config->fsync = RECORDER_FSYNC_ROTATE;
+            return 0;
+        }
+    }
+
+    const unsigned long n = strtoul(val, &end, 10);
+    if (*end != '\0' || n == 0 || n > UINT32_MAX)
+        return -1;
+
+    if (strncmp(opt, "rotate_mb", key_len) == 0 && key_len == strlen("rotate_mb"))
+        config->rotate_bytes = n * 1024ULL * 1024;
+    else if (strncmp(opt, "rotate_s", key_len) == 0 && key_len == strlen("rotate_s"))
+        config->rotate_s = n;
+    else if (strncmp(opt, "fsync", key_len) == 0 && key_len == strlen("fsync")) {
+        config->fsync = RECORDER_FSYNC_INTERVAL;
+        config->fsync_s = n;
+    }
+    else
+        return -1;
+
+    return 0;
+}
+
+static void sync_file(struct recorder *rec, uint64_t now) {
+    if (fdatasync(rec->fd) < 0)
+        log_errno("fdatasync recorder");
+    rec->last_fsync_ns = now;
+    atomic_fetch_add_explicit(&rec->fsyncs, 1, memory_order_relaxed);
+}
+
+static int open_file(struct recorder *rec) {
+    char path[PATH_MAX];
+    char started[32];
+    struct timespec realtime;
+
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    const uint64_t now = monotonic_ns();
+
+    struct tm tm;
+    localtime_r(&realtime.tv_sec, &tm);
+    strftime(started, sizeof(started), "%Y%m%d-%H%M%S", &tm);
+
+    if (snprintf(path, sizeof(path), "%s/mx5-%s-%04" PRIu32 ".rec", rec->config.dir, started, rec->file_seq)
+        >= (int)sizeof(path)) {
+        log_error("recorder path too long");
+        return -1;
+    }
+
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (rec->fd < 0) {
+        log_error("open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    const struct recorder_file_header header = {
+        .magic = RECORDER_MAGIC,
+        .version = RECORDER_VERSION,
+        .record_size = sizeof(struct recorder_record),
+        .monotonic_ns = now,
+        .realtime_ns = (uint64_t)realtime.tv_sec * NS_PER_S + realtime.tv_nsec,
+        .block_size = RECORDER_BLOCK_SIZE,
+        .block_records = RECORDER_BLOCK_RECORDS
+    };
+
+    if (write(rec->fd, &header, sizeof(header)) != sizeof(header)) {
+        log_error("write %s: %s", path, strerror(errno));
+        close(rec->fd);
+        rec->fd = -1;
+        return -1;
+    }
+
+    // The current block can already hold records queued while no file was open
+    rec->file_seq++;
+    rec->block_offset = sizeof(header);
+    rec->block_written = 0;
+    rec->file_opened_ns = now;
+    rec->last_fsync_ns = now;
+    atomic_fetch_add_explicit(&rec->files, 1, memory_order_relaxed);
+
+    log_info("recording to %s", path);
+
+    return 0;
+}
+
+static void reset_block(struct recorder *rec) {
+    memset(&rec->block.footer, 0, sizeof(rec->block.footer));
+    rec->block.footer.magic = RECORDER_BLOCK_MAGIC;
+    rec->block_written = 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        const ssize_t c = pwrite(fd, buf, len, offset);
+        if (c < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const uint8_t *)buf + c;
+        len -= c;
+        offset += c;
+    }
+
+    return 0;
+}
+
+// Writes the records not in the file yet then the footer, in a single write once the block is full
+static void write_block(struct recorder *rec) {
+    struct recorder_block *block = &rec->block;
+    const uint32_t count = block->footer.count;
+
+    if (count == rec->block_written)
+        return;
+
+    const size_t records_offset = rec->block_written * sizeof(struct recorder_record);
+    const size_t records_len = (count - rec->block_written) * sizeof(struct recorder_record);
+    const size_t footer_offset = offsetof(struct recorder_block, footer);
+    size_t written;
+    int ret;
+
+    if (count == RECORDER_BLOCK_RECORDS) {
+        written = sizeof(*block) - records_offset;
+        ret = pwrite_all(rec->fd, (const uint8_t *)block + records_offset, written, rec->block_offset + records_offset);
+    }
+    else {
+        written = records_len + sizeof(block->footer);
+        ret = pwrite_all(rec->fd, (const uint8_t *)block + records_offset, records_len,
+                         rec->block_offset + records_offset);
+        if (ret == 0)
+            ret = pwrite_all(rec->fd, &block->footer, sizeof(block->footer), rec->block_offset + footer_offset);
+    }
+
+    if (ret < 0) {
+        // Disk full or gone, these records are lost but recording goes on. The footer keeps indexing them,
+        // which only makes readers look at this block for nothing
+        log_errno("write recorder");
+        atomic_fetch_add_explicit(&rec->lost, count - rec->block_written, memory_order_relaxed);
+        block->footer.count = rec->block_written;
+        return;
+    }
+
+    atomic_fetch_add_explicit(&rec->bytes, written, memory_order_relaxed);
+    rec->block_written = count;
+}
+
+static void index_record(struct recorder_block_footer *footer, const struct recorder_record *record) {
+    if (footer->count == 0) {
+        footer->first_ns = record->timestamp_ns;
+        footer->min_id = record->id;
+        footer->max_id = record->id;
+    }
+    else if (record->id < footer->min_id)
+        footer->min_id = record->id;
+    else if (record->id > footer->max_id)
+        footer->max_id = record->id;
+    footer->last_ns = record->timestamp_ns;
+
+    // A handful of ids per block, kept sorted
+    size_t lo = 0, hi = footer->ids_count;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (footer->ids[mid].id < record->id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < footer->ids_count && footer->ids[lo].id == record->id) {
+        footer->ids[lo].count++;
+        return;
+    }
+
+    if (footer->ids_count == RECORDER_BLOCK_IDS) {
+        footer->flags |= RECORDER_BLOCK_IDS_OVERFLOW;
+        return;
+    }
+
+    memmove(&footer->ids[lo + 1], &footer->ids[lo], (footer->ids_count - lo) * sizeof(footer->ids[0]));
+    footer->ids[lo] = (struct recorder_block_id) {
+        .id = record->id,
+        .count = 1
+    };
+    footer->ids_count++;
+}
+
+static void close_file(struct recorder *rec, uint64_t now) {
+    write_block(rec);
+    if (rec->config.fsync != RECORDER_FSYNC_NEVER)
+        sync_file(rec, now);
+    close(rec->fd);
+    rec->fd = -1;
+    reset_block(rec);
+}
+
+static void write_queued(struct recorder *rec) {
+    struct recorder_block *block = &rec->block;
+    struct can_msg msg;
+    uint64_t recorded = 0;
+
+    while (spsc_queue_pop(&rec->queue, &msg)) {
+        if (block->footer.count == RECORDER_BLOCK_RECORDS) {
+            write_block(rec);
+            // Unless it couldn't be written, then its unwritten records are overwritten
+            if (block->footer.count == RECORDER_BLOCK_RECORDS) {
+                rec->block_offset += RECORDER_BLOCK_SIZE;
+                reset_block(rec);
+            }
+        }
+
+        struct recorder_record *record = &block->records[block->footer.count];
+        *record = (struct recorder_record) {
+            .timestamp_ns = msg.timestamp_ns,
+            .id = msg.id,
+            .len = msg.len
+        };
+
+        // Bytes past len stay 0
+        for (size_t i = 0; i < msg.len && i < sizeof(record->data); i++)
+            record->data[i] = msg.data >> (8 * (sizeof(record->data) - 1 - i));
+
+        index_record(&block->footer, record);
+        block->footer.count++;
+        recorded++;
+    }
+
+    atomic_fetch_add_explicit(&rec->recorded, recorded, memory_order_relaxed);
+}
+
+// Called every RECORDER_FLUSH_MS
+static void flush_recorder(struct recorder *rec) {
+    const uint64_t now = monotonic_ns();
+
+    write_queued(rec);
+
+    // The last rotation failed, records stay in the block until a file can be opened again or the block is full
+    if (rec->fd < 0 && open_file(rec) < 0)
+        return;
+
+    write_block(rec);
+
+    if (rec->config.fsync == RECORDER_FSYNC_INTERVAL && now - rec->last_fsync_ns >= rec->config.fsync_s * NS_PER_S)
+        sync_file(rec, now);
+
+    const uint64_t file_bytes = rec->block_offset + (rec->block.footer.count > 0 ? RECORDER_BLOCK_SIZE : 0);
+    if (file_bytes >= rec->config.rotate_bytes || now - rec->file_opened_ns >= rec->config.rotate_s * NS_PER_S) {
+        close_file(rec, now);
+        open_file(rec);
+    }
+}
+
+static void *recorder_thread_main(void *arg) {
+    struct recorder *rec = arg;
+    struct pollfd stop = {
+        .fd = rec->stop_fd,
+        .events = POLLIN
+    };
+
+    while (1) {
+        const int n = poll(&stop, 1, RECORDER_FLUSH_MS);
+        if (n > 0)
+            break;
+        if (n < 0 && errno != EINTR) {
+            log_errno("poll recorder");
+            break;
+        }
+
+        flush_recorder(rec);
+    }
+
+    // Stopping, what's still queued goes to the current file
+    write_queued(rec);
+    if (rec->fd >= 0)
+        close_file(rec, monotonic_ns());
+
+    return NULL;
+}
+
+int setup_recorder(const struct recorder_config *config, struct recorder *rec) {
+    rec->config = *config;
+    rec->fd = -1;
+    rec->file_seq = 0;
+    reset_block(rec);
+    spsc_queue_init(&rec->queue);
+    atomic_init(&rec->dropped, 0);
+    atomic_init(&rec->recorded, 0);
+    atomic_init(&rec->lost, 0);
+    atomic_init(&rec->bytes, 0);
+    atomic_init(&rec->files, 0);
+    atomic_init(&rec->fsyncs, 0);
+
+    // Fails early on a bad dir
+    if (open_file(rec) < 0)
+        return -1;
+
+    rec->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (rec->stop_fd < 0) {
+        log_errno("eventfd recorder stop_fd");
+        close(rec->fd);
+        return -1;
+    }
+
+    const int err = pthread_create(&rec->thread, NULL, recorder_thread_main, rec);
+    if (err != 0) {
+        log_error("pthread_create recorder: %s", strerror(err));
+        close(rec->stop_fd);
+        close(rec->fd);
+        return -1;
+    }
+
+    pthread_setname_np(rec->thread, "mx5-recorder");
+
+    return 0;
+}
+
+void close_recorder(struct recorder *rec) {
+    struct recorder_stats stats;
+    const uint64_t one = 1;
+
+    if (write(rec->stop_fd, &one, sizeof(one)) < 0)
+        log_errno("write recorder stop_fd");
+
+    pthread_join(rec->thread, NULL);
+    close(rec->stop_fd);
+
+    get_recorder_stats(rec, &stats);
+    log_info("recorder : %" PRIu64 " frames in %" PRIu64 " files, %" PRIu64 " bytes, %" PRIu64 " dropped, %" PRIu64
+             " lost, %" PRIu64 " fsyncs",
+             stats.recorded, stats.files, stats.bytes, stats.dropped, stats.lost, stats.fsyncs);
+}
+
+void record_can_msg(struct recorder *rec, const struct can_msg *msg) {
+    if (!spsc_queue_push(&rec->queue, msg))
+        atomic_fetch_add_explicit(&rec->dropped, 1, memory_order_relaxed);
+}
+
+void get_recorder_stats(struct recorder *rec, struct recorder_stats *stats) {
+    stats->recorded = atomic_load_explicit(&rec->recorded, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&rec->dropped, memory_order_relaxed);
+    stats->lost = atomic_load_explicit(&rec->lost, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&rec->bytes, memory_order_relaxed);
+    stats->files = atomic_load_explicit(&rec->files, memory_order_relaxed);
+    stats->fsyncs = atomic_load_explicit(&rec->fsyncs, memory_order_relaxed);
+}
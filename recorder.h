@@ -0,0 +1,142 @@
+#ifndef MX5METRICSSERVICE_RECORDER_H
+#define MX5METRICSSERVICE_RECORDER_H
+
+#include "metrics.h"
+#include "spsc_queue.h"
+#include <assert.h>
+#include <pthread.h>
+
+// Raw frame recorder : every frame handed over by the ingest backend is queued (never blocking, counted as
+// dropped when the queue is full) and written by the mx5-recorder thread, a block at a time.
+//
+// File : struct recorder_file_header then fixed size blocks (struct recorder_block) until the end, little endian.
+// A block holds up to RECORDER_BLOCK_RECORDS records in time order followed by a footer indexing its time range and
+// CAN ids, so readers can mmap a file, binary search the blocks then the records of a block by timestamp, and skip
+// the blocks without the ids they want (see recording.h). Only a file's last block can be partial : its records and
+// footer are written at every flush, so a file is readable while it's recorded.
+// Files are named <dir>/mx5-<local start time>-<seq>.rec and rotated by size and age.
+
+#define RECORDER_MAGIC             0x5235584d // "MX5R"
+#define RECORDER_VERSION           2
+#define RECORDER_BLOCK_MAGIC       0x4b4c424d // "MBLK"
+#define RECORDER_BLOCK_SIZE        (64 * 1024)
+#define RECORDER_BLOCK_IDS         56 // Ids indexed per block, more set RECORDER_BLOCK_IDS_OVERFLOW
+#define RECORDER_FLUSH_MS          100 // Writer thread period, also the most a record waits in memory
+#define RECORDER_DEFAULT_ROTATE_MB 64
+#define RECORDER_DEFAULT_ROTATE_S  3600
+
+struct recorder_file_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;      // sizeof(struct recorder_record)
+    uint64_t monotonic_ns;     // When the file was opened, CLOCK_MONOTONIC like the record timestamps
+    uint64_t realtime_ns;      // Same instant, CLOCK_REALTIME
+    uint32_t block_size;       // RECORDER_BLOCK_SIZE
+    uint32_t block_records;    // RECORDER_BLOCK_RECORDS
+};
+
+struct recorder_record {
+    uint64_t timestamp_ns;     // CLOCK_MONOTONIC, when the frame was read
+    uint16_t id;
+    uint8_t len;               // Data bytes (the DLC), those past it are 0
+    uint8_t flags;             // 0
+    uint32_t reserved;
+    uint8_t data[8];           // Wire order
+};
+
+#define RECORDER_BLOCK_IDS_OVERFLOW 0x01 // The block has more ids than indexed, ids is incomplete
+
+struct recorder_block_id {
+    uint16_t id;
+    uint16_t count;            // Records with that id in the block
+};
+
+struct recorder_block_footer {
+    uint32_t magic;            // RECORDER_BLOCK_MAGIC
+    uint16_t count;            // Records in the block
+    uint16_t ids_count;
+    uint64_t first_ns;         // Timestamps of the first and last records
+    uint64_t last_ns;
+    uint16_t min_id;
+    uint16_t max_id;
+    uint32_t flags;
+    struct recorder_block_id ids[RECORDER_BLOCK_IDS]; // Sorted by id
+};
+
+#define RECORDER_BLOCK_RECORDS \
+    ((RECORDER_BLOCK_SIZE - sizeof(struct recorder_block_footer)) / sizeof(struct recorder_record))
+
+struct recorder_block {
+    struct recorder_record records[RECORDER_BLOCK_RECORDS];
+    struct recorder_block_footer footer;
+};
+
+static_assert(sizeof(struct recorder_file_header) == 32, "recorder file header layout");
+static_assert(sizeof(struct recorder_record) == 24, "recorder record layout");
+static_assert(sizeof(struct recorder_block_footer) == 256, "recorder block footer layout");
+static_assert(sizeof(struct recorder_block) == RECORDER_BLOCK_SIZE, "recorder blocks are filled up to the footer");
+static_assert(RECORDER_BLOCK_RECORDS <= UINT16_MAX, "recorder block count");
+
+enum recorder_fsync {
+    RECORDER_FSYNC_NEVER,
+    RECORDER_FSYNC_ROTATE,     // When a file is closed
+    RECORDER_FSYNC_INTERVAL    // Every fsync_s seconds, and when a file is closed
+};
+
+struct recorder_config {
+    const char *dir;
+    uint64_t rotate_bytes;
+    uint32_t rotate_s;
+    enum recorder_fsync fsync;
+    uint32_t fsync_s;
+};
+
+struct recorder_stats {
+    uint64_t recorded;         // Taken from the queue
+    uint64_t dropped;          // Queue full
+    uint64_t lost;             // Recorded but failed to be written
+    uint64_t bytes;            // Written, footers included
+    uint64_t files;
+    uint64_t fsyncs;
+};
+
+struct recorder {
+    struct recorder_config config;
+    pthread_t thread;
+    int stop_fd;
+    struct spsc_queue queue;
+    // Producer counters
+    _Atomic uint64_t dropped;
+    // Writer thread
+    int fd;
+    uint32_t file_seq;
+    uint64_t file_opened_ns;
+    uint64_t last_fsync_ns;
+    uint64_t block_offset;     // Of the current block in the file
+    uint32_t block_written;    // Records of the current block already in the file
+    _Alignas(SPSC_CACHE_LINE_SIZE) struct recorder_block block;
+    // Writer counters
+    _Atomic uint64_t recorded;
+    _Atomic uint64_t lost;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t files;
+    _Atomic uint64_t fsyncs;
+};
+
+void init_recorder_config(struct recorder_config *config);
+
+// rotate_mb=<n>, rotate_s=<n> or fsync=<never|rotate|seconds>, returns -1 if invalid
+int parse_recorder_opt(const char *opt, struct recorder_config *config);
+
+// Opens the first file and starts the writer thread
+int setup_recorder(const struct recorder_config *config, struct recorder *rec);
+
+// Writes what's queued, then closes the file
+void close_recorder(struct recorder *rec);
+
+// Producer side, from the decode path only
+void record_can_msg(struct recorder *rec, const struct can_msg *msg);
+
+void get_recorder_stats(struct recorder *rec, struct recorder_stats *stats);
+
+#endif //MX5METRICSSERVICE_RECORDER_H
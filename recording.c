@@ -0,0 +1,141 @@
+#include "recording.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static bool valid_footer(const struct recorder_block_footer *footer) {
+    return footer->magic == RECORDER_BLOCK_MAGIC && footer->count > 0 && footer->count <= RECORDER_BLOCK_RECORDS &&
+           footer->ids_count <= RECORDER_BLOCK_IDS && footer->first_ns <= footer->last_ns;
+}
+
+int open_recording(const char *path, struct recording *rec) {
+    struct stat st;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->path = path;
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (!S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(struct recorder_file_header)) {
+        close(fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct recorder_file_header *header = map;
+    if (header->magic != RECORDER_MAGIC || header->version != RECORDER_VERSION ||
+        header->record_size != sizeof(struct recorder_record) || header->block_size != RECORDER_BLOCK_SIZE ||
+        header->block_records != RECORDER_BLOCK_RECORDS) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    rec->map = map;
+    rec->map_len = st.st_size;
+    rec->header = header;
+    rec->blocks = (const struct recorder_block *)(header + 1);
+
+    // A trailing partial block never got its footer written
+    const size_t blocks_len = st.st_size - sizeof(*header);
+    const size_t blocks_count = blocks_len / RECORDER_BLOCK_SIZE;
+    rec->ignored_blocks = blocks_len % RECORDER_BLOCK_SIZE != 0;
+
+    // Only reads the footers, one page per block
+    for (size_t i = 0; i < blocks_count; i++) {
+        const struct recorder_block_footer *footer = &rec->blocks[i].footer;
+        const bool in_order = i == 0 || footer->first_ns >= rec->blocks[i - 1].footer.last_ns;
+
+        if (!valid_footer(footer) || !in_order) {
+            rec->ignored_blocks += blocks_count - i;
+            break;
+        }
+
+        rec->blocks_count++;
+        rec->records_count += footer->count;
+    }
+
+    return 0;
+}
+
+void close_recording(struct recording *rec) {
+    if (rec->map != NULL)
+        munmap(rec->map, rec->map_len);
+    rec->map = NULL;
+}
+
+size_t find_recording_block(const struct recording *rec, uint64_t timestamp_ns) {
+    size_t lo = 0, hi = rec->blocks_count;
+
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (rec->blocks[mid].footer.last_ns < timestamp_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+size_t find_block_record(const struct recorder_block *block, uint64_t timestamp_ns) {
+    size_t lo = 0, hi = block->footer.count;
+
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (block->records[mid].timestamp_ns < timestamp_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+bool block_has_ids(const struct recorder_block *block, uint16_t min_id, uint16_t max_id) {
+    const struct recorder_block_footer *footer = &block->footer;
+
+    if (max_id < footer->min_id || min_id > footer->max_id)
+        return false;
+
+    // An incomplete id list can't rule anything out
+    if (footer->flags & RECORDER_BLOCK_IDS_OVERFLOW)
+        return true;
+
+    for (size_t i = 0; i < footer->ids_count; i++) {
+        if (footer->ids[i].id >= min_id && footer->ids[i].id <= max_id)
+            return true;
+    }
+
+    return false;
+}
+
+void recording_can_msg(const struct recorder_record *record, struct can_msg *msg) {
+    *msg = (struct can_msg) {
+        .timestamp_ns = record->timestamp_ns,
+        .id = record->id,
+        .len = record->len < sizeof(record->data) ? record->len : sizeof(record->data)
+    };
+
+    for (size_t i = 0; i < msg->len; i++)
+        msg->data |= (uint64_t)record->data[i] << (8 * (sizeof(record->data) - 1 - i));
+}
+
+void advise_recording_sequential(const struct recording *rec) {
+    madvise(rec->map, rec->map_len, MADV_SEQUENTIAL);
+}
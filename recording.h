@@ -0,0 +1,42 @@
+#ifndef MX5METRICSSERVICE_RECORDING_H
+#define MX5METRICSSERVICE_RECORDING_H
+
+#include "recorder.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Read side of the recorder files (format in recorder.h) : a file is mapped read only and searched through its block
+// footers, only the blocks a query needs are ever paged in. Nothing is logged, errors are left in errno.
+
+struct recording {
+    const char *path;
+    void *map;
+    size_t map_len;
+    const struct recorder_file_header *header;
+    const struct recorder_block *blocks;
+    size_t blocks_count;       // Valid blocks, in time order
+    size_t ignored_blocks;     // After the valid ones : unfinished or corrupt, from a crash
+    size_t records_count;
+};
+
+// Returns -1 with errno set, EINVAL if path isn't a recording of this version
+int open_recording(const char *path, struct recording *rec);
+
+void close_recording(struct recording *rec);
+
+// First block ending at or after timestamp_ns, blocks_count if there's none
+size_t find_recording_block(const struct recording *rec, uint64_t timestamp_ns);
+
+// First record of block at or after timestamp_ns, the block's count if there's none
+size_t find_block_record(const struct recorder_block *block, uint64_t timestamp_ns);
+
+// False when block has no record with an id in [min_id, max_id]
+bool block_has_ids(const struct recorder_block *block, uint16_t min_id, uint16_t max_id);
+
+// Frame as it was handed over by the ingest backend
+void recording_can_msg(const struct recorder_record *record, struct can_msg *msg);
+
+// Hints the kernel the blocks will be read in order
+void advise_recording_sequential(const struct recording *rec);
+
+#endif //MX5METRICSSERVICE_RECORDING_H
@@ -0,0 +1,199 @@
+#define LOG_MODULE LOG_MODULE_REPLAY
+
+#include "replay.h"
+#include "log.h"
+#include "monotonic.h"
+#include <stdio.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define NS_PER_S 1000000000ULL
+
+static int map_file(const char *path, struct recording *file) {
+    if (open_recording(path, file) < 0) {
+        if (errno == EINVAL)
+            log_error("%s is not a version %d recording", path, RECORDER_VERSION);
+        else
+            log_error("open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (file->ignored_blocks > 0)
+        log_warn("%s ends with %zu unfinished blocks, ignored", path, file->ignored_blocks);
+
+    // Sequential reads, let the kernel read ahead
+    advise_recording_sequential(file);
+
+    return 0;
+}
+
+static int arm_timer(struct replay_context *ctx, uint64_t deadline_ns) {
+    // 0 disarms
+    const struct itimerspec its = {
+        .it_value = { .tv_sec = deadline_ns / NS_PER_S, .tv_nsec = deadline_ns % NS_PER_S }
+    };
+
+    if (timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        log_errno("timerfd_settime replay");
+        return -1;
+    }
+
+    return 0;
+}
+
+int setup_replay(char **paths, int paths_count, double speed,
+                 can_msg_handler handler, void *handler_arg, struct replay_context *ctx) {
+    size_t frames = 0;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->timer_fd = -1;
+    ctx->speed = speed;
+    ctx->handler = handler;
+    ctx->handler_arg = handler_arg;
+
+    if (paths_count > REPLAY_MAX_FILES) {
+        log_error("too many files to replay (%d, max %d)", paths_count, REPLAY_MAX_FILES);
+        return -1;
+    }
+
+    for (int i = 0; i < paths_count; i++) {
+        if (map_file(paths[i], &ctx->files[i]) < 0) {
+            close_replay(ctx);
+            return -1;
+        }
+        ctx->files_count++;
+        frames += ctx->files[i].records_count;
+    }
+
+    if (frames == 0) {
+        log_error("nothing to replay");
+        close_replay(ctx);
+        return -1;
+    }
+
+    ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ctx->timer_fd < 0) {
+        log_errno("timerfd_create replay");
+        close_replay(ctx);
+        return -1;
+    }
+
+    log_info("replaying %zu frames from %d files at %s", frames, ctx->files_count,
+             speed > 0 ? "recorded pace" : "full speed");
+    if (speed > 0 && speed != 1)
+        log_info("replay speed x%g", speed);
+
+    // Starts with the main loop
+    if (arm_timer(ctx, monotonic_ns()) < 0) {
+        close_replay(ctx);
+        return -1;
+    }
+
+    return ctx->timer_fd;
+}
+
+void close_replay(struct replay_context *ctx) {
+    for (int i = 0; i < ctx->files_count; i++)
+        close_recording(&ctx->files[i]);
+    ctx->files_count = 0;
+
+    if (ctx->timer_fd >= 0)
+        close(ctx->timer_fd);
+}
+
+// NULL once everything was replayed
+static const struct recorder_record *next_record(struct replay_context *ctx) {
+    while (ctx->file < ctx->files_count) {
+        const struct recording *file = &ctx->files[ctx->file];
+
+        if (ctx->block < file->blocks_count) {
+            const struct recorder_block *block = &file->blocks[ctx->block];
+            if (ctx->next < block->footer.count)
+                return &block->records[ctx->next];
+
+            ctx->block++;
+            ctx->next = 0;
+            continue;
+        }
+
+        ctx->file++;
+        ctx->block = 0;
+    }
+
+    return NULL;
+}
+
+static void finish_replay(struct replay_context *ctx, uint64_t now) {
+    const double elapsed_s = (double)(now - ctx->start_ns) / NS_PER_S;
+
+    log_info("replay done : %" PRIu64 " frames in %.3f s, %.0f frames/s",
+             ctx->frames, elapsed_s, elapsed_s > 0 ? ctx->frames / elapsed_s : 0);
+
+    ctx->done = true;
+    arm_timer(ctx, 0);
+}
+
+int handle_replay_timeout(struct replay_context *ctx) {
+    uint64_t expirations;
+
+    if (read(ctx->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        log_errno("read replay timer_fd");
+        return -1;
+    }
+
+    if (ctx->done)
+        return 0;
+
+    const uint64_t now = monotonic_ns();
+
+    for (int n = 0; n < REPLAY_BATCH_SIZE; n++) {
+        const struct recorder_record *record = next_record(ctx);
+        if (record == NULL) {
+            finish_replay(ctx, monotonic_ns());
+            return n;
+        }
+
+        if (!ctx->started) {
+            ctx->start_ns = now;
+            ctx->base_ns = now;
+            ctx->base_timestamp_ns = record->timestamp_ns;
+            ctx->offset_ns = now - record->timestamp_ns;
+            ctx->started = true;
+        }
+        else if (record->timestamp_ns < ctx->last_timestamp_ns) {
+            log_info("replay timestamps go backwards in %s, carrying on from the previous frame",
+                     ctx->files[ctx->file].path);
+
+            ctx->base_ns = ctx->speed > 0
+                           ? ctx->base_ns + (uint64_t)((ctx->last_timestamp_ns - ctx->base_timestamp_ns) / ctx->speed)
+                           : now;
+            ctx->offset_ns = ctx->last_timestamp_ns + ctx->offset_ns - record->timestamp_ns;
+            ctx->base_timestamp_ns = record->timestamp_ns;
+        }
+
+        if (ctx->speed > 0) {
+            const uint64_t due = ctx->base_ns + (uint64_t)((record->timestamp_ns - ctx->base_timestamp_ns) / ctx->speed);
+            if (due > now) {
+                arm_timer(ctx, due);
+                return n;
+            }
+        }
+
+        struct can_msg msg;
+        recording_can_msg(record, &msg);
+        msg.timestamp_ns += ctx->offset_ns;
+
+        ctx->last_timestamp_ns = record->timestamp_ns;
+        ctx->next++;
+        ctx->frames++;
+
+        ctx->handler(&msg, ctx->handler_arg);
+    }
+
+    // More is due right away, after the rest of the loop had its turn
+    arm_timer(ctx, now);
+    return REPLAY_BATCH_SIZE;
+}
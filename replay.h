@@ -0,0 +1,48 @@
+#ifndef MX5METRICSSERVICE_REPLAY_H
+#define MX5METRICSSERVICE_REPLAY_H
+
+#define REPLAY_MAX_FILES  64
+#define REPLAY_BATCH_SIZE 256 // Max frames handed over per wakeup, so clients are still served
+
+#include "metrics.h"
+#include "recording.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Replay backend : feeds recorder files (see recorder.h) to the handler like a live backend, paced by a timerfd.
+// Every timestamp is shifted by the same offset so the first frame lands at the start of the replay : the
+// deltas between frames, and so every decoded, filtered and derived value, are the recorded ones.
+// Faster than recorded (-x above 1, or 0), recorded time runs ahead of the clock, so timestamps end up in the future.
+// They're kept that way for the filters and derived signals, metric ages clamp at 0 instead (see commands.c).
+
+struct replay_context {
+    int timer_fd;
+    double speed;              // Recorded time / replay time, 0 for as fast as possible
+    can_msg_handler handler;
+    void *handler_arg;
+    struct recording files[REPLAY_MAX_FILES];
+    int files_count;
+    int file;                  // Position of the next frame
+    size_t block;
+    size_t next;
+    // Frame n is due at base_ns + (timestamp_ns - base_timestamp_ns) / speed, stamped timestamp_ns + offset_ns.
+    // A timestamp going backwards (files from another boot) starts a new base right after the previous frame.
+    uint64_t base_ns;
+    uint64_t base_timestamp_ns;
+    uint64_t offset_ns;
+    uint64_t last_timestamp_ns;
+    uint64_t start_ns;
+    uint64_t frames;
+    bool started;
+    bool done;
+};
+
+// Maps the files, to be replayed in order. Returns timer_fd, readable whenever frames are due
+int setup_replay(char **paths, int paths_count, double speed,
+                 can_msg_handler handler, void *handler_arg, struct replay_context *ctx);
+
+void close_replay(struct replay_context *ctx);
+
+int handle_replay_timeout(struct replay_context *ctx);
+
+#endif //MX5METRICSSERVICE_REPLAY_H
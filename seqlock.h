@@ -0,0 +1,45 @@
+#ifndef MX5METRICSSERVICE_SEQLOCK_H
+#define MX5METRICSSERVICE_SEQLOCK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Single writer sequence lock : seq is odd while the writer updates the data it protects.
+// Readers never block the writer, they retry when their copy might be torn.
+
+static inline void seqlock_write_begin(_Atomic uint32_t *seq) {
+    const uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    // Data stores must not become visible before seq turns odd
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void seqlock_write_end(_Atomic uint32_t *seq) {
+    const uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_release);
+}
+
+static inline uint32_t seqlock_read_begin(const _Atomic uint32_t *seq) {
+    uint32_t s;
+    while ((s = atomic_load_explicit(seq, memory_order_acquire)) & 1);
+    return s;
+}
+
+static inline bool seqlock_read_retry(const _Atomic uint32_t *seq, uint32_t start) {
+    // Data loads must be done before seq is checked again
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
+
+// Consistent copy of a seqlock protected block of len bytes
+static inline void seqlock_read(const _Atomic uint32_t *seq, void *dst, const void *src, size_t len) {
+    uint32_t start;
+    do {
+        start = seqlock_read_begin(seq);
+        memcpy(dst, src, len);
+    } while (seqlock_read_retry(seq, start));
+}
+
+#endif //MX5METRICSSERVICE_SEQLOCK_H
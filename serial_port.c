@@ -2,7 +2,10 @@
 // Created by rleroux on 4/21/24.
 //
 
+#define LOG_MODULE LOG_MODULE_SERIAL
+
 #include "serial_port.h"
+#include "log.h"
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <stdio.h>
@@ -10,7 +13,7 @@
 int open_serial_port_blocking_io(const char *port_name) {
     int fd = open(port_name, O_RDWR | O_NOCTTY);
     if (fd < 0) {
-        perror("open serial");
+        log_errno("open serial");
         return -1;
     }
 
@@ -19,7 +22,7 @@ int open_serial_port_blocking_io(const char *port_name) {
 
 int set_serial_port_access_exclusive(const int fd) {
     if (ioctl(fd, TIOCEXCL) < 0) {
-        perror("ioctl TIOCEXCL");
+        log_errno("ioctl TIOCEXCL");
         return -1;
     }
 
@@ -28,7 +31,7 @@ int set_serial_port_access_exclusive(const int fd) {
 
 int set_serial_port_access_nonexclusive(const int fd) {
     if (ioctl(fd, TIOCNXCL) < 0) {
-        perror("ioctl TIOCNXCL");
+        log_errno("ioctl TIOCNXCL");
         return -1;
     }
 
@@ -39,7 +42,7 @@ int configure_serial_port(int fd, cc_t vtime, cc_t vmin, speed_t speed) {
     struct termios tty;
 
     if (tcgetattr(fd, &tty) != 0) {
-        perror("tcgetattr");
+        log_errno("tcgetattr");
         return -1;
     }
 
@@ -74,7 +77,7 @@ int configure_serial_port(int fd, cc_t vtime, cc_t vmin, speed_t speed) {
     cfsetspeed(&tty, speed);
 
     if (tcsetattr(fd, TCSANOW, &tty) != 0) {
-        perror("tcsetattr");
+        log_errno("tcsetattr");
         return -1;
     }
 
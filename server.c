@@ -2,19 +2,22 @@
 // Created by rleroux on 4/28/24.
 //
 
+#define LOG_MODULE LOG_MODULE_SERVER
+
 #include "server.h"
+#include "log.h"
+#include "latency.h"
+#include "monotonic.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include "commands.h"
 
-#define REC_BUFFER_SIZE CMD_ID_SIZE
-#define RSP_BUFFER_SIZE CMD_RSP_MAX_SIZE
-
-int setup_server_socket(const char *socket_name)
+int setup_server_socket(const char *socket_name, struct server_context *ctx)
 {
     int fd;
     struct sockaddr_un addr;
@@ -24,7 +27,7 @@ int setup_server_socket(const char *socket_name)
     fd = socket(AF_UNIX, SOCK_DGRAM, 0);
 
     if (fd < 0) {
-        perror("socket");
+        log_errno("socket");
         return -1;
     }
 
@@ -33,51 +36,119 @@ int setup_server_socket(const char *socket_name)
 
     if (bind(fd, (struct sockaddr *) &addr,
              strlen(addr.sun_path) + sizeof (addr.sun_family)) < 0) {
-        perror("bind");
+        log_errno("bind");
         close(fd);
         return -1;
     }
 
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->fd = fd;
+
     return fd;
 }
 
-void close_server_socket(int fd, const char *socket_name) {
-    close(fd);
+void close_server_socket(struct server_context *ctx, const char *socket_name) {
+    close(ctx->fd);
     unlink(socket_name);
 }
 
-int handle_incoming_server_msg(int fd, const struct metrics *metrics)
-{
-    uint8_t rec_buffer[REC_BUFFER_SIZE];
-    uint8_t rsp_buffer[RSP_BUFFER_SIZE];
-
-    struct sockaddr_un client_address;
-    socklen_t client_len = sizeof(struct sockaddr_un);
-
-    ssize_t rec_count = recvfrom(fd, rec_buffer, REC_BUFFER_SIZE, 0,
-                         (struct sockaddr *) &client_address, &client_len);
+// Returns how many datagrams were received, 0 once the socket is drained
+static int receive_batch(struct server_context *ctx) {
+    for (int i = 0; i < SERVER_BATCH_SIZE; i++) {
+        ctx->req_iovs[i].iov_base = ctx->reqs[i];
+        ctx->req_iovs[i].iov_len = CMD_REQ_MAX_SIZE;
+        ctx->req_msgs[i].msg_hdr = (struct msghdr) {
+            .msg_name = &ctx->addrs[i],
+            .msg_namelen = sizeof(ctx->addrs[i]),
+            .msg_iov = &ctx->req_iovs[i],
+            .msg_iovlen = 1
+        };
+    }
 
-    if (rec_count < 0) {
-        perror("recvfrom");
+    const int count = recvmmsg(ctx->fd, ctx->req_msgs, SERVER_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (count < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        log_errno("recvmmsg");
         return -1;
     }
 
-    printf("Got %zd bytes from %s\n", rec_count, client_address.sun_path);
+    return count;
+}
 
-    if (rec_count < REC_BUFFER_SIZE) {
-        printf("Datagram too small");
-        return 0;
+// One sendmmsg for the whole batch, a client that can't be reached doesn't hold the others back
+static void send_batch(struct server_context *ctx, int count) {
+    int sent = 0;
+
+    while (sent < count) {
+        const int c = sendmmsg(ctx->fd, ctx->rsp_msgs + sent, count - sent, MSG_DONTWAIT);
+        if (c < 0) {
+            log_debug("sendmmsg to %s: %m", ((struct sockaddr_un *) ctx->rsp_msgs[sent].msg_hdr.msg_name)->sun_path);
+            sent++;
+        }
+        else {
+            sent += c;
+        }
     }
+}
 
-    printf("cmd id %d %s\n", rec_buffer[0], command_str(rec_buffer[0]));
-
-    size_t rsp_len = handle_command(rec_buffer[0], metrics, rsp_buffer);
+int handle_incoming_server_msg(struct server_context *ctx, const struct command_context *cmd_ctx)
+{
+    int handled = 0;
+    int count;
+
+    ctx->stats.wakeups++;
+
+    while (handled < SERVER_BUDGET && (count = receive_batch(ctx)) > 0) {
+        const uint64_t received_ns = monotonic_ns();
+        int rsp_count = 0;
+
+        for (int i = 0; i < count; i++) {
+            const size_t req_len = ctx->req_msgs[i].msg_len;
+
+            log_debug("got %zu bytes from %s", req_len, ctx->addrs[i].sun_path);
+
+            if (req_len < CMD_ID_SIZE) {
+                log_warn("datagram too small");
+                continue;
+            }
+
+            log_debug("cmd id %d %s", ctx->reqs[i][0], command_str(ctx->reqs[i][0]));
+
+            const struct command_client client = {
+                .addr = &ctx->addrs[i],
+                .addr_len = ctx->req_msgs[i].msg_hdr.msg_namelen
+            };
+
+            ctx->rsp_iovs[rsp_count].iov_base = ctx->rsps[rsp_count];
+            ctx->rsp_iovs[rsp_count].iov_len = handle_command(ctx->reqs[i], req_len, cmd_ctx, &client,
+                                                              ctx->rsps[rsp_count]);
+            ctx->rsp_msgs[rsp_count].msg_hdr = (struct msghdr) {
+                .msg_name = &ctx->addrs[i],
+                .msg_namelen = client.addr_len,
+                .msg_iov = &ctx->rsp_iovs[rsp_count],
+                .msg_iovlen = 1
+            };
+            rsp_count++;
+        }
+
+        send_batch(ctx, rsp_count);
+        if (rsp_count > 0)
+            record_latency_n(LATENCY_STAGE_REPLY, monotonic_ns() - received_ns, rsp_count);
+        handled += count;
+
+        if (count < SERVER_BATCH_SIZE)
+            break;
+    }
 
-    if (sendto(fd, rsp_buffer, rsp_len, 0,
-               (const struct sockaddr *) &client_address, client_len) < 0) {
-        perror("sendto");
+    if (count < 0)
         return -1;
-    }
 
-    return 0;
+    ctx->stats.datagrams += handled;
+    if ((uint64_t)handled > ctx->stats.max_datagrams)
+        ctx->stats.max_datagrams = handled;
+    if (handled >= SERVER_BUDGET)
+        ctx->stats.budget_exhausted++;
+
+    return handled;
 }
@@ -5,12 +5,44 @@
 #ifndef MX5METRICSSERVICE_SERVER_H
 #define MX5METRICSSERVICE_SERVER_H
 
-#include "metrics.h"
+#include "commands.h"
+#include <sys/socket.h>
+#include <sys/un.h>
 
-int setup_server_socket(const char *socket_name);
+#define SERVER_BATCH_SIZE 16 // Datagrams per recvmmsg / sendmmsg
+#define SERVER_BUDGET     64 // Datagrams per wakeup, what's left waits for the next one so ingest isn't starved
 
-void close_server_socket(int fd, const char *socket_name);
+// Main loop counters, filled by main.c
+struct loop_stats {
+    uint64_t wakeups;
+    uint64_t events;
+    uint64_t max_events;      // In one wakeup
+};
 
-int handle_incoming_server_msg(int fd, const struct metrics *metrics);
+struct server_stats {
+    uint64_t wakeups;         // Readable socket wakeups
+    uint64_t datagrams;
+    uint64_t max_datagrams;   // In one wakeup
+    uint64_t budget_exhausted; // Wakeups that left datagrams for the next one
+};
+
+struct server_context {
+    int fd;
+    struct server_stats stats;
+    uint8_t reqs[SERVER_BATCH_SIZE][CMD_REQ_MAX_SIZE];
+    uint8_t rsps[SERVER_BATCH_SIZE][CMD_RSP_MAX_SIZE];
+    struct sockaddr_un addrs[SERVER_BATCH_SIZE];
+    struct iovec req_iovs[SERVER_BATCH_SIZE];
+    struct iovec rsp_iovs[SERVER_BATCH_SIZE];
+    struct mmsghdr req_msgs[SERVER_BATCH_SIZE];
+    struct mmsghdr rsp_msgs[SERVER_BATCH_SIZE];
+};
+
+int setup_server_socket(const char *socket_name, struct server_context *ctx);
+
+void close_server_socket(struct server_context *ctx, const char *socket_name);
+
+// Handles up to SERVER_BUDGET datagrams, returns how many or -1
+int handle_incoming_server_msg(struct server_context *ctx, const struct command_context *cmd_ctx);
 
 #endif //MX5METRICSSERVICE_SERVER_H
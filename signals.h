@@ -0,0 +1,102 @@
+#ifndef MX5METRICSSERVICE_SIGNALS_H
+#define MX5METRICSSERVICE_SIGNALS_H
+
+// Single source of truth for every decoded signal.
+// The shm group structs, decode table, metric commands and their names are all generated from it,
+// adding a signal only takes a new line here (and a new group + CAN_ID_ define for a new CAN ID,
+// or a derive_<group>() function for a new derived group).
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Groups, one per CAN ID. Their order is the shm layout order, faster groups first.
+// X(group, GROUP, can_id, rate_hz, GROUP_SIGNALS)
+#define METRICS_CAN_GROUPS(X)                                                                                     \
+    X(brakes,                  BRAKES,                  CAN_ID_BRAKES,                  100, BRAKES_SIGNALS)     \
+    X(rpm_speed_accel,         RPM_SPEED_ACCEL,         CAN_ID_RPM_SPEED_ACCEL,         100, RPM_SPEED_ACCEL_SIGNALS) \
+    X(wheel_speeds,            WHEEL_SPEEDS,            CAN_ID_WHEEL_SPEEDS,            100, WHEEL_SPEEDS_SIGNALS) \
+    X(coolant_throttle_intake, COOLANT_THROTTLE_INTAKE, CAN_ID_COOLANT_THROTTLE_INTAKE, 10,  COOLANT_THROTTLE_INTAKE_SIGNALS) \
+    X(fuel_level,              FUEL_LEVEL,              CAN_ID_FUEL_LEVEL,              10,  FUEL_LEVEL_SIGNALS)
+
+// Derived groups, computed by derive_<group>() (see derived.c) each time their source group is decoded,
+// then published like the CAN groups. At most one derived group per source group.
+// X(group, GROUP, SOURCE_GROUP, rate_hz, GROUP_SIGNALS)
+#define METRICS_DERIVED_GROUPS(X)                                                     \
+    X(wheel_slip, WHEEL_SLIP, WHEEL_SPEEDS,    100, WHEEL_SLIP_SIGNALS)               \
+    X(drivetrain, DRIVETRAIN, RPM_SPEED_ACCEL, 100, DRIVETRAIN_SIGNALS)
+
+// Every group, in shm layout order. Only the group, GROUP, rate_hz and GROUP_SIGNALS columns are common
+#define METRICS_GROUPS(X)     \
+    METRICS_CAN_GROUPS(X)     \
+    METRICS_DERIVED_GROUPS(X)
+
+// Signals, CAN data bytes are numbered in wire order (byte 0 is the first one).
+// raw = bytes [byte, byte + width) big endian, sign extended if raw_signed
+// value = clamp(filter(raw + offset) * mul / div, min, max)
+// filter and filter_param pick a filter from filters.h (NONE, SMA, EMA, MEDIAN or RATE_LIMIT), rate limits are in the
+// signal's unit per second. A filtered signal is published next to the raw one as <name>_filtered, decoded from the
+// same bytes, and its filter can be changed at startup (-f).
+// X(group, name, NAME, cmd_id, type, unit, byte, width, raw_signed, offset, mul, div, min, max, filter, filter_param)
+
+#define BRAKES_SIGNALS(X) \
+    X(brakes, brakes_pct, BRAKES_PCT, 9, uint8_t, "%", 0, 2, true, -102, 1, 5, 0, UINT8_MAX, NONE, 0) \
+    X(brakes, brakes_pct_filtered, BRAKES_PCT_FILTERED, 17, uint8_t, "%", 0, 2, true, -102, 1, 5, 0, UINT8_MAX, MEDIAN, 5)
+
+#define RPM_SPEED_ACCEL_SIGNALS(X) \
+    X(rpm_speed_accel, rpm, RPM, 1, uint16_t, "rpm", 0, 2, false, 0, 1, 4, 0, UINT16_MAX, NONE, 0) \
+    X(rpm_speed_accel, speed_kmh, SPEED_KMH, 2, uint16_t, "km/h", 4, 2, false, -10000, 1, 100, 0, UINT16_MAX, NONE, 0) \
+    X(rpm_speed_accel, accelerator_pedal_position_pct, ACCELERATOR_PEDAL_POSITION_PCT, 3, uint8_t, "%", 6, 1, false, 0, 1, 2, 0, UINT8_MAX, NONE, 0)
+
+#define WHEEL_SPEEDS_SIGNALS(X) \
+    X(wheel_speeds, fl_speed_kmh, FL_SPEED_KMH, 10, uint16_t, "km/h", 0, 2, false, -10000, 1, 100, 0, UINT16_MAX, NONE, 0) \
+    X(wheel_speeds, fl_speed_kmh_filtered, FL_SPEED_KMH_FILTERED, 20, uint16_t, "km/h", 0, 2, false, -10000, 1, 100, 0, UINT16_MAX, RATE_LIMIT, 150) \
+    X(wheel_speeds, fr_speed_kmh, FR_SPEED_KMH, 11, uint16_t, "km/h", 2, 2, false, -10000, 1, 100, 0, UINT16_MAX, NONE, 0) \
+    X(wheel_speeds, fr_speed_kmh_filtered, FR_SPEED_KMH_FILTERED, 21, uint16_t, "km/h", 2, 2, false, -10000, 1, 100, 0, UINT16_MAX, RATE_LIMIT, 150) \
+    X(wheel_speeds, rl_speed_kmh, RL_SPEED_KMH, 12, uint16_t, "km/h", 4, 2, false, -10000, 1, 100, 0, UINT16_MAX, NONE, 0) \
+    X(wheel_speeds, rl_speed_kmh_filtered, RL_SPEED_KMH_FILTERED, 22, uint16_t, "km/h", 4, 2, false, -10000, 1, 100, 0, UINT16_MAX, RATE_LIMIT, 150) \
+    X(wheel_speeds, rr_speed_kmh, RR_SPEED_KMH, 13, uint16_t, "km/h", 6, 2, false, -10000, 1, 100, 0, UINT16_MAX, NONE, 0) \
+    X(wheel_speeds, rr_speed_kmh_filtered, RR_SPEED_KMH_FILTERED, 23, uint16_t, "km/h", 6, 2, false, -10000, 1, 100, 0, UINT16_MAX, RATE_LIMIT, 150)
+
+#define COOLANT_THROTTLE_INTAKE_SIGNALS(X) \
+    X(coolant_throttle_intake, calculated_engine_load_pct, CALCULATED_ENGINE_LOAD_PCT, 4, uint8_t, "%", 0, 1, false, 0, 100, 255, 0, UINT8_MAX, NONE, 0) \
+    X(coolant_throttle_intake, engine_coolant_temp_c, ENGINE_COOLANT_TEMP_C, 5, int16_t, "C", 1, 1, false, -40, 1, 1, INT16_MIN, INT16_MAX, NONE, 0) \
+    X(coolant_throttle_intake, engine_coolant_temp_c_filtered, ENGINE_COOLANT_TEMP_C_FILTERED, 19, int16_t, "C", 1, 1, false, -40, 1, 1, INT16_MIN, INT16_MAX, SMA, 10) \
+    X(coolant_throttle_intake, throttle_valve_position_pct, THROTTLE_VALVE_POSITION_PCT, 6, uint8_t, "%", 3, 1, false, 0, 100, 255, 0, UINT8_MAX, NONE, 0) \
+    X(coolant_throttle_intake, throttle_valve_position_pct_filtered, THROTTLE_VALVE_POSITION_PCT_FILTERED, 18, uint8_t, "%", 3, 1, false, 0, 100, 255, 0, UINT8_MAX, EMA, 64) \
+    X(coolant_throttle_intake, intake_air_temp_c, INTAKE_AIR_TEMP_C, 7, int16_t, "C", 4, 1, false, -40, 1, 1, INT16_MIN, INT16_MAX, NONE, 0)
+
+#define FUEL_LEVEL_SIGNALS(X) \
+    X(fuel_level, fuel_level_pct, FUEL_LEVEL_PCT, 8, uint8_t, "%", 0, 1, false, 0, 100, 255, 0, UINT8_MAX, NONE, 0) \
+    X(fuel_level, fuel_level_pct_filtered, FUEL_LEVEL_PCT_FILTERED, 24, uint8_t, "%", 0, 1, false, 0, 100, 255, 0, UINT8_MAX, SMA, 10)
+
+// Derived signals, derive_<group>() results are clamped to [min, max]
+// X(group, name, NAME, cmd_id, type, unit, min, max)
+
+// Rear (driven) wheels vs front wheels speed, 0 under 5 km/h
+#define WHEEL_SLIP_SIGNALS(X) \
+    X(wheel_slip, wheel_slip_pct, WHEEL_SLIP_PCT, 14, int16_t, "%", INT16_MIN, INT16_MAX)
+
+// Gear from the rpm / speed ratio, 0 when stopped, in neutral or clutch in.
+// Longitudinal acceleration from the speed delta over the last 100ms
+#define DRIVETRAIN_SIGNALS(X) \
+    X(drivetrain, gear, GEAR, 15, uint8_t, "", 0, 6) \
+    X(drivetrain, longitudinal_accel_mg, LONGITUDINAL_ACCEL_MG, 16, int16_t, "mg", INT16_MIN, INT16_MAX)
+
+// Every decoded signal, in group order
+#define METRICS_DECODED_SIGNALS(X)      \
+    BRAKES_SIGNALS(X)                   \
+    RPM_SPEED_ACCEL_SIGNALS(X)          \
+    WHEEL_SPEEDS_SIGNALS(X)             \
+    COOLANT_THROTTLE_INTAKE_SIGNALS(X)  \
+    FUEL_LEVEL_SIGNALS(X)
+
+#define METRICS_DERIVED_SIGNALS(X)      \
+    WHEEL_SLIP_SIGNALS(X)               \
+    DRIVETRAIN_SIGNALS(X)
+
+// Every signal, in group order. Only the group, name, NAME, cmd_id, type and unit columns are common
+#define METRICS_SIGNALS(X)              \
+    METRICS_DECODED_SIGNALS(X)          \
+    METRICS_DERIVED_SIGNALS(X)
+
+#endif //MX5METRICSSERVICE_SIGNALS_H
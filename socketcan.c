@@ -0,0 +1,122 @@
+#define LOG_MODULE LOG_MODULE_SOCKETCAN
+
+#include "socketcan.h"
+#include "log.h"
+#include "monotonic.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <endian.h>
+#include <net/if.h>
+#include <linux/can/raw.h>
+
+#define MAX_CAN_FILTERS 16
+
+// Same layout as the STN monitoring frames : first data byte is the MSB,
+// bytes past the dlc are zeroed since the kernel doesn't guarantee it
+static uint64_t can_frame_data(const struct can_frame *frame) {
+    uint64_t data;
+
+    if (frame->can_dlc == 0)
+        return 0;
+
+    memcpy(&data, frame->data, sizeof(data));
+    data = be64toh(data);
+
+    if (frame->can_dlc < CAN_MAX_DLEN)
+        data &= ~(UINT64_MAX >> (frame->can_dlc * 8));
+
+    return data;
+}
+
+int setup_socketcan(const char *if_name, const uint16_t *can_ids, int can_ids_count,
+                    can_msg_handler handler, void *handler_arg, struct socketcan_context *ctx) {
+    struct can_filter filters[MAX_CAN_FILTERS];
+    struct sockaddr_can addr = {0};
+
+    if (can_ids_count > MAX_CAN_FILTERS) {
+        log_error("too many can ids to filter (%d, max %d)", can_ids_count, MAX_CAN_FILTERS);
+        return -1;
+    }
+
+    int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (fd < 0) {
+        log_errno("socket PF_CAN");
+        return -1;
+    }
+
+    // Let the kernel drop everything we don't decode, matching standard data frames only
+    for (int i = 0; i < can_ids_count; i++) {
+        filters[i].can_id = can_ids[i];
+        filters[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+    }
+
+    if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters, can_ids_count * sizeof(filters[0])) < 0) {
+        log_errno("setsockopt CAN_RAW_FILTER");
+        close(fd);
+        return -1;
+    }
+
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = (int)if_nametoindex(if_name);
+    if (addr.can_ifindex == 0) {
+        log_errno("if_nametoindex");
+        close(fd);
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        log_errno("bind PF_CAN");
+        close(fd);
+        return -1;
+    }
+
+    for (int i = 0; i < SOCKETCAN_BATCH_SIZE; i++) {
+        ctx->iovs[i].iov_base = &ctx->frames[i];
+        ctx->iovs[i].iov_len = sizeof(ctx->frames[i]);
+        memset(&ctx->msgs[i], 0, sizeof(ctx->msgs[i]));
+        ctx->msgs[i].msg_hdr.msg_iov = &ctx->iovs[i];
+        ctx->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    ctx->fd = fd;
+    ctx->handler = handler;
+    ctx->handler_arg = handler_arg;
+    ctx->frames_count = 0;
+
+    return fd;
+}
+
+void close_socketcan(struct socketcan_context *ctx) {
+    close(ctx->fd);
+}
+
+int handle_incoming_socketcan_msg(struct socketcan_context *ctx) {
+    // Whatever is left after a full batch keeps the fd readable for the next epoll_wait
+    int n = recvmmsg(ctx->fd, ctx->msgs, SOCKETCAN_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        log_errno("recvmmsg");
+        return -1;
+    }
+
+    // Every frame of the batch shares the read timestamp
+    struct can_msg msg = { .timestamp_ns = monotonic_ns() };
+
+    for (int i = 0; i < n; i++) {
+        const struct can_frame *frame = &ctx->frames[i];
+
+        if (ctx->msgs[i].msg_len != sizeof(*frame)) {
+            log_debug("unexpected can frame size %u", ctx->msgs[i].msg_len);
+            continue;
+        }
+
+        ctx->frames_count++;
+        msg.id = (uint16_t)(frame->can_id & CAN_SFF_MASK);
+        msg.data = can_frame_data(frame);
+        msg.len = frame->can_dlc < CAN_MAX_DLEN ? frame->can_dlc : CAN_MAX_DLEN;
+        ctx->handler(&msg, ctx->handler_arg);
+    }
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef MX5METRICSSERVICE_SOCKETCAN_H
+#define MX5METRICSSERVICE_SOCKETCAN_H
+
+#define SOCKETCAN_BATCH_SIZE 32 // Max frames fetched per recvmmsg
+
+#include "metrics.h"
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+
+struct socketcan_context {
+    int fd;
+    can_msg_handler handler;
+    void *handler_arg;
+    struct can_frame frames[SOCKETCAN_BATCH_SIZE];
+    struct iovec iovs[SOCKETCAN_BATCH_SIZE];
+    struct mmsghdr msgs[SOCKETCAN_BATCH_SIZE];
+    uint64_t frames_count;
+};
+
+int setup_socketcan(const char *if_name, const uint16_t *can_ids, int can_ids_count,
+                    can_msg_handler handler, void *handler_arg, struct socketcan_context *ctx);
+
+void close_socketcan(struct socketcan_context *ctx);
+
+int handle_incoming_socketcan_msg(struct socketcan_context *ctx);
+
+#endif //MX5METRICSSERVICE_SOCKETCAN_H
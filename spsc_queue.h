@@ -0,0 +1,71 @@
+#ifndef MX5METRICSSERVICE_SPSC_QUEUE_H
+#define MX5METRICSSERVICE_SPSC_QUEUE_H
+
+#define SPSC_QUEUE_SIZE       4096 // Must be a power of 2
+#define SPSC_QUEUE_MASK       (SPSC_QUEUE_SIZE - 1)
+#define SPSC_CACHE_LINE_SIZE  64
+
+#include "metrics.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lock-free single producer / single consumer queue of can msgs.
+// Positions are free running, each side caches the other side's position
+// so the shared cache lines are only touched when the queue looks full/empty.
+struct spsc_queue {
+    _Alignas(SPSC_CACHE_LINE_SIZE) _Atomic size_t head; // Written by the producer
+    size_t cached_tail;
+
+    _Alignas(SPSC_CACHE_LINE_SIZE) _Atomic size_t tail; // Written by the consumer
+    size_t cached_head;
+
+    _Alignas(SPSC_CACHE_LINE_SIZE) struct can_msg msgs[SPSC_QUEUE_SIZE];
+};
+
+static inline void spsc_queue_init(struct spsc_queue *q) {
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->cached_tail = 0;
+    q->cached_head = 0;
+}
+
+// Producer side, returns false when full
+static inline bool spsc_queue_push(struct spsc_queue *q, const struct can_msg *msg) {
+    const size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if (head - q->cached_tail == SPSC_QUEUE_SIZE) {
+        q->cached_tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (head - q->cached_tail == SPSC_QUEUE_SIZE)
+            return false;
+    }
+
+    q->msgs[head & SPSC_QUEUE_MASK] = *msg;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    return true;
+}
+
+// Consumer side, returns false when empty
+static inline bool spsc_queue_pop(struct spsc_queue *q, struct can_msg *msg) {
+    const size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if (tail == q->cached_head) {
+        q->cached_head = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (tail == q->cached_head)
+            return false;
+    }
+
+    *msg = q->msgs[tail & SPSC_QUEUE_MASK];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+// Approximate when called concurrently, good enough for counters
+static inline size_t spsc_queue_depth(struct spsc_queue *q) {
+    return atomic_load_explicit(&q->head, memory_order_acquire)
+         - atomic_load_explicit(&q->tail, memory_order_acquire);
+}
+
+#endif //MX5METRICSSERVICE_SPSC_QUEUE_H
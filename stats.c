@@ -0,0 +1,188 @@
+#include "stats.h"
+#include "monotonic.h"
+#include <string.h>
+
+#define NS_PER_S 1000000000ULL
+
+#define STATS_SIGNAL_ENUM(NAME, ...) STATS_##NAME,
+enum { STATS_SIGNALS(STATS_SIGNAL_ENUM) STATS_SIGNALS_COUNT };
+
+#define STATS_WINDOW_COUNT(window_s) + 1
+enum { STATS_WINDOWS_COUNT = 0 STATS_WINDOWS(STATS_WINDOW_COUNT) };
+
+#define STATS_WINDOW_S(window_s) window_s,
+static const uint32_t windows_s[STATS_WINDOWS_COUNT] = { STATS_WINDOWS(STATS_WINDOW_S) };
+
+struct stats_def {
+    enum metrics_signal signal;
+    int32_t bucket_min;
+    int32_t bucket_width;
+};
+
+#define STATS_DEF(NAME, bucket_min_, bucket_width_) \
+    [STATS_##NAME] = { SIGNAL_##NAME, bucket_min_, bucket_width_ },
+static const struct stats_def stats_defs[STATS_SIGNALS_COUNT] = { STATS_SIGNALS(STATS_DEF) };
+
+// Index in stats_defs + 1, 0 if the signal has no stats
+#define STATS_BY_SIGNAL(NAME, ...) [SIGNAL_##NAME] = STATS_##NAME + 1,
+static const uint8_t stats_by_signal[METRICS_SIGNALS_COUNT] = { STATS_SIGNALS(STATS_BY_SIGNAL) };
+
+// Monotonic deque of history samples n, their values are increasing (min) or decreasing (max) from front to back.
+// A window never holds more than METRICS_HISTORY_LEN samples so neither does the deque.
+struct deque {
+    uint64_t front;
+    uint64_t back;
+    uint64_t samples[METRICS_HISTORY_LEN];
+};
+
+// Samples [tail, head) of the history ring
+struct window {
+    uint64_t tail;
+    uint64_t head;
+    int64_t sum;
+    uint32_t buckets[STATS_BUCKETS];
+    struct deque min;
+    struct deque max;
+};
+
+static const struct metrics *stats_metrics;
+static struct window windows[STATS_SIGNALS_COUNT][STATS_WINDOWS_COUNT];
+
+static int32_t sample_value(const struct metrics_history *history, uint64_t n) {
+    return history->samples[n & METRICS_HISTORY_MASK].value;
+}
+
+static int bucket(const struct stats_def *def, int32_t value) {
+    const int64_t b = ((int64_t)value - def->bucket_min) / def->bucket_width;
+
+    if (b < 0) return 0;
+    if (b >= STATS_BUCKETS) return STATS_BUCKETS - 1;
+    return (int)b;
+}
+
+// Drops back samples that can't be the min (max) anymore, amortized O(1)
+static void deque_push(struct deque *deque, const struct metrics_history *history, uint64_t n, bool is_max) {
+    const int32_t value = sample_value(history, n);
+
+    while (deque->back > deque->front) {
+        const int32_t back = sample_value(history, deque->samples[(deque->back - 1) & METRICS_HISTORY_MASK]);
+        if (is_max ? back > value : back < value)
+            break;
+        deque->back--;
+    }
+
+    deque->samples[deque->back++ & METRICS_HISTORY_MASK] = n;
+}
+
+static void evict_tail(struct window *window, const struct stats_def *def, const struct metrics_history *history) {
+    const int32_t value = sample_value(history, window->tail);
+
+    window->sum -= value;
+    window->buckets[bucket(def, value)]--;
+
+    if (window->min.back > window->min.front && window->min.samples[window->min.front & METRICS_HISTORY_MASK] == window->tail)
+        window->min.front++;
+    if (window->max.back > window->max.front && window->max.samples[window->max.front & METRICS_HISTORY_MASK] == window->tail)
+        window->max.front++;
+
+    window->tail++;
+}
+
+// Evicts the samples older than now - window
+static void expire_window(struct window *window, const struct stats_def *def, const struct metrics_history *history,
+                          uint32_t window_s, uint64_t now_ns) {
+    const uint64_t window_ns = window_s * NS_PER_S;
+
+    while (window->tail < window->head &&
+           history->samples[window->tail & METRICS_HISTORY_MASK].timestamp_ns + window_ns <= now_ns)
+        evict_tail(window, def, history);
+}
+
+void init_stats(const struct metrics *metrics) {
+    stats_metrics = metrics;
+    memset(windows, 0, sizeof(windows));
+}
+
+void update_stats(enum metrics_signal signal, uint64_t n) {
+    if (stats_by_signal[signal] == 0)
+        return;
+
+    const int index = stats_by_signal[signal] - 1;
+    const struct stats_def *def = &stats_defs[index];
+    const struct metrics_history *history = &stats_metrics->history[signal];
+    const struct metrics_sample *sample = &history->samples[n & METRICS_HISTORY_MASK];
+
+    for (int w = 0; w < STATS_WINDOWS_COUNT; w++) {
+        struct window *window = &windows[index][w];
+
+        // Started with a history that already had samples
+        if (window->head == 0)
+            window->tail = window->head = n;
+
+        window->sum += sample->value;
+        window->buckets[bucket(def, sample->value)]++;
+        deque_push(&window->min, history, n, false);
+        deque_push(&window->max, history, n, true);
+        window->head = n + 1;
+
+        expire_window(window, def, history, windows_s[w], sample->timestamp_ns);
+
+        // The next history push overwrites sample head - METRICS_HISTORY_LEN
+        while (window->head - window->tail > METRICS_HISTORY_LEN - 1)
+            evict_tail(window, def, history);
+    }
+}
+
+static int32_t percentile(const struct window *window, const struct stats_def *def, uint32_t count, int pct,
+                          int32_t min, int32_t max) {
+    // Nearest rank
+    const uint64_t rank = ((uint64_t)count * pct + 99) / 100;
+    uint64_t seen = 0;
+    int b = 0;
+
+    for (; b < STATS_BUCKETS - 1; b++) {
+        seen += window->buckets[b];
+        if (seen >= rank)
+            break;
+    }
+
+    // Highest value of the bucket, never outside of what was actually seen
+    const int64_t value = (int64_t)def->bucket_min + (int64_t)(b + 1) * def->bucket_width - 1;
+    if (value < min) return min;
+    if (value > max) return max;
+    return (int32_t)value;
+}
+
+int get_signal_stats(enum metrics_signal signal, uint32_t window_s, struct signal_stats *stats) {
+    int w = 0;
+
+    if (stats_by_signal[signal] == 0)
+        return -1;
+
+    while (w < STATS_WINDOWS_COUNT && windows_s[w] != window_s)
+        w++;
+    if (w == STATS_WINDOWS_COUNT)
+        return -1;
+
+    const int index = stats_by_signal[signal] - 1;
+    const struct stats_def *def = &stats_defs[index];
+    const struct metrics_history *history = &stats_metrics->history[signal];
+    struct window *window = &windows[index][w];
+
+    // Nothing may have been received for a while
+    expire_window(window, def, history, window_s, monotonic_ns());
+
+    memset(stats, 0, sizeof(*stats));
+    stats->count = (uint32_t)(window->head - window->tail);
+    if (stats->count == 0)
+        return 0;
+
+    stats->min = sample_value(history, window->min.samples[window->min.front & METRICS_HISTORY_MASK]);
+    stats->max = sample_value(history, window->max.samples[window->max.front & METRICS_HISTORY_MASK]);
+    stats->mean = (int32_t)(window->sum / stats->count);
+    stats->p50 = percentile(window, def, stats->count, 50, stats->min, stats->max);
+    stats->p95 = percentile(window, def, stats->count, 95, stats->min, stats->max);
+    stats->p99 = percentile(window, def, stats->count, 99, stats->min, stats->max);
+
+    return 0;
+}
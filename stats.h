@@ -0,0 +1,41 @@
+#ifndef MX5METRICSSERVICE_STATS_H
+#define MX5METRICSSERVICE_STATS_H
+
+#include "metrics.h"
+
+// Sliding window statistics of a few signals, updated in the decode path.
+// Windows are made of the signal's history ring samples, so a window never holds more than
+// METRICS_HISTORY_LEN - 1 samples (over 80s at 100hz).
+// Updates and queries must run on the same thread (the main loop's).
+
+// X(NAME, bucket_min, bucket_width) : percentiles come from STATS_BUCKETS buckets starting at bucket_min,
+// values outside of them land in the first or last one
+#define STATS_SIGNALS(X)              \
+    X(RPM, 0, 32)                     \
+    X(ENGINE_COOLANT_TEMP_C, -40, 1)  \
+    X(BRAKES_PCT, 0, 1)
+
+#define STATS_BUCKETS 256
+
+// Window lengths in seconds, as used in GET_SIGNAL_STATS requests
+#define STATS_WINDOWS(X) X(1) X(10) X(60)
+
+struct signal_stats {
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int32_t mean;
+    int32_t p50;
+    int32_t p95;
+    int32_t p99;
+};
+
+void init_stats(const struct metrics *metrics);
+
+// n is the history sample that was just pushed
+void update_stats(enum metrics_signal signal, uint64_t n);
+
+// Over the last window_s seconds, returns -1 if the signal has no stats or the window doesn't exist
+int get_signal_stats(enum metrics_signal signal, uint32_t window_s, struct signal_stats *stats);
+
+#endif //MX5METRICSSERVICE_STATS_H
@@ -2,215 +2,311 @@
 // Created by rleroux on 5/4/24.
 //
 
+#define LOG_MODULE LOG_MODULE_STNOBD
+
 #include "stnobd.h"
+#include "log.h"
+#include "monotonic.h"
 #include "serial_port.h"
+#include "hex_decoder.h"
+#include "latency.h"
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <assert.h>
 #include <stdint.h>
-#include <stdlib.h>
 #include <time.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
 
 #define WAIT_FOR_FIRST_BYTE 1
 #define INTER_BYTE_TIMEOUT  1
-#define CFG_ACK_LEN         4 // >OK\r
+#define PROMPT_CHAR         '>'
+
+#define MONITORING_RING_MASK (MONITORING_RING_SIZE - 1)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static_assert((MONITORING_RING_SIZE & MONITORING_RING_MASK) == 0, "MONITORING_RING_SIZE must be a power of 2");
 
-static void msleep(int milliseconds) {
-    const struct timespec ts = { .tv_nsec = milliseconds * 1000000, .tv_sec = 0 };
-    nanosleep(&ts, NULL);
+static double elapsed_ms(uint64_t since_ns) {
+    return (double)(monotonic_ns() - since_ns) / 1000000.0;
 }
 
-static int send_cfg_cmd(struct stnobd_context *ctx) {
-    assert(ctx->current_cfg_cmd < ctx->cfg_cmds_count);
-    const char *cmd = ctx->cfg_cmds[ctx->current_cfg_cmd];
-    const size_t cmd_len = strlen(cmd);
+static int arm_timeout(struct stnobd_context *ctx, int milliseconds) {
+    const struct itimerspec its = {
+        .it_value = { .tv_sec = milliseconds / 1000, .tv_nsec = (milliseconds % 1000) * 1000000 }
+    };
+
+    if (timerfd_settime(ctx->timer_fd, 0, &its, NULL) < 0) {
+        log_errno("timerfd_settime");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int disarm_timeout(struct stnobd_context *ctx) {
+    return arm_timeout(ctx, 0);
+}
 
-    printf("sending cfg cmd %.*s\n", (int)strlen(cmd) - 1 /* omit \r */, cmd);
+static int write_cmd(struct stnobd_context *ctx, const char *cmd) {
+    const size_t cmd_len = strlen(cmd);
 
     ssize_t c = write(ctx->fd, cmd, cmd_len);
     if (c < 0) {
-        perror("write send_cfg_cmd");
+        log_errno("write stnobd cmd");
         return -1;
     }
 
-    if (c != cmd_len) {
-        fprintf(stderr, "incomplete write cfg cmd (actual %zd expected %zu)\n", c, cmd_len);
+    if ((size_t)c != cmd_len) {
+        log_error("incomplete write stnobd cmd %.*s (actual %zd expected %zu)",
+                (int)cmd_len - 1 /* omit \r */, cmd, c, cmd_len);
         return -1;
     }
 
     return 0;
 }
 
-static int start_monitoring_mode(struct stnobd_context *ctx) {
-    const char cmd[] = "STM\r";
-    const size_t cmd_len = strlen(cmd);
+static int send_cfg_cmd(struct stnobd_context *ctx) {
+    assert(ctx->current_cfg_cmd < ctx->cfg_cmds_count);
+    const char *cmd = ctx->cfg_cmds[ctx->current_cfg_cmd];
+
+    log_info("sending cfg cmd %.*s", (int)strlen(cmd) - 1 /* omit \r */, cmd);
+
+    ctx->rsp_len = 0;
+    if (write_cmd(ctx, cmd) < 0) return -1;
+
+    return arm_timeout(ctx, STNOBD_CFG_TIMEOUT_MS);
+}
 
+static void reset_monitoring_ring(struct stnobd_context *ctx) {
+    ctx->mon_head = 0;
+    ctx->mon_tail = 0;
+    ctx->mon_scan = 0;
+}
+
+static int start_monitoring_mode(struct stnobd_context *ctx) {
     // Get rid of any existing unwanted bytes
     tcflush(ctx->fd, TCIOFLUSH);
-    ssize_t c = write(ctx->fd, cmd, strlen(cmd));
-    if (c < 0) {
-        perror("write start_monitoring_mode");
-        return -1;
-    }
+    if (write_cmd(ctx, "STM\r") < 0) return -1;
 
-    if (c != cmd_len) {
-        fprintf(stderr, "incomplete write stm cmd (actual %zd expected %zu)\n", c, cmd_len);
-        return -1;
-    }
+    ctx->state = STNOBD_STATE_MONITORING;
+    ctx->first_frame_pending = true;
+    reset_monitoring_ring(ctx);
+
+    return disarm_timeout(ctx);
+}
 
-    ctx->in_monitoring_mode = true;
+static int stop_monitoring_mode(struct stnobd_context *ctx) {
+    // Any char stops monitoring
+    if (write_cmd(ctx, "\r") < 0) return -1;
+
+    ctx->state = STNOBD_STATE_IDLE;
 
     return 0;
 }
 
-static int stop_monitoring_mode(struct stnobd_context *ctx) {
-    const char cmd[] = "\r";
-    const size_t cmd_len = strlen(cmd);
+// A read returning 0, or EIO once the other side of a pty or a USB adapter hung up, fails the same way on every
+// later read while fd stays readable : stop there instead of spinning on it
+static bool is_disconnected(ssize_t c) {
+    return c == 0 || (c < 0 && errno == EIO);
+}
 
-    ssize_t c = write(ctx->fd, cmd, strlen(cmd));
-    if (c < 0) {
-        perror("write stop_monitoring_mode");
-        return -1;
+static int handle_disconnect(struct stnobd_context *ctx) {
+    log_error("adapter disconnected");
+    disarm_timeout(ctx);
+    ctx->state = STNOBD_STATE_DISCONNECTED;
+
+    return STNOBD_DISCONNECTED;
+}
+
+static int handle_monitoring_rsp(struct stnobd_context *ctx) {
+    size_t used = ctx->mon_head - ctx->mon_tail;
+
+    // A full ring without a single \r can only be garbage, drop everything and resync on the next \r
+    if (used == MONITORING_RING_SIZE) {
+        log_debug("no \\r in %zu monitoring bytes, dropping them", used);
+        ctx->mon_dropped_bytes += used;
+        ctx->mon_tail = ctx->mon_head;
+        ctx->mon_scan = ctx->mon_head;
+        used = 0;
     }
 
-    if (c != cmd_len) {
-        fprintf(stderr, "incomplete write stm cmd (actual %zd expected %zu)\n", c, cmd_len);
+    // Fill all the free space with a single syscall, even when it wraps around the end of the ring
+    const size_t head_index = ctx->mon_head & MONITORING_RING_MASK;
+    const size_t free_len = MONITORING_RING_SIZE - used;
+    const size_t first_len = MIN(free_len, MONITORING_RING_SIZE - head_index);
+    struct iovec iov[2] = {
+        { .iov_base = ctx->mon_ring + head_index, .iov_len = first_len },
+        { .iov_base = ctx->mon_ring, .iov_len = free_len - first_len }
+    };
+
+    const uint64_t read_start_ns = monotonic_ns();
+    ssize_t c = readv(ctx->fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+    if (is_disconnected(c))
+        return handle_disconnect(ctx);
+    if (c < 0) {
+        log_errno("readv handle_monitoring_rsp");
         return -1;
     }
 
-    ctx->in_monitoring_mode = false;
+    ctx->mon_head += c;
 
-    return 0;
-}
+    // Every frame of the batch shares the read timestamp
+    struct can_msg msg = { .timestamp_ns = monotonic_ns(), .len = CAN_DATA_STR_LEN / 2 };
+    record_latency(LATENCY_STAGE_READ, msg.timestamp_ns - read_start_ns);
 
-static int handle_monitoring_rsp(struct stnobd_context *ctx, struct metrics *metrics) {
-    uint16_t can_id;
-    uint64_t can_data;
+    // Pull every complete frame out of the ring
+    while (ctx->mon_scan != ctx->mon_head) {
+        const size_t scan_index = ctx->mon_scan & MONITORING_RING_MASK;
+        const size_t segment_len = MIN(ctx->mon_head - ctx->mon_scan, MONITORING_RING_SIZE - scan_index);
 
-    if (ctx->mon_rsp_pos >= MONITORING_RSP_LEN) {
-        ctx->mon_rsp_pos = 0;
-    }
+        const char *cr = memchr(ctx->mon_ring + scan_index, '\r', segment_len);
+        if (cr == NULL) {
+            // No complete frame yet, the rest will come with a later read
+            ctx->mon_scan += segment_len;
+            continue;
+        }
 
-    int n = MONITORING_RSP_LEN - ctx->mon_rsp_pos;
+        const size_t cr_pos = ctx->mon_scan + (cr - (ctx->mon_ring + scan_index));
+        const size_t frame_len = cr_pos - ctx->mon_tail;
+
+        if (frame_len == MONITORING_RSP_LEN - 1 /* \r */) {
+            const size_t tail_index = ctx->mon_tail & MONITORING_RING_MASK;
+            const char *frame = ctx->mon_ring + tail_index;
+
+            // Only a frame straddling the end of the ring needs to be made contiguous
+            char wrapped_frame[MONITORING_RSP_LEN - 1];
+            if (tail_index + frame_len > MONITORING_RING_SIZE) {
+                const size_t before_wrap_len = MONITORING_RING_SIZE - tail_index;
+                memcpy(wrapped_frame, frame, before_wrap_len);
+                memcpy(wrapped_frame + before_wrap_len, ctx->mon_ring, frame_len - before_wrap_len);
+                frame = wrapped_frame;
+            }
+
+            if (decode_hex_frame(frame, &msg.id, &msg.data) < 0) {
+                log_debug("dropping monitoring frame with non hex chars '%.*s'", (int)frame_len, frame);
+                ctx->mon_bad_frames++;
+            }
+            else {
+                ctx->mon_frames++;
+                record_latency(LATENCY_STAGE_PARSE, monotonic_ns() - msg.timestamp_ns);
+                ctx->handler(&msg, ctx->handler_arg);
+
+                if (ctx->first_frame_pending) {
+                    ctx->first_frame_pending = false;
+                    log_info("first metric %.1f ms after reset", elapsed_ms(ctx->reset_start_ns));
+                }
+            }
+        }
+        else if (frame_len > 0) {
+            // Misaligned or unexpected line, resync right after its \r
+            log_debug("dropping %zu bytes of misaligned monitoring data", frame_len);
+            ctx->mon_dropped_bytes += frame_len;
+        }
 
-    ssize_t c = read(ctx->fd, ctx->mon_rsp_buf + ctx->mon_rsp_pos, n);
-    if (c < 0) {
-        perror("read handle_monitoring_rsp");
-        return -1;
+        ctx->mon_tail = cr_pos + 1;
+        ctx->mon_scan = cr_pos + 1;
     }
 
-    //printf("got rsp %zd, '%.*s'\n", c, (int)(c - 1), ctx->mon_rsp_buf + ctx->mon_rsp_pos);
+    return 0;
+}
 
-    // Remember our current progress
-    ctx->mon_rsp_pos += c;
+// Accumulates bytes until the > prompt ends the response.
+// Returns 1 once a full response is in rsp_buf (null terminated), 0 if more bytes are needed, < 0 on errors
+static int read_prompt_rsp(struct stnobd_context *ctx) {
+    // Keep room for the null terminator, an overflowing response is garbage anyway
+    if (ctx->rsp_len >= STNOBD_RSP_BUF_SIZE - 1) {
+        log_warn("stnobd response overflow, dropping %zu bytes", ctx->rsp_len);
+        ctx->rsp_len = 0;
+    }
 
-    if (c != n) {
-        printf("partial rsp (got %zd expected %d)\n", c, n);
-        // No worries, try to get the rest with the next read
-        return 1;
+    ssize_t c = read(ctx->fd, ctx->rsp_buf + ctx->rsp_len, STNOBD_RSP_BUF_SIZE - 1 - ctx->rsp_len);
+    if (is_disconnected(c))
+        return handle_disconnect(ctx);
+    if (c < 0) {
+        log_errno("read stnobd rsp");
+        return -1;
     }
 
-    assert(ctx->mon_rsp_pos == MONITORING_RSP_LEN);
+    ctx->rsp_len += c;
+    ctx->rsp_buf[ctx->rsp_len] = '\0';
 
-    int rsp_last_index = MONITORING_RSP_LEN - 1;
+    return memchr(ctx->rsp_buf, PROMPT_CHAR, ctx->rsp_len) != NULL;
+}
 
-    // Handle misaligned reads
-    if (ctx->mon_rsp_buf[rsp_last_index] != '\r') {
-        printf("expected monitoring msg to end with \\r\n");
+static int send_reset_cmd(struct stnobd_context *ctx) {
+    // Get rid of any existing unwanted bytes
+    tcflush(ctx->fd, TCIOFLUSH);
 
-        char *cr = strchr(ctx->mon_rsp_buf, '\r');
-        if (cr == NULL)
-            // We couldn't find \r, let the next read happen normally in the hopes to finally get it
-            return 1;
+    ctx->state = STNOBD_STATE_RESET;
+    ctx->rsp_len = 0;
+    if (write_cmd(ctx, "ATZ\r") < 0) return -1;
 
-        int cr_index = (int)(cr - ctx->mon_rsp_buf);
-        int after_cr_len = rsp_last_index - cr_index;
+    log_info("STN reset in progress");
 
-        // Move everything after \r to the start of the buffer
-        // and advance pos
-        memmove(ctx->mon_rsp_buf, cr + 1, after_cr_len);
-        ctx->mon_rsp_pos = after_cr_len;
+    return arm_timeout(ctx, STNOBD_RESET_TIMEOUT_MS);
+}
 
-        return 1;
+static int retry_cfg_cmd(struct stnobd_context *ctx) {
+    if (++ctx->retries > STNOBD_MAX_RETRIES) {
+        log_warn("cfg cmd failed %d times, resetting STN", STNOBD_MAX_RETRIES);
+        ctx->retries = 0;
+        return send_reset_cmd(ctx);
     }
 
-    char can_id_str[CAN_ID_STR_LEN + 1 /* null terminator */] = {0};
-    memcpy(can_id_str, ctx->mon_rsp_buf, CAN_ID_STR_LEN);
-    can_id = strtoul(can_id_str, NULL, 16);
-
-    char can_data_str[CAN_DATA_STR_LEN + 1 /* null terminator */] = {0};
-    memcpy(can_data_str, ctx->mon_rsp_buf + CAN_ID_STR_LEN, CAN_DATA_STR_LEN);
-    can_data = strtoull(can_data_str, NULL, 16);
+    log_warn("retrying cfg cmd (attempt %d)", ctx->retries);
+    tcflush(ctx->fd, TCIFLUSH);
 
-    return handle_can_msg(can_id, can_data, metrics);
+    return send_cfg_cmd(ctx);
 }
 
 static int handle_cfg_rsp(struct stnobd_context *ctx) {
-    char buf[CFG_ACK_LEN + 1 /* null terminator */] = {0};
+    int r = read_prompt_rsp(ctx);
+    if (r <= 0) return r;
 
-    msleep(100); // Wait for full response (> prompt char can lag behind initial ack chars)
-    ssize_t c = read(ctx->fd, buf, CFG_ACK_LEN);
-    if (c < 0) {
-        perror("read handle_cfg_rsp");
-        return -1;
+    if (strstr(ctx->rsp_buf, "OK") == NULL) {
+        log_warn("didnt get expected cfg ack '%s'", ctx->rsp_buf);
+        return retry_cfg_cmd(ctx);
     }
 
-    // TODO: Retry
-    if (strstr(buf, "OK") == NULL) {
-        printf("didnt get expected cfg ack %zd, %s\n", c, buf);
-    }
     // Move to next cfg cmd
-    else {
-        ctx->current_cfg_cmd++;
-        if (ctx->current_cfg_cmd >= ctx->cfg_cmds_count)
-        {
-            ctx->must_configure = false;
-            printf("all cfg cmds done\n");
-            start_monitoring_mode(ctx);
-            return 0;
-        }
+    ctx->retries = 0;
+    ctx->current_cfg_cmd++;
+    if (ctx->current_cfg_cmd >= ctx->cfg_cmds_count) {
+        log_info("all cfg cmds done in %.1f ms", elapsed_ms(ctx->cfg_start_ns));
+        log_info("STN ready %.1f ms after reset", elapsed_ms(ctx->reset_start_ns));
+        return start_monitoring_mode(ctx);
     }
 
-    tcflush(ctx->fd, TCIFLUSH);
     return send_cfg_cmd(ctx);
 }
 
 static int handle_reset_rsp(struct stnobd_context *ctx) {
-    // TODO : the startup msg might be chopped when reading and we'd miss it
+    int r = read_prompt_rsp(ctx);
+    if (r <= 0) return r;
 
-    const char startup_msg[] = "ELM327";
-    const int startup_msg_len = strlen(startup_msg);
-    char buf[32] = {0};
-
-    msleep(100); // Wait for full response (> prompt char can lag behind initial startup msg chars)
-    // Read a bunch of bytes in the hope of finding the STN startup msg
-    ssize_t c = read(ctx->fd, buf, sizeof(buf) - 1 /* null terminator */);
-    if (c < 0) {
-        perror("read handle_reset_rsp");
-        return -1;
-    }
-
-    if (c < startup_msg_len) {
-        printf("not enough bytes to contain STN startup msg\n");
+    // A stale prompt from a previous command, the startup msg should follow
+    if (strstr(ctx->rsp_buf, "ELM327") == NULL) {
+        ctx->rsp_len = 0;
         return 0;
     }
 
-    if (strstr(buf, startup_msg) != NULL)
-    {
-        // We got the STN startup message, reset is complete
-        ctx->reset_in_progress = false;
-        // Get rid of whatever might be left in the serial input buffer
-        tcflush(ctx->fd, TCIFLUSH);
-        printf("STN reset done\n");
+    // We got the STN startup message, reset is complete
+    log_info("STN reset done in %.1f ms", elapsed_ms(ctx->reset_start_ns));
 
-        send_cfg_cmd(ctx);
-    }
+    ctx->state = STNOBD_STATE_CONFIGURE;
+    ctx->retries = 0;
+    ctx->current_cfg_cmd = 0;
+    ctx->cfg_start_ns = monotonic_ns();
 
-    return 0;
+    return send_cfg_cmd(ctx);
 }
 
 int setup_stnobd(const char *port_name, speed_t baud_rate,
-                 char **cfg_cmds, int cfg_cmds_count, struct stnobd_context *ctx) {
+                 char **cfg_cmds, int cfg_cmds_count,
+                 can_msg_handler handler, void *handler_arg, struct stnobd_context *ctx) {
     int fd = open_serial_port_blocking_io(port_name);
     if (fd < 0) return -1;
 
@@ -221,62 +317,92 @@ int setup_stnobd(const char *port_name, speed_t baud_rate,
         return -1;
     }
 
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer_fd < 0) {
+        log_errno("timerfd_create");
+        set_serial_port_access_nonexclusive(fd);
+        return -1;
+    }
+
     ctx->fd = fd;
-    ctx->reset_in_progress = false;
-    ctx->must_configure = false;
+    ctx->timer_fd = timer_fd;
+    ctx->state = STNOBD_STATE_IDLE;
+    ctx->handler = handler;
+    ctx->handler_arg = handler_arg;
     ctx->cfg_cmds = cfg_cmds;
     ctx->cfg_cmds_count = cfg_cmds_count;
     ctx->current_cfg_cmd = 0;
+    ctx->retries = 0;
+    ctx->rsp_len = 0;
+    ctx->first_frame_pending = false;
+    ctx->mon_frames = 0;
+    ctx->mon_bad_frames = 0;
+    ctx->mon_dropped_bytes = 0;
+    reset_monitoring_ring(ctx);
 
     return fd;
 }
 
 void close_stnobd(struct stnobd_context *ctx) {
-    if (ctx->in_monitoring_mode) stop_monitoring_mode(ctx);
-    set_serial_port_access_nonexclusive(ctx->fd);
+    if (ctx->state == STNOBD_STATE_MONITORING) stop_monitoring_mode(ctx);
+    if (ctx->state != STNOBD_STATE_DISCONNECTED) set_serial_port_access_nonexclusive(ctx->fd);
+    close(ctx->timer_fd);
     close(ctx->fd);
 }
 
-int handle_incoming_stnobd_msg(struct stnobd_context *ctx, struct metrics *metrics)
+int handle_incoming_stnobd_msg(struct stnobd_context *ctx)
 {
-    if (ctx->reset_in_progress)
-        return handle_reset_rsp(ctx);
-
-    if (ctx->must_configure)
-        return handle_cfg_rsp(ctx);
-
-    if (ctx->in_monitoring_mode)
-        return handle_monitoring_rsp(ctx, metrics);
+    switch (ctx->state) {
+        case STNOBD_STATE_RESET:
+            return handle_reset_rsp(ctx);
+        case STNOBD_STATE_CONFIGURE:
+            return handle_cfg_rsp(ctx);
+        case STNOBD_STATE_MONITORING:
+            return handle_monitoring_rsp(ctx);
+        case STNOBD_STATE_DISCONNECTED:
+            return STNOBD_DISCONNECTED;
+        default:
+            break;
+    }
 
     // TODO
     char buf[255] = {0};
     ssize_t c = read(ctx->fd, buf, 255 - 1);
+    if (is_disconnected(c))
+        return handle_disconnect(ctx);
     tcflush(ctx->fd, TCIFLUSH);
-    printf("unknown stn msg (%zd bytes) %s\n", c, buf);
+    log_warn("unknown stn msg (%zd bytes) %s", c, buf);
 
     return 0;
 }
 
-int send_stnobd_reset_cmd(struct stnobd_context *ctx) {
-    const char cmd[] = "ATZ\r";
-    size_t cmd_len = strlen(cmd);
+int handle_stnobd_timeout(struct stnobd_context *ctx) {
+    uint64_t expirations;
 
-    // Get rid of any existing unwanted bytes
-    tcflush(ctx->fd, TCIOFLUSH);
-    ssize_t c = write(ctx->fd, cmd, cmd_len);
-    if (c < 0) {
-        perror("write send_stnobd_reset_cmd");
+    if (read(ctx->timer_fd, &expirations, sizeof(expirations)) < 0) {
+        log_errno("read stnobd timer_fd");
         return -1;
     }
 
-    if (c != cmd_len) {
-        fprintf(stderr, "incomplete write reset cmd (actual %zd expected %zu)\n", c, cmd_len);
-        return -1;
+    switch (ctx->state) {
+        case STNOBD_STATE_RESET:
+            // The adapter might not be powered yet, keep trying
+            ctx->retries++;
+            log_warn("STN reset timed out (attempt %d), retrying", ctx->retries);
+            return send_reset_cmd(ctx);
+
+        case STNOBD_STATE_CONFIGURE:
+            log_warn("cfg cmd timed out");
+            return retry_cfg_cmd(ctx);
+
+        default:
+            return 0;
     }
+}
 
-    ctx->reset_in_progress = true;
-    ctx->must_configure = true;
+int send_stnobd_reset_cmd(struct stnobd_context *ctx) {
+    ctx->retries = 0;
+    ctx->reset_start_ns = monotonic_ns();
 
-    printf("STN reset in progress\n");
-    return 0;
+    return send_reset_cmd(ctx);
 }
@@ -14,30 +14,66 @@
 #define CAN_ID_STR_LEN      3
 #define CAN_DATA_STR_LEN    16
 #define MONITORING_RSP_LEN  (CAN_ID_STR_LEN + CAN_DATA_STR_LEN + 1 /* \r */)
+#define MONITORING_RING_SIZE 4096 // Must be a power of 2
+
+#define STNOBD_RSP_BUF_SIZE     256
+#define STNOBD_RESET_TIMEOUT_MS 2000
+#define STNOBD_CFG_TIMEOUT_MS   500
+#define STNOBD_MAX_RETRIES      3
 
 #include "metrics.h"
 #include <termios.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
+enum stnobd_state {
+    STNOBD_STATE_IDLE,
+    STNOBD_STATE_RESET,
+    STNOBD_STATE_CONFIGURE,
+    STNOBD_STATE_MONITORING,
+    STNOBD_STATE_DISCONNECTED // EOF or EIO on fd, the adapter is gone and nothing more can be read
+};
+
+// handle_incoming_stnobd_msg() result once disconnected, fd must no longer be polled
+#define STNOBD_DISCONNECTED (-2)
+
 struct stnobd_context {
     int fd;
-    bool reset_in_progress;
-    bool must_configure;
-    bool in_monitoring_mode;
+    int timer_fd; // Response timeouts, must be polled along with fd
+    enum stnobd_state state;
+    can_msg_handler handler;
+    void *handler_arg;
     char **cfg_cmds;
     int cfg_cmds_count;
     int current_cfg_cmd;
-    char mon_rsp_buf[MONITORING_RSP_LEN];
-    ssize_t mon_rsp_pos;
+    int retries;
+    // Reset and cfg responses are accumulated until the > prompt
+    char rsp_buf[STNOBD_RSP_BUF_SIZE];
+    size_t rsp_len;
+    // Startup latency
+    uint64_t reset_start_ns;
+    uint64_t cfg_start_ns;
+    bool first_frame_pending;
+    // Monitoring stream ring buffer, positions are free running and masked on access
+    char mon_ring[MONITORING_RING_SIZE];
+    size_t mon_head; // Next byte to be written by read()
+    size_t mon_tail; // Start of the frame currently being assembled
+    size_t mon_scan; // Next byte to be checked for \r
+    uint64_t mon_frames;
+    uint64_t mon_bad_frames;
+    uint64_t mon_dropped_bytes;
 };
 
 int setup_stnobd(const char *port_name, speed_t baud_rate,
-                 char **cfg_cmds, int cfg_cmds_count, struct stnobd_context *ctx);
+                 char **cfg_cmds, int cfg_cmds_count,
+                 can_msg_handler handler, void *handler_arg, struct stnobd_context *ctx);
 
 void close_stnobd(struct stnobd_context *ctx);
 
-int handle_incoming_stnobd_msg(struct stnobd_context *ctx, struct metrics *metrics);
+int handle_incoming_stnobd_msg(struct stnobd_context *ctx);
+
+int handle_stnobd_timeout(struct stnobd_context *ctx);
 
 int send_stnobd_reset_cmd(struct stnobd_context *ctx);
 
@@ -0,0 +1,278 @@
+#define LOG_MODULE LOG_MODULE_SUBSCRIPTIONS
+
+#include "subscriptions.h"
+#include "log.h"
+#include "commands.h"
+#include "monotonic.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/timerfd.h>
+
+#define NS_PER_S       1000000000ULL
+#define STALL_RETRY_NS 10000000ULL // Full subscriber socket
+
+#define UPDATE_HEADER_SIZE 2
+#define UPDATE_ENTRY_SIZE  (1 + sizeof(int32_t) + sizeof(uint64_t))
+
+static_assert(METRICS_SIGNALS_COUNT <= 64, "subscription masks are 64 bits");
+static_assert(UPDATE_HEADER_SIZE + METRICS_SIGNALS_COUNT * UPDATE_ENTRY_SIZE <= CMD_RSP_MAX_SIZE,
+              "a full update doesn't fit in a datagram");
+
+static int arm_timer(struct subscriptions *subs, uint64_t deadline_ns) {
+    // 0 disarms
+    const struct itimerspec its = {
+        .it_value = { .tv_sec = deadline_ns / NS_PER_S, .tv_nsec = deadline_ns % NS_PER_S }
+    };
+
+    if (timerfd_settime(subs->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        log_errno("timerfd_settime");
+        return -1;
+    }
+
+    return 0;
+}
+
+int setup_subscriptions(int socket_fd, struct subscriptions *subs) {
+    memset(subs, 0, sizeof(*subs));
+
+    subs->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (subs->timer_fd < 0) {
+        log_errno("timerfd_create");
+        return -1;
+    }
+
+    subs->socket_fd = socket_fd;
+
+    return subs->timer_fd;
+}
+
+void close_subscriptions(struct subscriptions *subs) {
+    close(subs->timer_fd);
+}
+
+static struct subscriber *find_subscriber(struct subscriptions *subs, int fd, const struct sockaddr_un *addr,
+                                          socklen_t addr_len) {
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        struct subscriber *sub = &subs->subscribers[i];
+        if (!sub->active || sub->fd != fd)
+            continue;
+        if (fd >= 0 || (sub->addr_len == addr_len && memcmp(&sub->addr, addr, addr_len) == 0))
+            return sub;
+    }
+
+    return NULL;
+}
+
+static void evict_subscriber(struct subscriptions *subs, struct subscriber *sub, const char *reason) {
+    if (sub->fd >= 0)
+        log_info("dropping subscriber fd %d : %s, %" PRIu64 " updates coalesced", sub->fd, reason, sub->coalesced);
+    else
+        log_info("dropping subscriber %s : %s, %" PRIu64 " updates coalesced", sub->addr.sun_path, reason, sub->coalesced);
+    sub->active = false;
+    subs->subscribers_count--;
+}
+
+int subscribe(struct subscriptions *subs, int fd, const struct sockaddr_un *addr, socklen_t addr_len,
+              uint64_t signals, uint16_t max_rate_hz) {
+    struct subscriber *sub = find_subscriber(subs, fd, addr, addr_len);
+
+    if (sub == NULL) {
+        for (int i = 0; i < MAX_SUBSCRIBERS && sub == NULL; i++) {
+            if (!subs->subscribers[i].active)
+                sub = &subs->subscribers[i];
+        }
+        if (sub == NULL)
+            return -1;
+
+        memset(sub, 0, sizeof(*sub));
+        sub->fd = fd;
+        if (fd < 0) {
+            memcpy(&sub->addr, addr, addr_len);
+            sub->addr_len = addr_len;
+        }
+        sub->active = true;
+        subs->subscribers_count++;
+    }
+
+    const uint64_t now = monotonic_ns();
+
+    // Newly subscribed metrics start with their current value, or their first one whatever it is
+    const uint64_t added = signals & ~sub->signals;
+    sub->pending = (sub->pending & signals) | (added & subs->received);
+    sub->unsent = (sub->unsent & signals) | added;
+    sub->signals = signals;
+    sub->interval_ns = max_rate_hz > 0 ? NS_PER_S / max_rate_hz : 0;
+    // A connection's subscription ends with it
+    sub->lease_end_ns = fd >= 0 ? UINT64_MAX : now + SUBSCRIPTION_LEASE_S * NS_PER_S;
+
+    return (int)(sub - subs->subscribers);
+}
+
+int unsubscribe(struct subscriptions *subs, int fd, const struct sockaddr_un *addr, socklen_t addr_len) {
+    struct subscriber *sub = find_subscriber(subs, fd, addr, addr_len);
+
+    if (sub == NULL)
+        return -1;
+
+    evict_subscriber(subs, sub, "unsubscribed");
+    return 0;
+}
+
+void handle_subscriptions_group_update(const struct group_def *group, const int32_t *values,
+                                       uint64_t timestamp_ns, void *arg) {
+    struct subscriptions *subs = arg;
+    uint64_t updated = 0;
+
+    for (int i = 0; i < group->signals_count; i++) {
+        const uint8_t signal = group->signals[i];
+        subs->values[signal] = values[i];
+        subs->timestamps_ns[signal] = timestamp_ns;
+        updated |= 1ULL << signal;
+    }
+    subs->received |= updated;
+
+    if (subs->subscribers_count == 0)
+        return;
+
+    for (int s = 0; s < MAX_SUBSCRIBERS; s++) {
+        struct subscriber *sub = &subs->subscribers[s];
+        uint64_t mask = sub->active ? sub->signals & updated : 0;
+
+        // Only what differs from what the subscriber last got, a value that came back is coalesced away.
+        // Never sent ones have nothing to compare to and stay pending
+        while (mask) {
+            const int signal = __builtin_ctzll(mask);
+            mask &= mask - 1;
+
+            if ((sub->unsent & (1ULL << signal)) || subs->values[signal] != sub->sent[signal]) {
+                if (sub->pending & (1ULL << signal))
+                    sub->coalesced++;
+                sub->pending |= 1ULL << signal;
+            }
+            else {
+                sub->pending &= ~(1ULL << signal);
+            }
+        }
+    }
+}
+
+// Returns -1 if the subscriber is gone
+static int send_update(struct subscriptions *subs, struct subscriber *sub, uint64_t now) {
+    // Bytes :
+    // 0      | 1     | 2 ...
+    // cmd id | count | count times : metric cmd id | value (int32) | timestamp ns (uint64)
+    uint8_t buf[UPDATE_HEADER_SIZE + METRICS_SIGNALS_COUNT * UPDATE_ENTRY_SIZE];
+    size_t len = UPDATE_HEADER_SIZE;
+    uint64_t mask = sub->pending;
+
+    buf[0] = SUBSCRIPTION_UPDATE;
+    buf[1] = __builtin_popcountll(mask);
+
+    while (mask) {
+        const int signal = __builtin_ctzll(mask);
+        mask &= mask - 1;
+
+        buf[len++] = signal_defs[signal].cmd_id;
+        memcpy(buf + len, &subs->values[signal], sizeof(int32_t));
+        len += sizeof(int32_t);
+        memcpy(buf + len, &subs->timestamps_ns[signal], sizeof(uint64_t));
+        len += sizeof(uint64_t);
+    }
+
+    const ssize_t sent = sub->fd >= 0
+                         ? send(sub->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL)
+                         : sendto(subs->socket_fd, buf, len, MSG_DONTWAIT,
+                                  (const struct sockaddr *)&sub->addr, sub->addr_len);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Falling behind, keep the changes pending, newer values will replace them
+            if (sub->stalled_since_ns == 0)
+                sub->stalled_since_ns = now;
+            return 0;
+        }
+
+        // ECONNREFUSED, ENOENT, EPIPE... the client socket is gone
+        log_errno("send subscriber");
+        return -1;
+    }
+
+    mask = sub->pending;
+    while (mask) {
+        const int signal = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        sub->sent[signal] = subs->values[signal];
+    }
+
+    sub->unsent &= ~sub->pending;
+    sub->pending = 0;
+    sub->last_sent_ns = now;
+    sub->stalled_since_ns = 0;
+
+    return 0;
+}
+
+int flush_subscriptions(struct subscriptions *subs) {
+    const uint64_t now = monotonic_ns();
+    uint64_t deadline = 0;
+
+    if (subs->subscribers_count == 0)
+        return 0;
+
+    for (int s = 0; s < MAX_SUBSCRIBERS; s++) {
+        struct subscriber *sub = &subs->subscribers[s];
+        if (!sub->active)
+            continue;
+
+        if (now >= sub->lease_end_ns) {
+            evict_subscriber(subs, sub, "lease expired");
+            continue;
+        }
+
+        if (sub->stalled_since_ns != 0 && now - sub->stalled_since_ns >= SUBSCRIBER_STALL_S * NS_PER_S) {
+            evict_subscriber(subs, sub, "stalled");
+            continue;
+        }
+
+        uint64_t due = sub->lease_end_ns;
+
+        if (sub->pending) {
+            const uint64_t next_send = sub->last_sent_ns + sub->interval_ns;
+
+            if (now >= next_send) {
+                if (send_update(subs, sub, now) < 0) {
+                    evict_subscriber(subs, sub, "unreachable");
+                    continue;
+                }
+            }
+
+            // Still pending : rate limited, or the socket was full
+            if (sub->pending) {
+                const uint64_t retry = now < next_send ? next_send
+                                       : now + (sub->interval_ns > STALL_RETRY_NS ? sub->interval_ns : STALL_RETRY_NS);
+                if (retry < due)
+                    due = retry;
+            }
+        }
+
+        // Nothing to wait for on an idle connection subscriber
+        if (due != UINT64_MAX && (deadline == 0 || due < deadline))
+            deadline = due;
+    }
+
+    return arm_timer(subs, deadline);
+}
+
+int handle_subscriptions_timeout(struct subscriptions *subs) {
+    uint64_t expirations;
+
+    if (read(subs->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        log_errno("read subscriptions timer_fd");
+        return -1;
+    }
+
+    return flush_subscriptions(subs);
+}
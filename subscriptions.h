@@ -0,0 +1,64 @@
+#ifndef MX5METRICSSERVICE_SUBSCRIPTIONS_H
+#define MX5METRICSSERVICE_SUBSCRIPTIONS_H
+
+#include "metrics.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Push mode : subscribers get a datagram with the metrics that changed, at most max rate times per second.
+// Connection subscribers get it as a message on their connection and keep their subscription until they disconnect.
+// Changes are only marked from the decode path and sent by flush_subscriptions(), values that change again
+// before they could be sent are coalesced into one update.
+
+#define MAX_SUBSCRIBERS          16
+#define SUBSCRIPTION_LEASE_S     30 // Subscribing again renews it
+#define SUBSCRIBER_STALL_S       5  // A subscriber whose socket stays full that long is dropped
+
+struct subscriber {
+    bool active;
+    int fd;                                    // Connection socket, -1 for datagram subscribers
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    uint64_t signals;                          // Bit per enum metrics_signal
+    uint64_t pending;                          // Changed since last sent
+    uint64_t unsent;                           // Subscribed but never sent since, sent[] is meaningless for them
+    uint64_t interval_ns;                      // 1 / max rate, 0 for every change
+    uint64_t last_sent_ns;
+    uint64_t lease_end_ns;
+    uint64_t stalled_since_ns;                 // 0 unless the last send hit a full socket
+    uint64_t coalesced;                        // Updates merged into a later one
+    int32_t sent[METRICS_SIGNALS_COUNT];       // Last values sent
+};
+
+struct subscriptions {
+    int socket_fd;                             // Server socket, updates are sent from it
+    int timer_fd;                              // Next rate limited update or lease end
+    int subscribers_count;
+    uint64_t received;                         // Bit per enum metrics_signal, received at least once
+    int32_t values[METRICS_SIGNALS_COUNT];
+    uint64_t timestamps_ns[METRICS_SIGNALS_COUNT];
+    struct subscriber subscribers[MAX_SUBSCRIBERS];
+};
+
+int setup_subscriptions(int socket_fd, struct subscriptions *subs);
+
+void close_subscriptions(struct subscriptions *subs);
+
+// Adds or renews the subscription of connection fd, or of addr when fd is -1, which replaces the previous one.
+// Returns the subscriber's index, -1 if the table is full
+int subscribe(struct subscriptions *subs, int fd, const struct sockaddr_un *addr, socklen_t addr_len,
+              uint64_t signals, uint16_t max_rate_hz);
+
+// Returns -1 if connection fd, or addr when fd is -1, wasn't subscribed
+int unsubscribe(struct subscriptions *subs, int fd, const struct sockaddr_un *addr, socklen_t addr_len);
+
+// group_listener, marks the changed values
+void handle_subscriptions_group_update(const struct group_def *group, const int32_t *values,
+                                       uint64_t timestamp_ns, void *arg);
+
+// Sends what's due, evicts idle and dead subscribers then arms the timer for what's left
+int flush_subscriptions(struct subscriptions *subs);
+
+int handle_subscriptions_timeout(struct subscriptions *subs);
+
+#endif //MX5METRICSSERVICE_SUBSCRIPTIONS_H
@@ -0,0 +1,125 @@
+// Replay at full speed : the recorded spacing runs ahead of the clock, metric ages must still be right
+
+#include "../replay.h"
+#include "../recorder.h"
+#include "../commands.h"
+#include "../server.h"
+#include "../monotonic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#define FRAMES_COUNT 100
+#define FRAME_GAP_NS (100 * 1000000ULL) // 10 s recorded, replayed in no time
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d : %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+static void decode_msg(const struct can_msg *msg, void *arg) {
+    handle_can_msg(msg, arg);
+}
+
+// Records FRAMES_COUNT rpm frames in dir, path gets the file's name
+static int record_session(const char *dir, char *path, size_t path_size) {
+    static struct recorder rec;
+    struct recorder_config config;
+
+    init_recorder_config(&config);
+    config.dir = dir;
+    if (setup_recorder(&config, &rec) < 0)
+        return -1;
+
+    for (int i = 0; i < FRAMES_COUNT; i++) {
+        const struct can_msg msg = {
+            .timestamp_ns = 1000000000ULL + i * FRAME_GAP_NS,
+            .data = 0x1f40000027100000ULL,
+            .id = CAN_ID_RPM_SPEED_ACCEL,
+            .len = 8
+        };
+        record_can_msg(&rec, &msg);
+    }
+    close_recorder(&rec);
+
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return -1;
+
+    int found = -1;
+    for (struct dirent *entry; (entry = readdir(d)) != NULL;) {
+        if (strstr(entry->d_name, ".rec") != NULL) {
+            snprintf(path, path_size, "%s/%s", dir, entry->d_name);
+            found = 0;
+        }
+    }
+    closedir(d);
+
+    return found;
+}
+
+static void test_full_speed_ages(void) {
+    static struct replay_context replay;
+    static struct subscriptions subscriptions;
+    static uint8_t buf[CMD_RSP_MAX_SIZE];
+    const struct loop_stats loop_stats = { 0 };
+    const struct server_stats server_stats = { 0 };
+    char dir[] = "/tmp/mx5-replay-test-XXXXXX";
+    char path[512];
+    uint64_t rsp[2];
+
+    struct metrics *metrics = calloc(1, sizeof(*metrics));
+    CHECK(metrics != NULL && mkdtemp(dir) != NULL);
+    if (failures > 0)
+        return;
+
+    init_metrics(metrics);
+    CHECK(record_session(dir, path, sizeof(path)) == 0);
+
+    char *paths[] = { path };
+    CHECK(setup_replay(paths, 1, 0, decode_msg, metrics, &replay) >= 0);
+    while (!replay.done && failures == 0)
+        CHECK(handle_replay_timeout(&replay) >= 0);
+    CHECK(replay.frames == FRAMES_COUNT);
+
+    const struct command_context ctx = {
+        .metrics = metrics,
+        .subscriptions = &subscriptions,
+        .loop_stats = &loop_stats,
+        .server_stats = &server_stats
+    };
+
+    // The last frame is stamped 9.9 s ahead, it was just decoded all the same
+    const uint8_t timestamp_req[] = { GET_METRIC_TIMESTAMP, GET_RPM };
+    CHECK(handle_command(timestamp_req, sizeof(timestamp_req), &ctx, NULL, buf) == 1 + sizeof(rsp));
+    memcpy(rsp, buf + 1, sizeof(rsp));
+    CHECK(buf[0] == GET_METRIC_TIMESTAMP);
+    CHECK(rsp[0] > monotonic_ns());
+    CHECK(rsp[1] == 0);
+
+    const uint8_t fresh_req[] = { GET_FRESH_METRIC, GET_RPM, 0xe8, 0x03, 0, 0 /* 1000 ms */ };
+    handle_command(fresh_req, sizeof(fresh_req), &ctx, NULL, buf);
+    CHECK(buf[0] == GET_RPM);
+
+    close_replay(&replay);
+    unlink(path);
+    rmdir(dir);
+    free(metrics);
+}
+
+int main(void) {
+    test_full_speed_ages();
+
+    if (failures > 0)
+        return EXIT_FAILURE;
+
+    printf("replay_test passed\n");
+    return 0;
+}
@@ -0,0 +1,117 @@
+// Subscription updates : a newly subscribed signal is always pushed once, whatever its value
+
+#include "../subscriptions.h"
+#include "../commands.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define SIGNAL_BIT(signal) (1ULL << (signal))
+
+static int failures;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d : %s failed\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+// Frame of the rpm_speed_accel group with every signal at value
+static void update_rpm_speed_accel(struct subscriptions *subs, int32_t value) {
+    const struct group_def *group = &group_defs[METRICS_GROUP_RPM_SPEED_ACCEL];
+    int32_t values[64];
+
+    for (int i = 0; i < group->signals_count; i++)
+        values[i] = value;
+    handle_subscriptions_group_update(group, values, 1, subs);
+}
+
+// Value pushed for signal in the next update, -1 if there was no update or it wasn't in it
+static int received_value(int fd, enum metrics_signal signal, int32_t *value) {
+    uint8_t buf[CMD_RSP_MAX_SIZE];
+
+    const ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 2 || buf[0] != SUBSCRIPTION_UPDATE)
+        return -1;
+
+    for (size_t entry = 2; entry + 13 <= (size_t)len; entry += 13) {
+        if (buf[entry] == signal_defs[signal].cmd_id) {
+            memcpy(value, buf + entry + 1, sizeof(*value));
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void test_first_value_zero(void) {
+    static struct subscriptions subs;
+    int fds[2];
+    int32_t value = -1;
+
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+    CHECK(setup_subscriptions(-1, &subs) >= 0);
+
+    // Subscribed before anything was received, then the first value is 0 like sent[] starts
+    CHECK(subscribe(&subs, fds[0], NULL, 0, SIGNAL_BIT(SIGNAL_RPM), 0) >= 0);
+    update_rpm_speed_accel(&subs, 0);
+    flush_subscriptions(&subs);
+
+    CHECK(received_value(fds[1], SIGNAL_RPM, &value) == 0);
+    CHECK(value == 0);
+
+    // Then only changes
+    update_rpm_speed_accel(&subs, 0);
+    flush_subscriptions(&subs);
+    CHECK(received_value(fds[1], SIGNAL_RPM, &value) < 0);
+
+    close_subscriptions(&subs);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_resubscribed_same_value(void) {
+    static struct subscriptions subs;
+    int fds[2];
+    int32_t value = -1;
+
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+    CHECK(setup_subscriptions(-1, &subs) >= 0);
+
+    CHECK(subscribe(&subs, fds[0], NULL, 0, SIGNAL_BIT(SIGNAL_RPM), 0) >= 0);
+    update_rpm_speed_accel(&subs, 5);
+    flush_subscriptions(&subs);
+    CHECK(received_value(fds[1], SIGNAL_RPM, &value) == 0 && value == 5);
+
+    // Dropped then added back : its last sent value must not hide the current one
+    CHECK(subscribe(&subs, fds[0], NULL, 0, SIGNAL_BIT(SIGNAL_SPEED_KMH), 0) >= 0);
+    update_rpm_speed_accel(&subs, 7);
+    flush_subscriptions(&subs);
+    CHECK(received_value(fds[1], SIGNAL_RPM, &value) < 0);
+
+    CHECK(subscribe(&subs, fds[0], NULL, 0, SIGNAL_BIT(SIGNAL_RPM) | SIGNAL_BIT(SIGNAL_SPEED_KMH), 0) >= 0);
+    update_rpm_speed_accel(&subs, 5);
+    flush_subscriptions(&subs);
+    value = -1;
+    CHECK(received_value(fds[1], SIGNAL_RPM, &value) == 0);
+    CHECK(value == 5);
+
+    close_subscriptions(&subs);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void) {
+    test_first_value_zero();
+    test_resubscribed_same_value();
+
+    if (failures > 0)
+        return EXIT_FAILURE;
+
+    printf("subscriptions_test passed\n");
+    return 0;
+}
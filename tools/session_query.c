@@ -0,0 +1,241 @@
+// Extracts a time window of recorder files (see recorder.h) as decoded metrics, one CSV row per frame.
+// Only the blocks overlapping the window and the CAN id range are read, found through the block footers.
+//
+// session_query [-f from_s] [-t to_s] [-i id[-id]] [-s signal,...] [-p preroll_s] file...
+//
+// Times are seconds since the first frame of the session, whose files are given in order. Frames from preroll_s
+// before the window are decoded but not printed so filtered and derived signals are settled when it starts.
+
+#include "../recording.h"
+#include "../metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define NS_PER_S          UINT64_C(1000000000)
+#define DEFAULT_PREROLL_S 2.0
+#define MAX_FILES         256
+
+struct query {
+    uint64_t preroll_ns;       // Absolute CLOCK_MONOTONIC timestamps, like the records
+    uint64_t from_ns;
+    uint64_t to_ns;
+    uint16_t min_id;
+    uint16_t max_id;
+    const struct signal_def *columns[METRICS_SIGNALS_COUNT];
+    int columns_count;
+    uint64_t session_ns;       // First frame of the session
+    uint64_t session_realtime_ns;
+    // Results
+    size_t blocks_read;
+    size_t blocks_total;
+    size_t frames;
+};
+
+static struct metrics metrics;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-f from_s] [-t to_s] [-i id[-id]] [-s signal,...] [-p preroll_s] file...\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static int parse_seconds(const char *str, double *seconds) {
+    char *end;
+
+    *seconds = strtod(str, &end);
+    return *end != '\0' || end == str || *seconds < 0 ? -1 : 0;
+}
+
+// Hex, a single id or an inclusive range
+static int parse_ids(const char *str, uint16_t *min_id, uint16_t *max_id) {
+    char *end;
+
+    const unsigned long min = strtoul(str, &end, 16);
+    unsigned long max = min;
+    if (*end == '-')
+        max = strtoul(end + 1, &end, 16);
+
+    if (*end != '\0' || min > max || max > METRICS_MAX_CAN_ID)
+        return -1;
+
+    *min_id = min;
+    *max_id = max;
+    return 0;
+}
+
+static int parse_columns(char *str, struct query *query) {
+    for (char *name = strtok(str, ","); name != NULL; name = strtok(NULL, ",")) {
+        const struct signal_def *def = NULL;
+        for (int i = 0; i < METRICS_SIGNALS_COUNT && def == NULL; i++) {
+            if (strcmp(signal_defs[i].name, name) == 0)
+                def = &signal_defs[i];
+        }
+
+        if (def == NULL || query->columns_count == METRICS_SIGNALS_COUNT) {
+            fprintf(stderr, "unknown signal %s\n", name);
+            return -1;
+        }
+        query->columns[query->columns_count++] = def;
+    }
+
+    return 0;
+}
+
+static void print_header(const struct query *query) {
+    printf("time_s,unix_time_s,can_id");
+    for (int i = 0; i < query->columns_count; i++)
+        printf(",%s", query->columns[i]->name);
+    printf("\n");
+}
+
+static void print_row(const struct query *query, const struct can_msg *msg) {
+    struct metrics_snapshot snapshot;
+
+    read_snapshot(&metrics, &snapshot);
+
+    const uint64_t since_ns = msg->timestamp_ns - query->session_ns;
+    const uint64_t unix_ns = query->session_realtime_ns + since_ns;
+    printf("%" PRIu64 ".%06" PRIu64 ",%" PRIu64 ".%06" PRIu64 ",%03x",
+           since_ns / NS_PER_S, since_ns / 1000 % 1000000, unix_ns / NS_PER_S, unix_ns / 1000 % 1000000, msg->id);
+
+    // Empty until the signal's group was first decoded
+    for (int i = 0; i < query->columns_count; i++) {
+        const struct signal_def *def = query->columns[i];
+        if (snapshot.timestamps_ns[def->group] == 0)
+            printf(",");
+        else
+            printf(",%d", snapshot.values[def - signal_defs]);
+    }
+    printf("\n");
+}
+
+// Returns false once past the window
+static bool query_block(struct query *query, const struct recorder_block *block) {
+    if (block->footer.first_ns > query->to_ns)
+        return false;
+
+    if (!block_has_ids(block, query->min_id, query->max_id))
+        return true;
+
+    query->blocks_read++;
+
+    for (size_t r = find_block_record(block, query->preroll_ns); r < block->footer.count; r++) {
+        const struct recorder_record *record = &block->records[r];
+        if (record->timestamp_ns > query->to_ns)
+            return false;
+        if (record->id < query->min_id || record->id > query->max_id)
+            continue;
+
+        struct can_msg msg;
+        recording_can_msg(record, &msg);
+        if (handle_can_msg(&msg, &metrics) < 0)
+            continue;
+
+        if (msg.timestamp_ns >= query->from_ns) {
+            print_row(query, &msg);
+            query->frames++;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    static struct recording files[MAX_FILES];
+    struct query query = {
+        .max_id = METRICS_MAX_CAN_ID
+    };
+    double from_s = 0, to_s = -1, preroll_s = DEFAULT_PREROLL_S;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:t:i:s:p:")) != -1) {
+        switch (opt) {
+            case 'f':
+                if (parse_seconds(optarg, &from_s) < 0)
+                    usage(argv[0]);
+                break;
+            case 't':
+                if (parse_seconds(optarg, &to_s) < 0)
+                    usage(argv[0]);
+                break;
+            case 'i':
+                if (parse_ids(optarg, &query.min_id, &query.max_id) < 0)
+                    usage(argv[0]);
+                break;
+            case 's':
+                if (parse_columns(optarg, &query) < 0)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                if (parse_seconds(optarg, &preroll_s) < 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    const int files_count = argc - optind;
+    if (files_count == 0 || files_count > MAX_FILES)
+        usage(argv[0]);
+
+    // Every signal by default
+    if (query.columns_count == 0) {
+        for (int i = 0; i < METRICS_SIGNALS_COUNT; i++)
+            query.columns[query.columns_count++] = &signal_defs[i];
+    }
+
+    for (int i = 0; i < files_count; i++) {
+        const char *path = argv[optind + i];
+        if (open_recording(path, &files[i]) < 0) {
+            if (errno == EINVAL)
+                fprintf(stderr, "%s: not a version %d recording\n", path, RECORDER_VERSION);
+            else
+                fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (files[i].ignored_blocks > 0)
+            fprintf(stderr, "%s: %zu unfinished blocks ignored\n", path, files[i].ignored_blocks);
+        query.blocks_total += files[i].blocks_count;
+    }
+
+    const struct recording *first = NULL;
+    for (int i = 0; i < files_count && first == NULL; i++) {
+        if (files[i].blocks_count > 0)
+            first = &files[i];
+    }
+    if (first == NULL) {
+        fprintf(stderr, "nothing recorded\n");
+        return EXIT_FAILURE;
+    }
+
+    query.session_ns = first->blocks[0].footer.first_ns;
+    query.session_realtime_ns = first->header->realtime_ns + (query.session_ns - first->header->monotonic_ns);
+    query.from_ns = query.session_ns + (uint64_t)(from_s * NS_PER_S);
+    query.to_ns = to_s < 0 ? UINT64_MAX : query.session_ns + (uint64_t)(to_s * NS_PER_S);
+    const uint64_t preroll_ns = (uint64_t)(preroll_s * NS_PER_S);
+    query.preroll_ns = query.from_ns - query.session_ns > preroll_ns ? query.from_ns - preroll_ns : query.session_ns;
+
+    if (query.to_ns < query.from_ns)
+        usage(argv[0]);
+
+    init_metrics(&metrics);
+    print_header(&query);
+
+    bool done = false;
+    for (int i = 0; i < files_count && !done; i++) {
+        const struct recording *file = &files[i];
+        for (size_t b = find_recording_block(file, query.preroll_ns); b < file->blocks_count && !done; b++)
+            done = !query_block(&query, &file->blocks[b]);
+    }
+
+    fprintf(stderr, "%zu frames, %zu of %zu blocks read\n", query.frames, query.blocks_read, query.blocks_total);
+
+    for (int i = 0; i < files_count; i++)
+        close_recording(&files[i]);
+
+    return 0;
+}
@@ -0,0 +1,849 @@
+// STN1110 emulator on a pty, for load and soak tests without a car : answers ATZ, ATE, ATH, ATS, ATL, STFPA, STFCP
+// and STM like the adapter, then streams frames paced to the line rate of the emulated baud rate until any byte
+// is received. Frames are synthetic (every CAN group of signals.h at its rate, encoded from a simple drive) or
+// replayed from recorder files, with optional faults : split reads, garbage bytes, dropped \r and a hang up.
+//
+// stn_emulator [-l link] [-b baud] [-i id:rate_hz ...] [-m rate_mul] [-R] [-r file ...]
+//              [-f fault=probability ...] [-s seed] [-H seconds] [-d seconds] [-v]
+//
+// e.g. stn_emulator -l /tmp/stn -f garbage=0.001 & Mx5MetricsService -s /tmp/stn
+
+#include "../metrics.h"
+#include "../recording.h"
+#include "../monotonic.h"
+#include "../stnobd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define NS_PER_S             UINT64_C(1000000000)
+#define TICK_NS              1000000 // Frames are generated and written every ms
+#define DEFAULT_BAUD         921600  // Same as the service
+#define BITS_PER_BYTE        10      // 8N1
+#define OUT_BUF_SIZE         4096    // Adapter transmit buffer, frames are dropped when it's full
+#define CMD_BUF_SIZE         64
+#define MAX_SOURCES          64
+#define MAX_FILTERS          16
+#define MAX_FILES            64
+#define MAX_GARBAGE_LEN      8
+#define MAX_UNLIMITED_WRITES 64 // Per tick with -b 0 -R
+#define MAX_CATCH_UP_NS      (100 * 1000000ULL) // A source further behind skips ahead instead of bursting
+#define FRAME_MAX_LEN        (CAN_ID_STR_LEN + 1 + 8 * 3 + 2) // With spaces, \r and \n
+
+#define STARTUP_MSG "\r\rELM327 v1.3a\r\r>"
+
+struct source {
+    uint16_t id;
+    double rate_hz;
+    uint64_t next_ns;
+    uint64_t frames;
+};
+
+struct pass_filter {
+    uint16_t pattern;
+    uint16_t mask;
+};
+
+struct faults {
+    double split;              // Per write, only part of the bytes are written, the rest a tick later
+    double garbage;            // Per frame, random bytes before it
+    double drop_cr;            // Per frame, its \r is left out
+};
+
+struct emulator_stats {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t overflows;        // Frames dropped, transmit buffer full
+    uint64_t splits;
+    uint64_t garbage;
+    uint64_t dropped_cr;
+};
+
+struct emulator {
+    int master_fd;
+    int slave_fd;              // Kept open so the master never sees a hang up between clients
+    int timer_fd;
+    // Adapter settings
+    bool echo;
+    bool headers;
+    bool spaces;
+    bool linefeeds;
+    struct pass_filter filters[MAX_FILTERS];
+    int filters_count;
+    bool monitoring;
+    uint64_t monitoring_start_ns;
+    char cmd[CMD_BUF_SIZE];
+    size_t cmd_len;
+    // Transmit buffer, paced by the line rate
+    uint8_t out[OUT_BUF_SIZE];
+    size_t out_len;
+    double bytes_per_ns;       // 0 for no limit
+    double credit;             // Bytes that can be written now
+    uint64_t last_tick_ns;
+    // Synthetic frames
+    struct source sources[MAX_SOURCES];
+    int sources_count;
+    double rate_mul;
+    bool saturate;             // As many frames as the line rate allows, round robin over the sources
+    int next_source;
+    // Recorded frames, looped
+    struct recording files[MAX_FILES];
+    int files_count;
+    int file;
+    size_t block;
+    size_t record;
+    bool replay_started;
+    uint64_t replay_offset_ns; // Recorded timestamp to stream time, modulo 2^64
+    uint64_t last_stream_ns;
+    struct faults faults;
+    struct emulator_stats stats;
+    struct emulator_stats last_stats;   // At the last -v report
+    uint64_t next_report_ns;
+};
+
+static volatile sig_atomic_t stop;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-l link] [-b baud] [-i id:rate_hz ...] [-m rate_mul] [-R] [-r file ...]\n"
+                    "          [-f fault=probability ...] [-s seed] [-H seconds] [-d seconds] [-v]\n"
+                    "  -l  symlink to the pty, its path is printed anyway\n"
+                    "  -b  emulated baud rate, 0 for as fast as the pty goes (default %d)\n"
+                    "  -i  frame rate of a CAN id, adds it if it isn't in signals.h\n"
+                    "  -m  multiplies every rate\n"
+                    "  -R  saturates the line instead\n"
+                    "  -r  replays recorder files at their recorded pace times -m, looping\n"
+                    "  -f  split, garbage or drop_cr fault with its probability\n"
+                    "  -s  random seed of the faults\n"
+                    "  -H  closes the pty that many seconds into monitoring, like an unplugged adapter\n"
+                    "  -d  exits after that many seconds\n"
+                    "  -v  reports rates every second\n",
+            prog, DEFAULT_BAUD);
+    exit(EXIT_FAILURE);
+}
+
+static void handle_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static double random_unit(void) {
+    return (double)random() / ((double)RAND_MAX + 1);
+}
+
+static bool inject(double probability) {
+    return probability > 0 && random_unit() < probability;
+}
+
+static int setup_pty(struct emulator *emu, const char *link) {
+    struct termios tty;
+
+    emu->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (emu->master_fd < 0 || grantpt(emu->master_fd) < 0 || unlockpt(emu->master_fd) < 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+
+    const char *name = ptsname(emu->master_fd);
+    emu->slave_fd = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (emu->slave_fd < 0) {
+        perror("open pty");
+        return -1;
+    }
+
+    // Raw like a serial port, until the client configures it
+    if (tcgetattr(emu->slave_fd, &tty) == 0) {
+        cfmakeraw(&tty);
+        tcsetattr(emu->slave_fd, TCSANOW, &tty);
+    }
+
+    if (link != NULL) {
+        unlink(link);
+        if (symlink(name, link) < 0) {
+            perror("symlink");
+            return -1;
+        }
+    }
+
+    printf("%s\n", name);
+    fflush(stdout);
+
+    return 0;
+}
+
+static struct source *find_source(struct emulator *emu, uint16_t id) {
+    for (int i = 0; i < emu->sources_count; i++) {
+        if (emu->sources[i].id == id)
+            return &emu->sources[i];
+    }
+
+    return NULL;
+}
+
+// id:rate_hz, both hex id and decimal rate
+static int parse_source(const char *opt, struct emulator *emu) {
+    char *end;
+
+    const unsigned long id = strtoul(opt, &end, 16);
+    if (*end != ':' || id > METRICS_MAX_CAN_ID)
+        return -1;
+
+    const double rate_hz = strtod(end + 1, &end);
+    if (*end != '\0' || rate_hz < 0)
+        return -1;
+
+    struct source *source = find_source(emu, id);
+    if (source == NULL) {
+        if (emu->sources_count == MAX_SOURCES)
+            return -1;
+        source = &emu->sources[emu->sources_count++];
+        source->id = id;
+    }
+    source->rate_hz = rate_hz;
+
+    return 0;
+}
+
+static int parse_fault(const char *opt, struct faults *faults) {
+    const char *sep = strchr(opt, '=');
+    char *end;
+
+    if (sep == NULL)
+        return -1;
+
+    const double probability = strtod(sep + 1, &end);
+    if (*end != '\0' || probability < 0 || probability > 1)
+        return -1;
+
+    const size_t key_len = sep - opt;
+    if (strncmp(opt, "split", key_len) == 0 && key_len == strlen("split"))
+        faults->split = probability;
+    else if (strncmp(opt, "garbage", key_len) == 0 && key_len == strlen("garbage"))
+        faults->garbage = probability;
+    else if (strncmp(opt, "drop_cr", key_len) == 0 && key_len == strlen("drop_cr"))
+        faults->drop_cr = probability;
+    else
+        return -1;
+
+    return 0;
+}
+
+// Responses and echo skip the line rate, they're a few bytes
+static void write_now(struct emulator *emu, const char *buf, size_t len) {
+    while (len > 0) {
+        const ssize_t c = write(emu->master_fd, buf, len);
+        if (c < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                perror("write pty");
+            return;
+        }
+        buf += c;
+        len -= c;
+    }
+}
+
+static void respond(struct emulator *emu, const char *rsp) {
+    char buf[CMD_BUF_SIZE + 8];
+    size_t len = 0;
+
+    for (const char *c = rsp; *c != '\0' && len + 2 < sizeof(buf); c++) {
+        buf[len++] = *c;
+        if (*c == '\r' && emu->linefeeds)
+            buf[len++] = '\n';
+    }
+
+    write_now(emu, buf, len);
+}
+
+static void reset_settings(struct emulator *emu) {
+    emu->echo = true;
+    emu->headers = false;
+    emu->spaces = true;
+    emu->linefeeds = false;
+    emu->filters_count = 0;
+}
+
+static bool passes_filters(const struct emulator *emu, uint16_t id) {
+    // No pass filter lets everything through
+    if (emu->filters_count == 0)
+        return true;
+
+    for (int i = 0; i < emu->filters_count; i++) {
+        if ((id & emu->filters[i].mask) == (emu->filters[i].pattern & emu->filters[i].mask))
+            return true;
+    }
+
+    return false;
+}
+
+static void start_monitoring(struct emulator *emu) {
+    const uint64_t now = monotonic_ns();
+
+    emu->monitoring = true;
+    emu->monitoring_start_ns = now;
+    emu->out_len = 0;
+    emu->credit = 0;
+    emu->last_tick_ns = now;
+
+    for (int i = 0; i < emu->sources_count; i++)
+        emu->sources[i].next_ns = now;
+
+    // Recorded frames start right away
+    emu->file = 0;
+    emu->block = 0;
+    emu->record = 0;
+    emu->replay_started = false;
+    emu->last_stream_ns = 0;
+    emu->next_report_ns = now + NS_PER_S;
+
+    fprintf(stderr, "monitoring\n");
+}
+
+static void print_stats(const char *what, const struct emulator_stats *stats, double elapsed_s) {
+    fprintf(stderr, "%s : %" PRIu64 " frames, %.0f frames/s, %.0f bytes/s, %" PRIu64 " overflows, %" PRIu64
+                    " splits, %" PRIu64 " garbage, %" PRIu64 " dropped \\r\n",
+            what, stats->frames, elapsed_s > 0 ? stats->frames / elapsed_s : 0,
+            elapsed_s > 0 ? stats->bytes / elapsed_s : 0, stats->overflows, stats->splits, stats->garbage,
+            stats->dropped_cr);
+}
+
+static void stop_monitoring(struct emulator *emu) {
+    emu->monitoring = false;
+    emu->out_len = 0;
+
+    print_stats("monitoring stopped", &emu->stats, (double)(monotonic_ns() - emu->monitoring_start_ns) / NS_PER_S);
+    respond(emu, "STOPPED\r\r>");
+}
+
+// The client then reads EOF or EIO, the emulator keeps running until -d or a signal
+static void hang_up(struct emulator *emu, const char *link) {
+    print_stats("hung up", &emu->stats, (double)(monotonic_ns() - emu->monitoring_start_ns) / NS_PER_S);
+
+    emu->monitoring = false;
+    emu->out_len = 0;
+    close(emu->master_fd);
+    close(emu->slave_fd);
+    emu->master_fd = -1;
+    emu->slave_fd = -1;
+    if (link != NULL)
+        unlink(link);
+}
+
+static void handle_cmd(struct emulator *emu) {
+    const char *cmd = emu->cmd;
+
+    if (emu->echo) {
+        write_now(emu, emu->cmd, emu->cmd_len);
+        respond(emu, "\r");
+    }
+
+    if (strcmp(cmd, "ATZ") == 0 || strcmp(cmd, "ATWS") == 0) {
+        reset_settings(emu);
+        respond(emu, STARTUP_MSG);
+    }
+    else if (strcmp(cmd, "ATI") == 0)
+        respond(emu, "ELM327 v1.3a\r\r>");
+    else if (strcmp(cmd, "ATE0") == 0 || strcmp(cmd, "ATE1") == 0) {
+        emu->echo = cmd[3] == '1';
+        respond(emu, "OK\r\r>");
+    }
+    else if (strcmp(cmd, "ATH0") == 0 || strcmp(cmd, "ATH1") == 0) {
+        emu->headers = cmd[3] == '1';
+        respond(emu, "OK\r\r>");
+    }
+    else if (strcmp(cmd, "ATS0") == 0 || strcmp(cmd, "ATS1") == 0) {
+        emu->spaces = cmd[3] == '1';
+        respond(emu, "OK\r\r>");
+    }
+    else if (strcmp(cmd, "ATL0") == 0 || strcmp(cmd, "ATL1") == 0) {
+        emu->linefeeds = cmd[3] == '1';
+        respond(emu, "OK\r\r>");
+    }
+    else if (strncmp(cmd, "STFPA", 5) == 0) {
+        char *end;
+        const unsigned long pattern = strtoul(cmd + 5, &end, 16);
+        const unsigned long mask = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+
+        if (*end != '\0' || end == cmd + 5 || emu->filters_count == MAX_FILTERS)
+            respond(emu, "?\r\r>");
+        else {
+            emu->filters[emu->filters_count++] = (struct pass_filter) { .pattern = pattern, .mask = mask };
+            respond(emu, "OK\r\r>");
+        }
+    }
+    else if (strcmp(cmd, "STFCP") == 0) {
+        emu->filters_count = 0;
+        respond(emu, "OK\r\r>");
+    }
+    else if (strcmp(cmd, "STM") == 0 || strcmp(cmd, "ATMA") == 0)
+        start_monitoring(emu);
+    else if (emu->cmd_len == 0)
+        respond(emu, ">");
+    else
+        respond(emu, "?\r\r>");
+}
+
+static int handle_input(struct emulator *emu) {
+    char buf[256];
+
+    const ssize_t c = read(emu->master_fd, buf, sizeof(buf));
+    if (c < 0) {
+        // No client has the pty open, or it's in the middle of reopening it
+        if (errno == EAGAIN || errno == EIO)
+            return 0;
+        perror("read pty");
+        return -1;
+    }
+
+    for (ssize_t i = 0; i < c; i++) {
+        // Any byte stops monitoring, the rest of the read is dropped like the adapter does
+        if (emu->monitoring) {
+            stop_monitoring(emu);
+            emu->cmd_len = 0;
+            break;
+        }
+
+        const char b = buf[i];
+        if (b == '\r') {
+            emu->cmd[emu->cmd_len] = '\0';
+            handle_cmd(emu);
+            emu->cmd_len = 0;
+        }
+        else if (b != ' ' && b != '\n' && emu->cmd_len < sizeof(emu->cmd) - 1)
+            emu->cmd[emu->cmd_len++] = toupper((unsigned char)b);
+    }
+
+    return 0;
+}
+
+// A simple drive : speed sweeps between 10 and 110 km/h every 30s, braking while slowing down
+static void drive_values(double t, int32_t values[METRICS_SIGNALS_COUNT]) {
+    const double phase = 2 * M_PI * t / 30;
+    const double speed_kmh = 60 + 50 * sin(phase);
+    const double slope = cos(phase);
+
+    memset(values, 0, sizeof(values[0]) * METRICS_SIGNALS_COUNT);
+
+    values[SIGNAL_BRAKES_PCT] = slope < 0 ? (int32_t)(-60 * slope) : 0;
+    values[SIGNAL_RPM] = 800 + (int32_t)(speed_kmh * 45);
+    values[SIGNAL_SPEED_KMH] = (int32_t)speed_kmh;
+    values[SIGNAL_ACCELERATOR_PEDAL_POSITION_PCT] = slope > 0 ? (int32_t)(80 * slope) : 0;
+    values[SIGNAL_FL_SPEED_KMH] = (int32_t)speed_kmh;
+    values[SIGNAL_FR_SPEED_KMH] = (int32_t)speed_kmh;
+    values[SIGNAL_RL_SPEED_KMH] = (int32_t)(speed_kmh * 1.02);
+    values[SIGNAL_RR_SPEED_KMH] = (int32_t)(speed_kmh * 1.02);
+    values[SIGNAL_CALCULATED_ENGINE_LOAD_PCT] = 20 + values[SIGNAL_ACCELERATOR_PEDAL_POSITION_PCT] / 2;
+    values[SIGNAL_ENGINE_COOLANT_TEMP_C] = 90;
+    values[SIGNAL_THROTTLE_VALVE_POSITION_PCT] = values[SIGNAL_ACCELERATOR_PEDAL_POSITION_PCT];
+    values[SIGNAL_INTAKE_AIR_TEMP_C] = 30;
+    values[SIGNAL_FUEL_LEVEL_PCT] = 60;
+}
+
+// Inverse of the signals.h decoding
+static void encode_signal(const struct signal_def *def, int32_t value, uint64_t *data) {
+    const int bits = def->width * 8;
+    const int shift = (8 - def->byte - def->width) * 8;
+    const int64_t raw = (int64_t)value * def->div / def->mul - def->offset;
+    const uint64_t mask = UINT64_MAX >> (64 - bits);
+
+    *data = (*data & ~(mask << shift)) | (((uint64_t)raw & mask) << shift);
+}
+
+static uint64_t synthetic_data(const struct emulator *emu, const struct source *source, uint64_t now) {
+    const struct group_def *group = NULL;
+    int32_t values[METRICS_SIGNALS_COUNT];
+    uint64_t data = 0;
+
+    for (int i = 0; i < METRICS_GROUPS_COUNT && group == NULL; i++) {
+        if (group_defs[i].can_id != 0 && group_defs[i].can_id == source->id)
+            group = &group_defs[i];
+    }
+
+    // Ids unknown to signals.h get a counter. Filtered signals are decoded from their raw signal's bytes
+    if (group == NULL)
+        return source->frames;
+
+    drive_values((double)(now - emu->monitoring_start_ns) / NS_PER_S, values);
+    for (int i = 0; i < group->signals_count; i++) {
+        const enum metrics_signal signal = group->signals[i];
+        if (signal_defs[signal].filter.type == FILTER_NONE)
+            encode_signal(&signal_defs[signal], values[signal], &data);
+    }
+
+    return data;
+}
+
+static void emit_frame(struct emulator *emu, uint16_t id, uint64_t data) {
+    static const char hex[] = "0123456789ABCDEF";
+    char frame[MAX_GARBAGE_LEN + FRAME_MAX_LEN];
+    size_t len = 0;
+
+    if (!passes_filters(emu, id))
+        return;
+
+    if (inject(emu->faults.garbage)) {
+        // Printable junk, sometimes with a \r making a line of its own
+        const int garbage_len = 1 + random() % MAX_GARBAGE_LEN;
+        for (int i = 0; i < garbage_len; i++)
+            frame[len++] = random() % 16 == 0 ? '\r' : (char)(' ' + random() % ('~' - ' '));
+        emu->stats.garbage++;
+    }
+
+    if (emu->headers) {
+        frame[len++] = hex[(id >> 8) & 0xf];
+        frame[len++] = hex[(id >> 4) & 0xf];
+        frame[len++] = hex[id & 0xf];
+        if (emu->spaces)
+            frame[len++] = ' ';
+    }
+
+    for (int i = 0; i < 8; i++) {
+        const uint8_t byte = data >> (8 * (7 - i));
+        frame[len++] = hex[byte >> 4];
+        frame[len++] = hex[byte & 0xf];
+        if (emu->spaces && i < 7)
+            frame[len++] = ' ';
+    }
+
+    if (inject(emu->faults.drop_cr))
+        emu->stats.dropped_cr++;
+    else {
+        frame[len++] = '\r';
+        if (emu->linefeeds)
+            frame[len++] = '\n';
+    }
+
+    if (emu->out_len + len > sizeof(emu->out)) {
+        emu->stats.overflows++;
+        return;
+    }
+
+    memcpy(emu->out + emu->out_len, frame, len);
+    emu->out_len += len;
+    emu->stats.frames++;
+}
+
+static void generate_synthetic(struct emulator *emu, uint64_t now) {
+    if (emu->saturate) {
+        // Keeps the transmit buffer topped up with what the line can take
+        while (emu->sources_count > 0 && emu->out_len + FRAME_MAX_LEN <= sizeof(emu->out) &&
+               (emu->bytes_per_ns == 0 || emu->out_len < emu->credit + FRAME_MAX_LEN)) {
+            struct source *source = &emu->sources[emu->next_source];
+            emu->next_source = (emu->next_source + 1) % emu->sources_count;
+            emit_frame(emu, source->id, synthetic_data(emu, source, now));
+            source->frames++;
+        }
+        return;
+    }
+
+    for (int i = 0; i < emu->sources_count; i++) {
+        struct source *source = &emu->sources[i];
+        const double rate_hz = source->rate_hz * emu->rate_mul;
+        if (rate_hz <= 0)
+            continue;
+
+        const uint64_t period_ns = (uint64_t)(NS_PER_S / rate_hz);
+        if (now > source->next_ns + MAX_CATCH_UP_NS)
+            source->next_ns = now;
+
+        while (source->next_ns <= now) {
+            emit_frame(emu, source->id, synthetic_data(emu, source, source->next_ns));
+            source->frames++;
+            source->next_ns += period_ns > 0 ? period_ns : 1;
+        }
+    }
+}
+
+// NULL once every file was played, then it starts over
+static const struct recorder_record *next_record(struct emulator *emu) {
+    while (emu->file < emu->files_count) {
+        const struct recording *file = &emu->files[emu->file];
+
+        if (emu->block < file->blocks_count) {
+            const struct recorder_block *block = &file->blocks[emu->block];
+            if (emu->record < block->footer.count)
+                return &block->records[emu->record];
+
+            emu->block++;
+            emu->record = 0;
+            continue;
+        }
+
+        emu->file++;
+        emu->block = 0;
+    }
+
+    return NULL;
+}
+
+// Recorded frames are due at monitoring_start_ns + stream_ns / rate_mul
+static void generate_recorded(struct emulator *emu, uint64_t now) {
+    while (1) {
+        const struct recorder_record *record = next_record(emu);
+        if (record == NULL) {
+            emu->file = 0;
+            continue;
+        }
+
+        // The first frame starts the stream, a new lap or a file from another boot carries on from the last frame
+        uint64_t stream_ns = record->timestamp_ns + emu->replay_offset_ns;
+        if (!emu->replay_started || stream_ns < emu->last_stream_ns) {
+            emu->replay_offset_ns = emu->last_stream_ns - record->timestamp_ns;
+            stream_ns = emu->last_stream_ns;
+            emu->replay_started = true;
+        }
+
+        if (emu->monitoring_start_ns + (uint64_t)((double)stream_ns / emu->rate_mul) > now)
+            return;
+
+        struct can_msg msg;
+        recording_can_msg(record, &msg);
+        emit_frame(emu, msg.id, msg.data);
+
+        emu->last_stream_ns = stream_ns;
+        emu->record++;
+    }
+}
+
+// Returns the bytes written
+static size_t flush_out(struct emulator *emu) {
+    size_t len = emu->out_len;
+
+    if (emu->bytes_per_ns > 0 && len > emu->credit)
+        len = (size_t)emu->credit;
+
+    if (len > 1 && inject(emu->faults.split)) {
+        len = 1 + random() % (len - 1);
+        emu->stats.splits++;
+    }
+
+    if (len == 0)
+        return 0;
+
+    const ssize_t c = write(emu->master_fd, emu->out, len);
+    if (c < 0) {
+        // The client is late reading, the transmit buffer fills up
+        if (errno != EAGAIN && errno != EIO)
+            perror("write pty");
+        return 0;
+    }
+
+    memmove(emu->out, emu->out + c, emu->out_len - c);
+    emu->out_len -= c;
+    emu->credit -= c;
+    emu->stats.bytes += c;
+
+    return c;
+}
+
+static void handle_tick(struct emulator *emu, bool verbose) {
+    uint64_t expirations;
+
+    if (read(emu->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("read timer_fd");
+
+    if (!emu->monitoring)
+        return;
+
+    const uint64_t now = monotonic_ns();
+
+    // Unused line time isn't saved up for more than a tick
+    if (emu->bytes_per_ns > 0) {
+        emu->credit += (double)(now - emu->last_tick_ns) * emu->bytes_per_ns;
+        if (emu->credit > 2 * TICK_NS * emu->bytes_per_ns)
+            emu->credit = 2 * TICK_NS * emu->bytes_per_ns;
+    }
+    emu->last_tick_ns = now;
+
+    // Without a line rate, as much as the client takes
+    for (int i = 0; i < MAX_UNLIMITED_WRITES; i++) {
+        if (emu->files_count > 0)
+            generate_recorded(emu, now);
+        else
+            generate_synthetic(emu, now);
+
+        if (flush_out(emu) == 0 || emu->bytes_per_ns > 0 || !emu->saturate)
+            break;
+    }
+
+    if (verbose && now >= emu->next_report_ns) {
+        struct emulator_stats delta = emu->stats;
+        delta.frames -= emu->last_stats.frames;
+        delta.bytes -= emu->last_stats.bytes;
+        delta.overflows -= emu->last_stats.overflows;
+        delta.splits -= emu->last_stats.splits;
+        delta.garbage -= emu->last_stats.garbage;
+        delta.dropped_cr -= emu->last_stats.dropped_cr;
+        print_stats("last second", &delta, 1);
+        emu->last_stats = emu->stats;
+        emu->next_report_ns += NS_PER_S;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static struct emulator emu;
+    const char *link = NULL;
+    unsigned long baud = DEFAULT_BAUD;
+    unsigned int seed = 1;
+    double duration_s = 0;
+    double hangup_s = 0;
+    bool verbose = false;
+    char *end;
+    int opt;
+
+    emu.rate_mul = 1;
+
+    // Every CAN group at its signals.h rate
+    for (int i = 0; i < METRICS_GROUPS_COUNT; i++) {
+        if (group_defs[i].can_id == 0)
+            continue;
+        emu.sources[emu.sources_count++] = (struct source) {
+            .id = group_defs[i].can_id,
+            .rate_hz = group_defs[i].rate_hz
+        };
+    }
+
+    while ((opt = getopt(argc, argv, "l:b:i:m:Rr:f:s:H:d:v")) != -1) {
+        switch (opt) {
+            case 'l':
+                link = optarg;
+                break;
+            case 'b':
+                baud = strtoul(optarg, &end, 10);
+                if (*end != '\0')
+                    usage(argv[0]);
+                break;
+            case 'i':
+                if (parse_source(optarg, &emu) < 0)
+                    usage(argv[0]);
+                break;
+            case 'm':
+                emu.rate_mul = strtod(optarg, &end);
+                if (*end != '\0' || emu.rate_mul <= 0)
+                    usage(argv[0]);
+                break;
+            case 'R':
+                emu.saturate = true;
+                break;
+            case 'r':
+                if (emu.files_count == MAX_FILES)
+                    usage(argv[0]);
+                if (open_recording(optarg, &emu.files[emu.files_count]) < 0) {
+                    if (errno == EINVAL)
+                        fprintf(stderr, "%s: not a version %d recording\n", optarg, RECORDER_VERSION);
+                    else
+                        fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+                    return EXIT_FAILURE;
+                }
+                emu.files_count++;
+                break;
+            case 'f':
+                if (parse_fault(optarg, &emu.faults) < 0)
+                    usage(argv[0]);
+                break;
+            case 's':
+                seed = strtoul(optarg, &end, 10);
+                if (*end != '\0')
+                    usage(argv[0]);
+                break;
+            case 'H':
+                hangup_s = strtod(optarg, &end);
+                if (*end != '\0' || hangup_s <= 0)
+                    usage(argv[0]);
+                break;
+            case 'd':
+                duration_s = strtod(optarg, &end);
+                if (*end != '\0' || duration_s < 0)
+                    usage(argv[0]);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind != argc)
+        usage(argv[0]);
+
+    size_t records_count = 0;
+    for (int i = 0; i < emu.files_count; i++)
+        records_count += emu.files[i].records_count;
+    if (emu.files_count > 0 && records_count == 0) {
+        fprintf(stderr, "nothing recorded\n");
+        return EXIT_FAILURE;
+    }
+
+    srandom(seed);
+    emu.bytes_per_ns = (double)baud / BITS_PER_BYTE / NS_PER_S;
+    reset_settings(&emu);
+
+    const struct sigaction sa = { .sa_handler = handle_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (setup_pty(&emu, link) < 0)
+        return EXIT_FAILURE;
+
+    emu.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    const struct itimerspec its = {
+        .it_interval = { .tv_nsec = TICK_NS },
+        .it_value = { .tv_nsec = TICK_NS }
+    };
+    if (emu.timer_fd < 0 || timerfd_settime(emu.timer_fd, 0, &its, NULL) < 0) {
+        perror("timerfd");
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t start_ns = monotonic_ns();
+
+    while (!stop) {
+        // Once hung up master_fd is -1, poll() skips it
+        struct pollfd fds[2] = {
+            { .fd = emu.master_fd, .events = POLLIN },
+            { .fd = emu.timer_fd, .events = POLLIN }
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) && handle_input(&emu) < 0)
+            break;
+
+        if (fds[1].revents & POLLIN)
+            handle_tick(&emu, verbose);
+
+        if (hangup_s > 0 && emu.monitoring &&
+            monotonic_ns() - emu.monitoring_start_ns >= (uint64_t)(hangup_s * NS_PER_S))
+            hang_up(&emu, link);
+
+        if (duration_s > 0 && monotonic_ns() - start_ns >= (uint64_t)(duration_s * NS_PER_S))
+            break;
+    }
+
+    print_stats("total", &emu.stats, (double)(monotonic_ns() - start_ns) / NS_PER_S);
+
+    if (link != NULL)
+        unlink(link);
+    for (int i = 0; i < emu.files_count; i++)
+        close_recording(&emu.files[i]);
+
+    return 0;
+}